@@ -5,9 +5,24 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dropbox_proto.h"
 
 #define BUF_SIZE 8192
 #define PROGRESS_BAR_WIDTH 50
+#define PROTO_VERSION 2
+#define STRIPES_DEFAULT 4
+#define STRIPES_MAX 16
+#define STRIPE_MIN (1L << 20)
 
 
 #define COLOR_RESET   "\033[0m"
@@ -32,10 +47,15 @@ void print_menu() {
     printf("┌──────────────────────────────────────────────────────────────┐\n");
     printf("│                         MAIN MENU                            │\n");
     printf("├──────────────────────────────────────────────────────────────┤\n");
-    printf("│      UPLOAD   - Upload file to cloud storage                 │\n");
-    printf("│      DOWNLOAD - Download file from storage                   │\n");
+    printf("│      UPLOAD   - Upload files, globs or a whole directory     │\n");
+    printf("│      DOWNLOAD - Download file(s), patterns like *.csv work   │\n");
+    printf("│      RESUME   - Continue an interrupted upload               │\n");
+    printf("│      SYNC     - Upload only the changes to a stored file     │\n");
     printf("│      DELETE   - Remove file from storage                     │\n");
     printf("│      LIST     - View all your files                          │\n");
+    printf("│      STAT     - Show the size and crc32c of one file         │\n");
+    printf("│      SUPLOAD  - Upload one big file over N connections       │\n");
+    printf("│      SDOWNLOAD- Download one big file over N connections     │\n");
     printf("│      EXIT     - Quit application                             │\n");
     printf("└──────────────────────────────────────────────────────────────┘\n");
     printf("%s", COLOR_RESET);
@@ -84,6 +104,50 @@ int send_all(int sock, const void *buf, size_t len) {
     return 0;
 }
 
+// Protocol version agreed with the server; 1 means the legacy EOF-marker framing
+static int proto_version = 1;
+
+// Kept from the login so striped transfers can open more connections
+static struct sockaddr_in server_addr;
+static char login_user[64], login_pass[64];
+
+ssize_t recv_line(int sock, char *buf, size_t maxlen) {
+    size_t idx = 0;
+    while (idx + 1 < maxlen) {
+        char c;
+        ssize_t r = recv(sock, &c, 1, 0);
+        if (r == 0) return 0;
+        if (r < 0) return -1;
+        if (c == '\n') break;
+        if (c != '\r') buf[idx++] = c;
+    }
+    buf[idx] = '\0';
+    return (ssize_t)idx;
+}
+
+int recv_exact(int sock, void *buf, size_t n) {
+    char *p = buf;
+    size_t left = n;
+    while (left > 0) {
+        ssize_t r = recv(sock, p, left, 0);
+        if (r <= 0) return -1;
+        p += r;
+        left -= r;
+    }
+    return 0;
+}
+
+void negotiate_protocol(int sock) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "PROTO %d\n", PROTO_VERSION);
+    send_all(sock, buf, strlen(buf));
+    // Servers that predate PROTO answer with an ERR line, keep protocol 1 then
+    if (recv_line(sock, buf, sizeof(buf)) > 0 && strncmp(buf, "OK PROTO ", 9) == 0) {
+        proto_version = atoi(buf + 9);
+        if (proto_version < 1) proto_version = 1;
+    }
+}
+
 void send_file(int sock, const char *filename) {
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
@@ -166,6 +230,865 @@ void receive_file(int sock, const char *filename) {
     }
 }
 
+// Whether a reply line ends in the LZ flag (dropbox_proto.h)
+static int has_lz_flag(const char *line) {
+    size_t n = strlen(line);
+    return n >= 3 && strcmp(line + n - 3, " LZ") == 0;
+}
+
+// CRC-32C of the first size bytes of fd, as the server keeps it per file
+static int file_crc32c(int fd, long size, uint32_t *crc) {
+    static unsigned char buf[1 << 20];
+    uint32_t c = 0;
+    for (long off = 0; off < size;) {
+        ssize_t n = pread(fd, buf, size - off < (long)sizeof(buf) ? (size_t)(size - off) : sizeof(buf), off);
+        if (n <= 0) return -1;
+        c = crc32c(c, buf, (size_t)n);
+        off += n;
+    }
+    *crc = c;
+    return 0;
+}
+
+// The checksum in a whole-file reply, "OK <size> <crc>[ LZ]"; servers
+// leave it out for files they have no checksum of
+static int reply_crc(const char *line, uint32_t *crc) {
+    long size;
+    char word[16], *end;
+    if (sscanf(line, "OK %ld %15s", &size, word) != 2 || strlen(word) != 8) return -1;
+    *crc = (uint32_t)strtoul(word, &end, 16);
+    return *end ? -1 : 0;
+}
+
+// Compares the local copy with the checksum the server reported
+static void verify_crc(const char *reply, int fd, long size) {
+    uint32_t theirs, ours;
+    char msg[96];
+    if (reply_crc(reply, &theirs) != 0) return;
+    if (file_crc32c(fd, size, &ours) != 0) {
+        print_error("Cannot read the local copy back");
+    } else if (ours != theirs) {
+        snprintf(msg, sizeof(msg), "Checksum mismatch: local crc32c %08x, server %08x", ours, theirs);
+        print_error(msg);
+    } else {
+        snprintf(msg, sizeof(msg), "crc32c %08x verified", ours);
+        print_info(msg);
+    }
+}
+
+// Asks for compression only if the start of the file looks compressible
+static int file_worth_lz(FILE *fp) {
+    unsigned char sample[LZ_SAMPLE];
+    ssize_t n = pread(fileno(fp), sample, sizeof(sample), 0);
+    return n > 0 && lz_sample_compressible(sample, (size_t)n);
+}
+
+// Sends len bytes of fp as LZ frames; returns the bytes put on the wire or -1
+static long send_lz_frames(int sock, FILE *fp, long len, long done, long file_size) {
+    static unsigned char block[LZ_BLOCK_MAX], frame[LZ_FRAME_HDR + LZ_BLOCK_MAX];
+    long wire = 0;
+    int misses = 0;
+    while (len > 0) {
+        size_t n = len < LZ_BLOCK_MAX ? (size_t)len : LZ_BLOCK_MAX;
+        if (fread(block, 1, n, fp) != n) return -1;
+        size_t f = lz_frame(block, n, frame, misses < LZ_GIVE_UP);
+        misses = f == LZ_FRAME_HDR + n ? misses + 1 : 0;
+        if (send_all(sock, frame, f) < 0) return -1;
+        wire += f;
+        len -= n;
+        done += n;
+        show_progress(done, file_size, "Uploading");
+    }
+    return wire;
+}
+
+// Streams filename from the offset in the server's "READY <id> <offset>" reply
+// and waits for the final status
+static void upload_body(int sock, FILE *fp, const char *filename, long file_size, const char *ready) {
+    char upload_id[32] = "";
+    long offset = 0;
+    sscanf(ready, "READY %31s %ld", upload_id, &offset);
+    if (offset < 0 || offset > file_size || fseek(fp, offset, SEEK_SET) != 0) {
+        print_error("Server asked for an invalid offset");
+        shutdown(sock, SHUT_RDWR);
+        return;
+    }
+
+    if (offset > 0) printf("Resuming %s at byte %ld of %ld...\n", filename, offset, file_size);
+    else printf("Uploading %s (%ld bytes)...\n", filename, file_size);
+    if (upload_id[0]) printf("Upload id %s (RESUME %s %s continues it if interrupted)\n", upload_id, upload_id, filename);
+
+    char buffer[BUF_SIZE];
+    long total_sent = offset;
+    size_t bytes;
+
+    if (has_lz_flag(ready)) {
+        long wire = send_lz_frames(sock, fp, file_size - offset, offset, file_size);
+        if (wire < 0) {
+            print_error("File changed during upload");
+            shutdown(sock, SHUT_RDWR);
+            return;
+        }
+        total_sent = file_size;
+        snprintf(buffer, sizeof(buffer), "Compressed %ld bytes to %ld on the wire", file_size - offset, wire);
+        print_info(buffer);
+    }
+
+    while (total_sent < file_size && (bytes = fread(buffer, 1, BUF_SIZE, fp)) > 0) {
+        if (total_sent + (long)bytes > file_size) bytes = file_size - total_sent;
+        if (send_all(sock, buffer, bytes) < 0) {
+            print_error("Upload failed");
+            return;
+        }
+        total_sent += bytes;
+        show_progress(total_sent, file_size, "Uploading");
+    }
+
+    if (total_sent != file_size) {
+        // The file shrank while we were sending; the framing is lost, so give up on the connection
+        print_error("File changed during upload");
+        shutdown(sock, SHUT_RDWR);
+        return;
+    }
+
+    char line[BUF_SIZE];
+    if (recv_line(sock, line, sizeof(line)) > 0 && strncmp(line, "OK", 2) == 0) {
+        print_success("File uploaded successfully");
+        verify_crc(line, fileno(fp), file_size);
+    } else {
+        print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : "Upload failed");
+    }
+}
+
+// Buffered reader for batch replies. They can arrive while the batch is
+// still being sent, and MDOWNLOAD mixes reply lines with file data.
+typedef struct ReplyReader {
+    char buf[65536];
+    size_t off, len;
+} ReplyReader;
+
+// Reads more into rr; with block 0 only what has already arrived
+static int reply_fill(int sock, ReplyReader *rr, int block) {
+    if (rr->off > 0) {
+        memmove(rr->buf, rr->buf + rr->off, rr->len - rr->off);
+        rr->len -= rr->off;
+        rr->off = 0;
+    }
+    if (rr->len == sizeof(rr->buf)) return -1;
+    ssize_t n = recv(sock, rr->buf + rr->len, sizeof(rr->buf) - rr->len, block ? 0 : MSG_DONTWAIT);
+    if (n == 0) return -1;
+    if (n < 0) return !block && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    rr->len += n;
+    return 0;
+}
+
+// Returns 1 with the next line in line, 0 if none is complete yet (only
+// without block), -1 once the connection is gone
+static int reply_line(int sock, ReplyReader *rr, char *line, size_t cap, int block) {
+    for (;;) {
+        char *start = rr->buf + rr->off;
+        char *nl = memchr(start, '\n', rr->len - rr->off);
+        if (nl) {
+            size_t n = nl - start < (long)cap ? (size_t)(nl - start) : cap - 1;
+            memcpy(line, start, n);
+            line[n] = '\0';
+            if (n > 0 && line[n-1] == '\r') line[n-1] = '\0';
+            rr->off = nl - rr->buf + 1;
+            return 1;
+        }
+        size_t had = rr->len - rr->off;
+        if (reply_fill(sock, rr, block) < 0) return -1;
+        if (!block && rr->len - rr->off == had) return 0;
+    }
+}
+
+// Reads exactly n bytes, starting with whatever is buffered
+static int reply_read(int sock, ReplyReader *rr, void *out, size_t n) {
+    size_t have = rr->len - rr->off < n ? rr->len - rr->off : n;
+    memcpy(out, rr->buf + rr->off, have);
+    rr->off += have;
+    return recv_exact(sock, (char *)out + have, n - have);
+}
+
+// Splits "#<index> <reply>" of a batch; returns the index or -1
+static int batch_reply(char *line, int count, char **reply) {
+    int index;
+    if (line[0] != '#' || sscanf(line + 1, "%d", &index) != 1 || index < 0 || index >= count) return -1;
+    char *sp = strchr(line, ' ');
+    *reply = sp ? sp + 1 : "";
+    return index;
+}
+
+static void add_path(char ***paths, int *count, int *cap, const char *path) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        char **np = realloc(*paths, *cap * sizeof(char *));
+        if (!np) return;
+        *paths = np;
+    }
+    char *dup = strdup(path);
+    if (dup) (*paths)[(*count)++] = dup;
+}
+
+// Expands upload arguments: glob patterns, and directories to the regular
+// files directly inside them (stored under their own names, as storage
+// has no subdirectories)
+static char **expand_upload_args(char **args, int nargs, int *count) {
+    char **paths = NULL;
+    int cap = 0;
+    *count = 0;
+    for (int i = 0; i < nargs; i++) {
+        glob_t g;
+        if (glob(args[i], GLOB_NOCHECK | GLOB_TILDE, NULL, &g) != 0) continue;
+        for (size_t k = 0; k < g.gl_pathc; k++) {
+            struct stat st;
+            const char *path = g.gl_pathv[k];
+            if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) { add_path(&paths, count, &cap, path); continue; }
+            DIR *d = opendir(path);
+            struct dirent *e;
+            while (d && (e = readdir(d)) != NULL) {
+                char full[PATH_MAX];
+                if (e->d_name[0] == '.') continue;
+                snprintf(full, sizeof(full), "%s/%s", path, e->d_name);
+                if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) add_path(&paths, count, &cap, full);
+            }
+            if (d) closedir(d);
+        }
+        globfree(&g);
+    }
+    return paths;
+}
+
+static void batch_print_result(const char *name, const char *reply, int *ok) {
+    if (strncmp(reply, "OK", 2) == 0) (*ok)++;
+    else printf("%s%s: %s%s\n", COLOR_RED, name, strncmp(reply, "ERR ", 4) == 0 ? reply + 4 : reply, COLOR_RESET);
+}
+
+// MUPLOAD: every file goes out back to back as "<name> <size> [LZ]" and
+// its body, while the per-file replies are picked up in between, so a batch
+// of small files costs about one round trip in total
+void send_files_batch(int sock, char **args, int nargs) {
+    int count;
+    char **paths = expand_upload_args(args, nargs, &count);
+    char line[BUF_SIZE], buffer[BUF_SIZE];
+    if (count == 0) { print_error("No files to upload"); free(paths); return; }
+
+    ReplyReader *rr = calloc(1, sizeof(ReplyReader));
+    if (!rr) { print_error("Out of memory"); return; }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    snprintf(line, sizeof(line), "MUPLOAD %d\n", count);
+    int failed = send_all(sock, line, strlen(line)) < 0;
+    int ok = 0, replies = 0;
+    long total = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        const char *name = strrchr(paths[i], '/') ? strrchr(paths[i], '/') + 1 : paths[i];
+        FILE *fp = fopen(paths[i], "rb");
+        struct stat st;
+        if (!fp || fstat(fileno(fp), &st) != 0) {
+            // The slot is already announced: an invalid name fills it
+            printf("%s%s: cannot read%s\n", COLOR_RED, paths[i], COLOR_RESET);
+            if (fp) fclose(fp);
+            failed = send_all(sock, ". 0\n", 4) < 0;
+            continue;
+        }
+        long size = (long)st.st_size;
+        int lz = file_worth_lz(fp);
+        snprintf(line, sizeof(line), "%s %ld%s\n", name, size, lz ? " LZ" : "");
+        failed = send_all(sock, line, strlen(line)) < 0;
+        if (!failed && lz) {
+            failed = send_lz_frames(sock, fp, size, 0, 0) < 0;
+        } else {
+            long sent = 0;
+            size_t bytes;
+            while (!failed && sent < size && (bytes = fread(buffer, 1, BUF_SIZE, fp)) > 0) {
+                if (sent + (long)bytes > size) bytes = size - sent;
+                failed = send_all(sock, buffer, bytes) < 0;
+                sent += bytes;
+            }
+            failed = failed || sent != size;
+        }
+        fclose(fp);
+        total += size;
+        char *reply;
+        int index;
+        while (!failed && reply_line(sock, rr, line, sizeof(line), 0) == 1) {
+            if ((index = batch_reply(line, count, &reply)) < 0) continue;
+            batch_print_result(paths[index], reply, &ok);
+            replies++;
+        }
+    }
+    if (failed) {
+        // The stream cannot be framed any more
+        print_error("Upload failed");
+        shutdown(sock, SHUT_RDWR);
+    }
+
+    // The untagged "OK <count>" comes after every file's reply
+    while (!failed && reply_line(sock, rr, line, sizeof(line), 1) == 1 && line[0] == '#') {
+        char *reply;
+        int index = batch_reply(line, count, &reply);
+        if (index >= 0) { batch_print_result(paths[index], reply, &ok); replies++; }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (replies < count) print_error("Connection lost before all uploads were confirmed");
+    snprintf(line, sizeof(line), "%d of %d files uploaded (%ld bytes in %.2fs)", ok, count, total, secs);
+    if (ok == count) print_success(line);
+    else print_error(line);
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    free(rr);
+}
+
+// MDOWNLOAD: the server names the files matching the patterns, then sends
+// them as tagged downloads interleaved in frames
+void receive_files_batch(int sock, char **patterns, int npatterns) {
+    char line[BUF_SIZE];
+    size_t len = snprintf(line, sizeof(line), "MDOWNLOAD");
+    for (int i = 0; i < npatterns && len < sizeof(line); i++) len += snprintf(line + len, sizeof(line) - len, " %s", patterns[i]);
+    if (len + 1 >= sizeof(line)) { print_error("Too many patterns"); return; }
+    line[len++] = '\n';
+    send_all(sock, line, len);
+
+    ReplyReader *rr = calloc(1, sizeof(ReplyReader));
+    int count = -1;
+    if (!rr) { print_error("Out of memory"); return; }
+    if (reply_line(sock, rr, line, sizeof(line), 1) != 1 || sscanf(line, "FILES %d", &count) != 1 || count < 0) {
+        print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : "Download failed");
+        free(rr);
+        return;
+    }
+    char **names = calloc(count + 1, sizeof(char *));
+    FILE **fps = calloc(count + 1, sizeof(FILE *));
+    long *left = calloc(count + 1, sizeof(long));
+    int ok = 0, lost = !names || !fps || !left;
+    long total = 0;
+    for (int i = 0; i < count && !lost; i++) {
+        lost = reply_line(sock, rr, line, sizeof(line), 1) != 1;
+        if (!lost) names[i] = strdup(line);
+    }
+
+    static char data[65536];
+    while (!lost && (lost = reply_line(sock, rr, line, sizeof(line), 1) != 1) == 0 && line[0] == '#') {
+        char *reply;
+        int index = batch_reply(line, count, &reply);
+        long n;
+        if (index < 0) continue;
+        if (sscanf(reply, "DATA %ld", &n) == 1) {
+            // Written even if the file could not be created, to stay in sync
+            while (!lost && n > 0) {
+                size_t want = n < (long)sizeof(data) ? (size_t)n : sizeof(data);
+                lost = reply_read(sock, rr, data, want) < 0;
+                if (!lost && fps[index] && fwrite(data, 1, want, fps[index]) != want) { fclose(fps[index]); fps[index] = NULL; }
+                n -= want;
+                left[index] -= want;
+                total += want;
+            }
+        } else if (strncmp(reply, "OK ", 3) == 0) {
+            left[index] = atol(reply + 3);
+            fps[index] = fopen(names[index], "wb");
+            if (!fps[index]) printf("%s%s: cannot create%s\n", COLOR_RED, names[index], COLOR_RESET);
+        } else {
+            batch_print_result(names[index], reply, &ok);
+            continue;
+        }
+        if (fps[index] && left[index] == 0) {
+            if (fclose(fps[index]) == 0) ok++;
+            fps[index] = NULL;
+        }
+    }
+    if (lost) print_error("Connection lost during download");
+    for (int i = 0; i < count; i++) {
+        if (fps && fps[i]) fclose(fps[i]);
+        if (names) free(names[i]);
+    }
+    snprintf(line, sizeof(line), "%d of %d files downloaded (%ld bytes)", ok, count, total);
+    if (count == 0) print_info("No stored file matches");
+    else if (ok == count) print_success(line);
+    else print_error(line);
+    free(names);
+    free(fps);
+    free(left);
+    free(rr);
+}
+
+// Protocol 2 upload: "UPLOAD <name> <size>" (or "RESUME <id>" when upload_id
+// is given), wait for READY, then send the rest of the file
+void send_file_framed(int sock, const char *filename, const char *upload_id) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        print_error("File not found");
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) {
+        print_error("Cannot stat file");
+        fclose(fp);
+        return;
+    }
+    long file_size = (long)st.st_size;
+
+    char line[BUF_SIZE];
+    uint32_t theirs, ours;
+    if (!upload_id) {
+        // Nothing to send if the server already has exactly these bytes
+        snprintf(line, sizeof(line), "STAT %s\n", filename);
+        send_all(sock, line, strlen(line));
+        if (recv_line(sock, line, sizeof(line)) > 0 && atol(line + 3) == file_size && reply_crc(line, &theirs) == 0 &&
+            file_crc32c(fileno(fp), file_size, &ours) == 0 && ours == theirs) {
+            print_info("The server copy is identical (same size and crc32c), nothing to upload");
+            fclose(fp);
+            return;
+        }
+    }
+    const char *lz = file_worth_lz(fp) ? " LZ" : "";
+    if (upload_id) snprintf(line, sizeof(line), "RESUME %s%s\n", upload_id, lz);
+    else snprintf(line, sizeof(line), "UPLOAD %s %ld%s\n", filename, file_size, lz);
+    send_all(sock, line, strlen(line));
+
+    if (recv_line(sock, line, sizeof(line)) <= 0) {
+        print_error("No response from server");
+    } else if (strncmp(line, "READY", 5) != 0) {
+        print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : line);
+    } else {
+        upload_body(sock, fp, filename, file_size, line);
+    }
+    fclose(fp);
+}
+
+// Sends one delta instruction
+static int send_delta_op(int sock, char op, uint32_t arg) {
+    unsigned char rec[5];
+    rec[0] = (unsigned char)op;
+    put_u32(rec + 1, arg);
+    return send_all(sock, rec, op == DELTA_OP_END ? 1 : sizeof(rec));
+}
+
+static int send_delta_literal(int sock, const unsigned char *data, size_t len) {
+    if (len == 0) return 0;
+    if (send_delta_op(sock, DELTA_OP_LITERAL, (uint32_t)len) < 0) return -1;
+    return send_all(sock, data, len);
+}
+
+// Finds a block of the server's copy equal to data[0..bs), or -1. Blocks are
+// chained by weak checksum; the strong hash is only computed on a weak hit.
+static long delta_match(const unsigned char *sigs, const long *heads, const long *next, size_t mask,
+                        uint32_t weak, const unsigned char *data, size_t bs) {
+    unsigned char digest[32];
+    int have_digest = 0;
+    for (long i = heads[weak & mask]; i >= 0; i = next[i]) {
+        const unsigned char *sig = sigs + (size_t)i * DELTA_SIG_SIZE;
+        if (get_u32(sig) != weak) continue;
+        if (!have_digest) {
+            Sha256 c;
+            sha256_init(&c);
+            sha256_update(&c, data, bs);
+            sha256_final(&c, digest);
+            have_digest = 1;
+        }
+        if (memcmp(sig + 4, digest, DELTA_STRONG_LEN) == 0) return i;
+    }
+    return -1;
+}
+
+// Protocol 2 delta upload: fetch the signatures of the server's copy, then
+// send blocks it already has as references and everything else as literals
+void send_file_delta(int sock, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        print_error("File not found");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    const unsigned char *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) { print_error("Cannot read file"); close(fd); return; }
+    }
+
+    char line[BUF_SIZE];
+    snprintf(line, sizeof(line), "DELTA_UPLOAD %s %zu\n", filename, size);
+    send_all(sock, line, strlen(line));
+
+    size_t bs = 0, count = 0, base_size = 0;
+    unsigned char *sigs = NULL;
+    long *heads = NULL, *next = NULL;
+    size_t mask = 0;
+    if (recv_line(sock, line, sizeof(line)) <= 0) {
+        print_error("No response from server");
+        goto out;
+    }
+    if (sscanf(line, "SIGS %zu %zu %zu", &bs, &count, &base_size) != 3 || bs == 0 || bs > DELTA_MAX_BLOCK) {
+        print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : "Unexpected response from server");
+        goto out;
+    }
+    sigs = malloc(count ? count * DELTA_SIG_SIZE : 1);
+    while ((mask + 1) < count * 2 || mask < 255) mask = mask * 2 + 1;
+    heads = malloc((mask + 1) * sizeof(long));
+    next = malloc((count ? count : 1) * sizeof(long));
+    if (!sigs || !heads || !next || recv_exact(sock, sigs, count * DELTA_SIG_SIZE) < 0) {
+        // The instruction stream can no longer be framed
+        print_error("Cannot receive block signatures");
+        shutdown(sock, SHUT_RDWR);
+        goto out;
+    }
+    for (size_t i = 0; i <= mask; i++) heads[i] = -1;
+    for (size_t i = count; i-- > 0;) {
+        uint32_t weak = get_u32(sigs + i * DELTA_SIG_SIZE);
+        next[i] = heads[weak & mask];
+        heads[weak & mask] = (long)i;
+    }
+
+    printf("Syncing %s (%zu bytes) against the server's %zu bytes...\n", filename, size, base_size);
+    size_t pos = 0, lit = 0, literal_bytes = 0, reused = 0, shown = 0;
+    int failed = 0;
+    RollSum rs = {0};
+    if (count && size >= bs) rollsum_init(&rs, data, bs);
+    while (!failed && count && pos + bs <= size) {
+        long idx = delta_match(sigs, heads, next, mask, rollsum_digest(&rs), data + pos, bs);
+        if (idx >= 0) {
+            failed = send_delta_literal(sock, data + lit, pos - lit) < 0 ||
+                     send_delta_op(sock, DELTA_OP_COPY, (uint32_t)idx) < 0;
+            literal_bytes += pos - lit;
+            reused++;
+            pos += bs;
+            lit = pos;
+            if (pos + bs <= size) rollsum_init(&rs, data + pos, bs);
+        } else {
+            if (pos + bs < size) rollsum_rotate(&rs, data[pos], data[pos + bs]);
+            pos++;
+        }
+        // Keep literals bounded so the server can stream them
+        if (!failed && pos - lit >= (1u << 20)) {
+            failed = send_delta_literal(sock, data + lit, pos - lit) < 0;
+            literal_bytes += pos - lit;
+            lit = pos;
+        }
+        if (pos - shown >= (1u << 20)) { show_progress((long)pos, (long)size, "Syncing"); shown = pos; }
+    }
+    if (!failed) {
+        failed = send_delta_literal(sock, data + lit, size - lit) < 0 || send_delta_op(sock, DELTA_OP_END, 0) < 0;
+        literal_bytes += size - lit;
+    }
+    if (failed) {
+        print_error("Upload failed");
+        goto out;
+    }
+    show_progress((long)size, (long)size, "Syncing");
+
+    if (recv_line(sock, line, sizeof(line)) > 0 && strncmp(line, "OK", 2) == 0) {
+        printf("Sent %zu new bytes, reused %zu blocks of %zu bytes\n", literal_bytes, reused, bs);
+        print_success("File synced successfully");
+        verify_crc(line, fd, (long)size);
+    } else {
+        print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : "Sync failed");
+    }
+
+out:
+    free(sigs);
+    free(heads);
+    free(next);
+    if (data) munmap((void *)data, size);
+    close(fd);
+}
+
+// Receives the LZ frames of a len byte download into fp (NULL to only
+// drain them); returns the raw bytes received, which is short on failure
+static long recv_lz_frames(int sock, FILE *fp, long len, int *write_failed) {
+    static unsigned char frame[LZ_BLOCK_MAX], block[LZ_BLOCK_MAX];
+    long done = 0, wire = 0;
+    while (done < len) {
+        unsigned char hdr[LZ_FRAME_HDR];
+        if (recv_exact(sock, hdr, sizeof(hdr)) < 0) break;
+        uint32_t raw = get_u32(hdr), clen = get_u32(hdr + 4);
+        if (raw == 0 || raw > LZ_BLOCK_MAX || raw > len - done || clen == 0 || clen > raw) break;
+        if (recv_exact(sock, frame, clen) < 0) break;
+        const unsigned char *data = frame;
+        if (clen < raw) {
+            if (lz_decompress(frame, clen, block, raw) != 0) break;
+            data = block;
+        }
+        if (fp && !*write_failed && fwrite(data, 1, raw, fp) != raw) *write_failed = 1;
+        done += raw;
+        wire += LZ_FRAME_HDR + clen;
+        if (fp) show_progress(done, len, "Downloading");
+    }
+    if (done == len && len > 0) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Received %ld bytes as %ld on the wire", len, wire);
+        print_info(msg);
+    }
+    return done;
+}
+
+// Protocol 2 download: the server answers "OK <size>" followed by exactly
+// <size> bytes, or by LZ frames if it adds "LZ". With a range
+// ("<offset> [<len>]") the bytes are written at that offset of the local
+// file, so an interrupted download can be finished.
+void receive_file_framed(int sock, const char *filename, const char *range) {
+    char line[BUF_SIZE];
+    if (range) snprintf(line, sizeof(line), "DOWNLOAD %s %s LZ\n", filename, range);
+    else snprintf(line, sizeof(line), "DOWNLOAD %s LZ\n", filename);
+    send_all(sock, line, strlen(line));
+
+    if (recv_line(sock, line, sizeof(line)) <= 0) {
+        print_error("No response from server");
+        return;
+    }
+    if (strncmp(line, "OK ", 3) != 0) {
+        print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : "Download failed");
+        return;
+    }
+    long file_size = atol(line + 3);
+    long offset = range ? atol(range) : 0;
+
+    FILE *fp = NULL;
+    if (range) {
+        fp = fopen(filename, "r+b");
+        if (!fp) fp = fopen(filename, "wb");
+        if (fp && fseek(fp, offset, SEEK_SET) != 0) { fclose(fp); fp = NULL; }
+    } else {
+        fp = fopen(filename, "w+b");   // read back for the checksum
+    }
+    if (!fp) {
+        print_error("Cannot create file");
+    } else if (range) {
+        printf("Downloading %s bytes %ld-%ld...\n", filename, offset, offset + file_size);
+    } else {
+        printf("Downloading %s (%ld bytes)...\n", filename, file_size);
+    }
+
+    // The payload is always drained so the connection stays usable
+    char buffer[BUF_SIZE];
+    long total_received = 0;
+    int write_failed = (fp == NULL);
+    if (has_lz_flag(line)) {
+        total_received = recv_lz_frames(sock, fp, file_size, &write_failed);
+        // A broken frame stream cannot be resynchronised
+        if (total_received != file_size) shutdown(sock, SHUT_RDWR);
+    }
+    while (!has_lz_flag(line) && total_received < file_size) {
+        size_t want = file_size - total_received < BUF_SIZE ? (size_t)(file_size - total_received) : BUF_SIZE;
+        ssize_t bytes = recv(sock, buffer, want, 0);
+        if (bytes <= 0) break;
+        if (!write_failed && fwrite(buffer, 1, bytes, fp) != (size_t)bytes) write_failed = 1;
+        total_received += bytes;
+        if (fp) show_progress(total_received, file_size, "Downloading");
+    }
+    if (fp && fflush(fp) != 0) write_failed = 1;
+
+    if (total_received == file_size && !write_failed) {
+        print_success("File downloaded successfully");
+        if (!range) verify_crc(line, fileno(fp), file_size);
+    } else if (fp) {
+        print_error("Download failed");
+    }
+    if (fp) fclose(fp);
+}
+
+// One stripe of a striped transfer, run on its own connection
+typedef struct Stripe {
+    pthread_t thread;
+    const char *filename;
+    const char *upload_id;   // NULL for downloads
+    int fd;                  // local file, shared by all stripes
+    long offset, len;
+    int ok;
+    char err[128];
+} Stripe;
+
+// Opens another connection to the server and logs in like the first one
+static int stripe_connect(char *err, size_t cap) {
+    char line[BUF_SIZE] = "";
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        snprintf(err, cap, "Connection failed");
+        if (sock >= 0) close(sock);
+        return -1;
+    }
+    snprintf(line, sizeof(line), "PROTO %d\nLOGIN %s %s\n", PROTO_VERSION, login_user, login_pass);
+    send_all(sock, line, strlen(line));
+    if (recv_line(sock, line, sizeof(line)) <= 0 || strncmp(line, "OK PROTO ", 9) != 0 ||
+        recv_line(sock, line, sizeof(line)) <= 0 || strncmp(line, "OK", 2) != 0) {
+        snprintf(err, cap, "%.120s", strncmp(line, "ERR ", 4) == 0 ? line + 4 : "Login failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void *stripe_upload(void *arg) {
+    Stripe *st = arg;
+    char line[BUF_SIZE] = "";
+    int sock = stripe_connect(st->err, sizeof(st->err));
+    if (sock < 0) return NULL;
+    snprintf(line, sizeof(line), "STRIPE %s %ld %ld\n", st->upload_id, st->offset, st->len);
+    send_all(sock, line, strlen(line));
+    if (recv_line(sock, line, sizeof(line)) <= 0 || strncmp(line, "READY", 5) != 0) {
+        snprintf(st->err, sizeof(st->err), "%.120s", strncmp(line, "ERR ", 4) == 0 ? line + 4 : "No response from server");
+        close(sock);
+        return NULL;
+    }
+    off_t off = st->offset;
+    long left = st->len;
+    while (left > 0) {
+        ssize_t n = sendfile(sock, st->fd, &off, (size_t)left);
+        if (n <= 0) break;
+        left -= n;
+    }
+    if (left > 0) snprintf(st->err, sizeof(st->err), "Upload failed");
+    else if (recv_line(sock, line, sizeof(line)) > 0 && strncmp(line, "OK", 2) == 0) st->ok = 1;
+    else snprintf(st->err, sizeof(st->err), "%.120s", strncmp(line, "ERR ", 4) == 0 ? line + 4 : "Upload failed");
+    close(sock);
+    return NULL;
+}
+
+static void *stripe_download(void *arg) {
+    Stripe *st = arg;
+    static __thread char buffer[256 * 1024];
+    char line[BUF_SIZE] = "";
+    int sock = stripe_connect(st->err, sizeof(st->err));
+    if (sock < 0) return NULL;
+    // Plain ranged DOWNLOAD; no LZ so the stripes stay independent of each other
+    snprintf(line, sizeof(line), "DOWNLOAD %s %ld %ld\n", st->filename, st->offset, st->len);
+    send_all(sock, line, strlen(line));
+    long len = -1;
+    if (recv_line(sock, line, sizeof(line)) <= 0 || sscanf(line, "OK %ld", &len) != 1 || len != st->len) {
+        snprintf(st->err, sizeof(st->err), "%.120s", strncmp(line, "ERR ", 4) == 0 ? line + 4 : "File changed during download");
+        close(sock);
+        return NULL;
+    }
+    long got = 0;
+    while (got < len) {
+        size_t want = len - got < (long)sizeof(buffer) ? (size_t)(len - got) : sizeof(buffer);
+        ssize_t r = recv(sock, buffer, want, 0);
+        if (r <= 0) break;
+        for (ssize_t done = 0; done < r;) {
+            ssize_t w = pwrite(st->fd, buffer + done, r - done, st->offset + got + done);
+            if (w <= 0) {
+                snprintf(st->err, sizeof(st->err), "Cannot write file");
+                close(sock);
+                return NULL;
+            }
+            done += w;
+        }
+        got += r;
+    }
+    if (got == len) st->ok = 1;
+    else snprintf(st->err, sizeof(st->err), "Connection lost");
+    close(sock);
+    return NULL;
+}
+
+// Splits size bytes into up to nstripes ranges and runs them in parallel;
+// returns the number of failed stripes
+static int run_stripes(const char *filename, const char *upload_id, int fd, long size, int nstripes,
+                       void *(*fn)(void *)) {
+    if (nstripes < 1) nstripes = 1;
+    if (nstripes > STRIPES_MAX) nstripes = STRIPES_MAX;
+    if (size / nstripes < STRIPE_MIN) nstripes = size / STRIPE_MIN > 0 ? (int)(size / STRIPE_MIN) : 1;
+
+    Stripe stripes[STRIPES_MAX];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long per = size / nstripes;
+    for (int i = 0; i < nstripes; i++) {
+        Stripe *st = &stripes[i];
+        memset(st, 0, sizeof(*st));
+        st->filename = filename;
+        st->upload_id = upload_id;
+        st->fd = fd;
+        st->offset = per * i;
+        st->len = i == nstripes - 1 ? size - st->offset : per;
+        if (pthread_create(&st->thread, NULL, fn, st) != 0) {
+            snprintf(st->err, sizeof(st->err), "Cannot start thread");
+            st->thread = 0;
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < nstripes; i++) {
+        if (stripes[i].thread) pthread_join(stripes[i].thread, NULL);
+        if (!stripes[i].ok) {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "Stripe %d (bytes %ld-%ld): %s", i, stripes[i].offset,
+                     stripes[i].offset + stripes[i].len, stripes[i].err);
+            print_error(msg);
+            failed++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (!failed) printf("%ld bytes over %d connections in %.2fs (%.1f MB/s)\n", size, nstripes, secs,
+                        secs > 0 ? size / secs / 1e6 : 0.0);
+    return failed;
+}
+
+// SUPLOAD: STRIPE_OPEN on this connection, the ranges on fresh ones, then STRIPE_COMMIT
+void send_file_striped(int sock, const char *filename, int nstripes) {
+    char line[BUF_SIZE] = "", upload_id[32];
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        print_error("File not found");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    snprintf(line, sizeof(line), "STRIPE_OPEN %s %ld\n", filename, (long)st.st_size);
+    send_all(sock, line, strlen(line));
+    if (recv_line(sock, line, sizeof(line)) <= 0 || sscanf(line, "OK %31s", upload_id) != 1) {
+        print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : "No response from server");
+        close(fd);
+        return;
+    }
+    printf("Uploading %s (%ld bytes) in stripes...\n", filename, (long)st.st_size);
+    if (run_stripes(filename, upload_id, fd, st.st_size, nstripes, stripe_upload) > 0) {
+        print_error("Striped upload failed");
+        close(fd);
+        return;
+    }
+    snprintf(line, sizeof(line), "STRIPE_COMMIT %s\n", upload_id);
+    send_all(sock, line, strlen(line));
+    if (recv_line(sock, line, sizeof(line)) > 0 && strncmp(line, "OK", 2) == 0) {
+        print_success("File uploaded successfully");
+        verify_crc(line, fd, (long)st.st_size);
+    } else {
+        print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : "Upload failed");
+    }
+    close(fd);
+}
+
+// SDOWNLOAD: STAT for the size, then ranged DOWNLOADs written in place
+void receive_file_striped(int sock, const char *filename, int nstripes) {
+    char line[BUF_SIZE] = "";
+    snprintf(line, sizeof(line), "STAT %s\n", filename);
+    send_all(sock, line, strlen(line));
+    if (recv_line(sock, line, sizeof(line)) <= 0 || strncmp(line, "OK ", 3) != 0) {
+        print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : "No response from server");
+        return;
+    }
+    long size = atol(line + 3);
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        print_error("Cannot create file");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    printf("Downloading %s (%ld bytes) in stripes...\n", filename, size);
+    int failed = size > 0 ? run_stripes(filename, NULL, fd, size, nstripes, stripe_download) : 0;
+    if (failed) {
+        print_error("Download failed");
+    } else {
+        print_success("File downloaded successfully");
+        // The STAT reply carries the whole file's checksum
+        verify_crc(line, fd, size);
+    }
+    close(fd);
+}
+
 int authenticate(int sock) {
     char buf[BUF_SIZE];
     char username[64], password[64];
@@ -201,6 +1124,8 @@ int authenticate(int sock) {
            
             if (strncmp(buf, "OK", 2) == 0) {
                 print_success("Login successful!");
+                strcpy(login_user, username);
+                strcpy(login_pass, password);
                 authenticated = 1;
             } else {
                 print_error("Login failed. Check your credentials.");
@@ -282,6 +1207,7 @@ int main(int argc, char *argv[]) {
 
     int sock;
     struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
 
     sock = socket(AF_INET, SOCK_STREAM, 0);
     serv_addr.sin_family = AF_INET;
@@ -293,8 +1219,11 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    server_addr = serv_addr;
+
     print_banner();
     print_success("Connected to Dropbox server!");
+    negotiate_protocol(sock);
 
     if (!authenticate(sock)) {
         close(sock);
@@ -313,14 +1242,25 @@ int main(int argc, char *argv[]) {
             char *fname = strchr(buf, ' ');
             if (fname) {
                 fname++;
-                // First send the UPLOAD command
-                char cmd[BUF_SIZE];
-                snprintf(cmd, sizeof(cmd), "UPLOAD %s\n", fname);
-                send_all(sock, cmd, strlen(cmd));
-                // Small delay to ensure command is processed
-                usleep(100000);
-                // Then send the file data
-                send_file(sock, fname);
+                struct stat st;
+                if (proto_version >= 2 && (strpbrk(fname, " *?[") || (stat(fname, &st) == 0 && S_ISDIR(st.st_mode)))) {
+                    // Several files, a glob or a directory: one batch
+                    char *args[256];
+                    int nargs = 0;
+                    for (char *tok = strtok(fname, " "); tok && nargs < 256; tok = strtok(NULL, " ")) args[nargs++] = tok;
+                    send_files_batch(sock, args, nargs);
+                } else if (proto_version >= 2) {
+                    send_file_framed(sock, fname, NULL);
+                } else {
+                    // First send the UPLOAD command
+                    char cmd[BUF_SIZE];
+                    snprintf(cmd, sizeof(cmd), "UPLOAD %s\n", fname);
+                    send_all(sock, cmd, strlen(cmd));
+                    // The data may follow right away: bytes the server reads
+                    // past the command line stay in the session buffer and
+                    // go to the payload
+                    send_file(sock, fname);
+                }
             } else {
                 print_error("Usage: UPLOAD <filename>");
             }
@@ -329,14 +1269,45 @@ int main(int argc, char *argv[]) {
             char *fname = strchr(buf, ' ');
             if (fname) {
                 fname++;
-                // Send the DOWNLOAD command with filename
-                char cmd[BUF_SIZE];
-                snprintf(cmd, sizeof(cmd), "DOWNLOAD %s\n", fname);
-                send_all(sock, cmd, strlen(cmd));
-                // Then receive the file
-                receive_file(sock, fname);
+                // Optional "<offset> [<len>]" after the name asks for a byte range
+                char *range = strchr(fname, ' ');
+                if (range) *range++ = '\0';
+                if (proto_version >= 2 && strpbrk(fname, "*?[")) {
+                    // A pattern fetches every matching file in one batch
+                    char *patterns[2] = { fname, range };
+                    receive_files_batch(sock, patterns, range ? 2 : 1);
+                } else if (proto_version >= 2) {
+                    receive_file_framed(sock, fname, range);
+                } else {
+                    // Send the DOWNLOAD command with filename
+                    char cmd[BUF_SIZE];
+                    snprintf(cmd, sizeof(cmd), "DOWNLOAD %s\n", fname);
+                    send_all(sock, cmd, strlen(cmd));
+                    // Then receive the file
+                    receive_file(sock, fname);
+                }
+            } else {
+                print_error("Usage: DOWNLOAD <filename> [<offset> [<len>]]");
+            }
+        }
+        else if (strncasecmp(buf, "RESUME", 6) == 0) {
+            char upload_id[32], fname[BUF_SIZE];
+            if (proto_version < 2) {
+                print_error("Server does not support resumable uploads");
+            } else if (sscanf(buf + 6, "%31s %8191[^\n]", upload_id, fname) == 2) {
+                send_file_framed(sock, fname, upload_id);
             } else {
-                print_error("Usage: DOWNLOAD <filename>");
+                print_error("Usage: RESUME <upload-id> <filename>");
+            }
+        }
+        else if (strncasecmp(buf, "SYNC", 4) == 0) {
+            char *fname = strchr(buf, ' ');
+            if (proto_version < 2) {
+                print_error("Server does not support delta uploads");
+            } else if (fname) {
+                send_file_delta(sock, fname + 1);
+            } else {
+                print_error("Usage: SYNC <filename>");
             }
         }
         else if (strncasecmp(buf, "DELETE", 6) == 0) {
@@ -365,7 +1336,6 @@ int main(int argc, char *argv[]) {
                         char *err_msg = response + 4; // Skip "ERR "
                         print_error(err_msg);
                     } else {
-                        printf("DEBUG: Received response: '%s'\n", response); // Debug line
                         print_error("Unexpected response from server");
                     }
                 } else {
@@ -375,6 +1345,38 @@ int main(int argc, char *argv[]) {
                 print_error("Usage: DELETE <filename>");
             }
         }
+        else if (strncasecmp(buf, "SUPLOAD ", 8) == 0 || strncasecmp(buf, "SDOWNLOAD ", 10) == 0) {
+            int upload = (buf[1] == 'U' || buf[1] == 'u');
+            char fname[BUF_SIZE];
+            int nstripes = STRIPES_DEFAULT;
+            if (proto_version < 2) {
+                print_error("Server does not support striped transfers");
+            } else if (sscanf(buf + (upload ? 8 : 10), "%8191s %d", fname, &nstripes) >= 1) {
+                if (upload) send_file_striped(sock, fname, nstripes);
+                else receive_file_striped(sock, fname, nstripes);
+            } else {
+                print_error(upload ? "Usage: SUPLOAD <filename> [connections]" : "Usage: SDOWNLOAD <filename> [connections]");
+            }
+        }
+        else if (strncasecmp(buf, "STAT", 4) == 0 && (buf[4] == ' ' || buf[4] == '\0')) {
+            char *fname = strchr(buf, ' ');
+            if (fname) {
+                char line[BUF_SIZE];
+                snprintf(line, sizeof(line), "STAT %s\n", fname + 1);
+                send_all(sock, line, strlen(line));
+                if (recv_line(sock, line, sizeof(line)) <= 0) {
+                    print_error("No response from server");
+                } else if (strncmp(line, "OK ", 3) == 0) {
+                    uint32_t crc;
+                    if (reply_crc(line, &crc) == 0) printf("%s: %ld bytes, crc32c %08x\n", fname + 1, atol(line + 3), crc);
+                    else printf("%s: %s bytes\n", fname + 1, line + 3);
+                } else {
+                    print_error(strncmp(line, "ERR ", 4) == 0 ? line + 4 : "Unexpected response from server");
+                }
+            } else {
+                print_error("Usage: STAT <filename>");
+            }
+        }
         else if (strncasecmp(buf, "LIST", 4) == 0) {
             handle_list(sock);
         }
@@ -384,7 +1386,7 @@ int main(int argc, char *argv[]) {
             break;
         }
         else if (strlen(buf) > 0) {
-            print_error("Unknown command. Available: UPLOAD, DOWNLOAD, DELETE, LIST, EXIT");
+            print_error("Unknown command. Available: UPLOAD, DOWNLOAD, RESUME, SYNC, DELETE, LIST, STAT, SUPLOAD, SDOWNLOAD, EXIT");
         }
     }
 
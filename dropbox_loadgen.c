@@ -0,0 +1,561 @@
+// Closed-loop load generator: N simulated users, each on its own connection
+// and thread, issue a weighted mix of operations back to back (optionally
+// with think time) for a fixed duration. It reports ops/s, MB/s and latency
+// percentiles per operation, can write the results as JSON, and can compare
+// them against an earlier JSON file to flag regressions between builds.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "dropbox_proto.h"
+
+#define DEFAULT_PORT 8080
+#define MAX_CLIENTS 1024
+#define LINE_MAX_LEN 1024
+#define READ_BUF 65536
+#define PAYLOAD_MAX (50 * 1024 * 1024)
+#define START_TIMEOUT 5          // seconds to wait for every client to log in
+
+enum Op { OP_SIGNUP, OP_LOGIN, OP_UPLOAD, OP_DOWNLOAD, OP_LIST, OP_STAT, OP_DELETE, OP_COUNT };
+static const char *op_names[OP_COUNT] = { "signup", "login", "upload", "download", "list", "stat", "delete" };
+
+typedef struct Config {
+    const char *host;
+    int port;
+    int clients;
+    double duration, warmup;
+    int think_ms;
+    int weights[OP_COUNT];
+    char mix[256];
+    size_t size_min, size_max;   // log-uniform between the two, equal for a fixed size
+    char sizes[64];
+    int files;                   // working set per user
+    int shared;                  // clients that run as one common account
+    const char *json_path;
+    const char *baseline_path;
+    double tolerance;            // percent
+} Config;
+
+static Config cfg = {
+    .host = "127.0.0.1", .port = DEFAULT_PORT, .clients = 8, .duration = 10, .warmup = 1,
+    .weights = { 0, 0, 30, 50, 5, 10, 5 }, .mix = "upload:30,download:50,list:5,stat:10,delete:5",
+    .size_min = 65536, .size_max = 65536, .sizes = "64k", .files = 16, .tolerance = 10,
+};
+
+typedef struct OpStats {
+    uint64_t count, errors, max_ns;
+    uint64_t hist[HIST_BUCKETS];
+} OpStats;
+
+typedef struct Client {
+    pthread_t thread;
+    int index;
+    int sock;
+    char user[64];
+    unsigned generation;         // accounts created so far by signup ops
+    char buf[READ_BUF];
+    size_t off, len;
+    uint64_t rng;
+    size_t *file_sizes;          // 0 = not stored
+    OpStats ops[OP_COUNT];
+    uint64_t bytes_up, bytes_down;
+} Client;
+
+static unsigned char *payload;
+static uint64_t measure_start_ns, run_end_ns;
+// Start gate: clients log in, then wait for the clock to be set
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_ready, gate_open;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t rng_next(Client *c) {
+    // xorshift64*
+    c->rng ^= c->rng >> 12;
+    c->rng ^= c->rng << 25;
+    c->rng ^= c->rng >> 27;
+    return c->rng * 2685821657736338717ULL;
+}
+
+static double rng_unit(Client *c) {
+    return (rng_next(c) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t pick_size(Client *c) {
+    if (cfg.size_min == cfg.size_max) return cfg.size_min;
+    double lo = log((double)cfg.size_min), hi = log((double)cfg.size_max);
+    return (size_t)exp(lo + (hi - lo) * rng_unit(c));
+}
+
+static enum Op pick_op(Client *c) {
+    int total = 0;
+    for (int i = 0; i < OP_COUNT; i++) total += cfg.weights[i];
+    int r = (int)(rng_next(c) % (uint64_t)total);
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (r < cfg.weights[i]) return (enum Op)i;
+        r -= cfg.weights[i];
+    }
+    return OP_STAT;
+}
+
+// A stored file of the working set, or -1 if there is none
+static int pick_stored(Client *c) {
+    int start = (int)(rng_next(c) % (uint64_t)cfg.files);
+    for (int i = 0; i < cfg.files; i++) {
+        int slot = (start + i) % cfg.files;
+        if (c->file_sizes[slot]) return slot;
+    }
+    return -1;
+}
+
+static int send_all(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t s = send(sock, p, len, 0);
+        if (s < 0 && errno == EINTR) continue;
+        if (s <= 0) return -1;
+        p += s;
+        len -= s;
+    }
+    return 0;
+}
+
+static int fill(Client *c) {
+    if (c->off > 0) {
+        memmove(c->buf, c->buf + c->off, c->len - c->off);
+        c->len -= c->off;
+        c->off = 0;
+    }
+    ssize_t r;
+    do r = recv(c->sock, c->buf + c->len, sizeof(c->buf) - c->len, 0); while (r < 0 && errno == EINTR);
+    if (r <= 0) return -1;
+    c->len += r;
+    return 0;
+}
+
+static int read_line(Client *c, char *line, size_t cap) {
+    for (;;) {
+        char *nl = memchr(c->buf + c->off, '\n', c->len - c->off);
+        if (nl) {
+            size_t n = nl - (c->buf + c->off);
+            if (n >= cap) n = cap - 1;
+            memcpy(line, c->buf + c->off, n);
+            line[n] = '\0';
+            if (n > 0 && line[n - 1] == '\r') line[n - 1] = '\0';
+            c->off = nl - c->buf + 1;
+            return 0;
+        }
+        if (c->len - c->off == sizeof(c->buf)) return -1;
+        if (fill(c) != 0) return -1;
+    }
+}
+
+// Reads n body bytes and checks them against the payload every upload
+// sends; 1 if they differ, -1 if the connection broke
+static int check_bytes(Client *c, size_t n) {
+    int bad = n > cfg.size_max;
+    for (size_t pos = 0; pos < n;) {
+        if (c->off == c->len && fill(c) != 0) return -1;
+        size_t take = c->len - c->off < n - pos ? c->len - c->off : n - pos;
+        if (!bad && memcmp(c->buf + c->off, payload + pos, take) != 0) bad = 1;
+        c->off += take;
+        pos += take;
+    }
+    return bad;
+}
+
+static int command(Client *c, const char *cmd, char *reply, size_t cap) {
+    if (send_all(c->sock, cmd, strlen(cmd)) != 0) return -1;
+    return read_line(c, reply, cap);
+}
+
+static int client_connect(Client *c) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg.port);
+    if (inet_pton(AF_INET, cfg.host, &addr.sin_addr) != 1) return -1;
+    c->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->sock < 0) return -1;
+    int one = 1;
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->off = c->len = 0;
+    if (connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(c->sock);
+        c->sock = -1;
+        return -1;
+    }
+    char reply[LINE_MAX_LEN];
+    if (command(c, "PROTO 2\n", reply, sizeof(reply)) != 0 || strcmp(reply, "OK PROTO 2") != 0) return -1;
+    return 0;
+}
+
+static void client_disconnect(Client *c) {
+    if (c->sock >= 0) close(c->sock);
+    c->sock = -1;
+}
+
+// New connection logged in as c->user; creates the account first if asked
+static int client_login(Client *c, int signup) {
+    char cmd[LINE_MAX_LEN], reply[LINE_MAX_LEN];
+    client_disconnect(c);
+    if (client_connect(c) != 0) return -1;
+    if (signup) {
+        snprintf(cmd, sizeof(cmd), "SIGNUP %s loadgen\n", c->user);
+        // An account left over from an earlier run is fine
+        if (command(c, cmd, reply, sizeof(reply)) != 0) return -1;
+    }
+    snprintf(cmd, sizeof(cmd), "LOGIN %s loadgen\n", c->user);
+    if (command(c, cmd, reply, sizeof(reply)) != 0 || strcmp(reply, "OK") != 0) return -1;
+    return 0;
+}
+
+static void next_user(Client *c) {
+    if (c->index < cfg.shared) snprintf(c->user, sizeof(c->user), "lg%d_shared", (int)getpid());
+    else snprintf(c->user, sizeof(c->user), "lg%d_%d_%u", (int)getpid(), c->index, c->generation++);
+    memset(c->file_sizes, 0, cfg.files * sizeof(size_t));
+}
+
+// One operation; returns 0, 1 for an ERR reply, -1 if the connection broke
+static int run_op(Client *c, enum Op op) {
+    char cmd[LINE_MAX_LEN], reply[LINE_MAX_LEN];
+    int slot;
+    switch (op) {
+    case OP_SIGNUP:
+        next_user(c);
+        return client_login(c, 1);
+    case OP_LOGIN:
+        return client_login(c, 0);
+    case OP_UPLOAD: {
+        slot = (int)(rng_next(c) % (uint64_t)cfg.files);
+        size_t size = pick_size(c);
+        snprintf(cmd, sizeof(cmd), "UPLOAD f%d %zu\n", slot, size);
+        if (command(c, cmd, reply, sizeof(reply)) != 0) return -1;
+        if (strncmp(reply, "READY", 5) != 0) return 1;
+        if (send_all(c->sock, payload, size) != 0 || read_line(c, reply, sizeof(reply)) != 0) return -1;
+        c->bytes_up += size;
+        if (strncmp(reply, "OK", 2) != 0) return 1;
+        c->file_sizes[slot] = size;
+        return 0;
+    }
+    case OP_DOWNLOAD: {
+        slot = pick_stored(c);
+        snprintf(cmd, sizeof(cmd), "DOWNLOAD f%d\n", slot < 0 ? 0 : slot);
+        if (command(c, cmd, reply, sizeof(reply)) != 0) return -1;
+        if (strncmp(reply, "OK ", 3) != 0) return slot < 0 ? 0 : 1;
+        size_t len = strtoull(reply + 3, NULL, 10);
+        int rc = check_bytes(c, len);
+        if (rc < 0) return -1;
+        c->bytes_down += len;
+        return rc;
+    }
+    case OP_LIST:
+        if (send_all(c->sock, "LIST\n", 5) != 0) return -1;
+        do {
+            if (read_line(c, reply, sizeof(reply)) != 0) return -1;
+            if (strncmp(reply, "ERR", 3) == 0) return 1;
+        } while (strcmp(reply, "END_OF_LIST") != 0);
+        return 0;
+    case OP_STAT:
+    case OP_DELETE:
+        // With nothing stored a miss is the expected answer
+        slot = pick_stored(c);
+        snprintf(cmd, sizeof(cmd), "%s f%d\n", op == OP_STAT ? "STAT" : "DELETE", slot < 0 ? 0 : slot);
+        if (command(c, cmd, reply, sizeof(reply)) != 0) return -1;
+        if (strncmp(reply, "OK", 2) != 0) return slot < 0 ? 0 : 1;
+        if (op == OP_DELETE) c->file_sizes[slot] = 0;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static void *client_thread(void *arg) {
+    Client *c = arg;
+    c->sock = -1;
+    next_user(c);
+    int ready = client_login(c, 1);
+    pthread_mutex_lock(&gate_lock);
+    gate_ready++;
+    pthread_cond_broadcast(&gate_cond);
+    while (!gate_open) pthread_cond_wait(&gate_cond, &gate_lock);
+    pthread_mutex_unlock(&gate_lock);
+    if (ready != 0) {
+        fprintf(stderr, "client %d: cannot log in as %s\n", c->index, c->user);
+        return NULL;
+    }
+    for (;;) {
+        uint64_t t0 = now_ns();
+        if (t0 >= run_end_ns) break;
+        enum Op op = pick_op(c);
+        int rc = run_op(c, op);
+        uint64_t t1 = now_ns();
+        if (t0 >= measure_start_ns) {
+            OpStats *st = &c->ops[op];
+            st->count++;
+            if (rc != 0) st->errors++;
+            st->hist[hist_index(t1 - t0)]++;
+            if (t1 - t0 > st->max_ns) st->max_ns = t1 - t0;
+        }
+        if (rc < 0 && client_login(c, 0) != 0) {
+            fprintf(stderr, "client %d: connection lost\n", c->index);
+            break;
+        }
+        if (cfg.think_ms > 0) usleep(cfg.think_ms * 1000);
+    }
+    client_disconnect(c);
+    return NULL;
+}
+
+static int parse_size(const char *s, size_t *out) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0) return -1;
+    if (*end == 'k' || *end == 'K') { v *= 1024; end++; }
+    else if (*end == 'm' || *end == 'M') { v *= 1024 * 1024; end++; }
+    if (*end && *end != '-') return -1;
+    *out = (size_t)v;
+    return 0;
+}
+
+// "<size>" or "<min>-<max>", with k/m suffixes
+static int parse_sizes(const char *arg) {
+    const char *dash = strchr(arg, '-');
+    if (parse_size(arg, &cfg.size_min) != 0) return -1;
+    cfg.size_max = cfg.size_min;
+    if (dash && parse_size(dash + 1, &cfg.size_max) != 0) return -1;
+    if (cfg.size_min == 0 || cfg.size_max < cfg.size_min || cfg.size_max > PAYLOAD_MAX) return -1;
+    snprintf(cfg.sizes, sizeof(cfg.sizes), "%s", arg);
+    return 0;
+}
+
+// "op:weight,..."; operations left out get weight 0
+static int parse_mix(const char *arg) {
+    int weights[OP_COUNT] = {0}, total = 0;
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", arg);
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        char *colon = strchr(tok, ':');
+        if (!colon) return -1;
+        *colon = '\0';
+        int op = 0;
+        while (op < OP_COUNT && strcmp(op_names[op], tok) != 0) op++;
+        int w = atoi(colon + 1);
+        if (op == OP_COUNT || w < 0) return -1;
+        weights[op] = w;
+        total += w;
+    }
+    if (total == 0) return -1;
+    memcpy(cfg.weights, weights, sizeof(weights));
+    snprintf(cfg.mix, sizeof(cfg.mix), "%s", arg);
+    return 0;
+}
+
+typedef struct Summary {
+    OpStats ops[OP_COUNT];
+    OpStats all;
+    uint64_t bytes_up, bytes_down;
+    double seconds;
+} Summary;
+
+static void merge(OpStats *into, const OpStats *from) {
+    into->count += from->count;
+    into->errors += from->errors;
+    if (from->max_ns > into->max_ns) into->max_ns = from->max_ns;
+    for (int i = 0; i < HIST_BUCKETS; i++) into->hist[i] += from->hist[i];
+}
+
+static double pct_us(const OpStats *st, double q) {
+    return hist_percentile(st->hist, st->count, q, st->max_ns) / 1000.0;
+}
+
+static void print_report(const Summary *sum) {
+    printf("%d clients, %.1fs measured, mix %s, sizes %s\n", cfg.clients, sum->seconds, cfg.mix, cfg.sizes);
+    printf("%-9s %10s %8s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "ops/s", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int i = 0; i <= OP_COUNT; i++) {
+        const OpStats *st = i < OP_COUNT ? &sum->ops[i] : &sum->all;
+        if (!st->count) continue;
+        printf("%-9s %10llu %8llu %10.0f %10.1f %10.1f %10.1f %10.1f\n", i < OP_COUNT ? op_names[i] : "total",
+               (unsigned long long)st->count, (unsigned long long)st->errors, st->count / sum->seconds,
+               pct_us(st, 0.5), pct_us(st, 0.99), pct_us(st, 0.999), st->max_ns / 1000.0);
+    }
+    printf("throughput %.0f ops/s, %.1f MB/s (%.1f up, %.1f down)\n", sum->all.count / sum->seconds,
+           (sum->bytes_up + sum->bytes_down) / sum->seconds / 1e6, sum->bytes_up / sum->seconds / 1e6,
+           sum->bytes_down / sum->seconds / 1e6);
+}
+
+static void write_stats_json(FILE *fp, const OpStats *st, double seconds) {
+    fprintf(fp, "{\"count\": %llu, \"errors\": %llu, \"ops_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                "\"p999_us\": %.1f, \"max_us\": %.1f}",
+            (unsigned long long)st->count, (unsigned long long)st->errors, st->count / seconds,
+            pct_us(st, 0.5), pct_us(st, 0.99), pct_us(st, 0.999), st->max_ns / 1000.0);
+}
+
+// Overall figures first, so a baseline check can find them without a JSON parser
+static int write_json(const char *path, const Summary *sum) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    fprintf(fp, "{\n  \"ops_per_sec\": %.1f,\n  \"mb_per_sec\": %.3f,\n  \"p99_us\": %.1f,\n",
+            sum->all.count / sum->seconds, (sum->bytes_up + sum->bytes_down) / sum->seconds / 1e6, pct_us(&sum->all, 0.99));
+    fprintf(fp, "  \"clients\": %d,\n  \"seconds\": %.3f,\n  \"mix\": \"%s\",\n  \"sizes\": \"%s\",\n  \"files\": %d,\n",
+            cfg.clients, sum->seconds, cfg.mix, cfg.sizes, cfg.files);
+    fprintf(fp, "  \"bytes_up\": %llu,\n  \"bytes_down\": %llu,\n  \"total\": ",
+            (unsigned long long)sum->bytes_up, (unsigned long long)sum->bytes_down);
+    write_stats_json(fp, &sum->all, sum->seconds);
+    fprintf(fp, ",\n  \"ops\": {");
+    int first = 1;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (!sum->ops[i].count) continue;
+        fprintf(fp, "%s\n    \"%s\": ", first ? "" : ",", op_names[i]);
+        write_stats_json(fp, &sum->ops[i], sum->seconds);
+        first = 0;
+    }
+    fprintf(fp, "\n  }\n}\n");
+    return fclose(fp);
+}
+
+static int json_number(const char *text, const char *key, double *out) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    const char *p = strstr(text, pat);
+    if (!p) return -1;
+    *out = strtod(p + strlen(pat), NULL);
+    return 0;
+}
+
+// Exit status 2 if throughput fell or p99 rose by more than the tolerance
+static int compare_baseline(const char *path, const Summary *sum) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) { perror(path); return 1; }
+    char text[4096];
+    size_t n = fread(text, 1, sizeof(text) - 1, fp);
+    fclose(fp);
+    text[n] = '\0';
+    double base_ops, base_p99;
+    if (json_number(text, "ops_per_sec", &base_ops) != 0 || json_number(text, "p99_us", &base_p99) != 0) {
+        fprintf(stderr, "%s: not a loadgen result\n", path);
+        return 1;
+    }
+    double ops = sum->all.count / sum->seconds, p99 = pct_us(&sum->all, 0.99);
+    double d_ops = base_ops > 0 ? (ops - base_ops) * 100 / base_ops : 0;
+    double d_p99 = base_p99 > 0 ? (p99 - base_p99) * 100 / base_p99 : 0;
+    printf("vs %s: ops/s %.0f -> %.0f (%+.1f%%), p99 %.1fus -> %.1fus (%+.1f%%)\n",
+           path, base_ops, ops, d_ops, base_p99, p99, d_p99);
+    if (d_ops < -cfg.tolerance || d_p99 > cfg.tolerance) {
+        printf("REGRESSION beyond %.0f%%\n", cfg.tolerance);
+        return 2;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--host=<ip>] [--port=<n>] [--clients=<n>] [--duration=<s>] [--warmup=<s>]\n"
+                    "       [--mix=<op:weight,...>] [--sizes=<size>|<min>-<max>] [--files=<n>] [--think=<ms>]\n"
+                    "       [--shared=<n>] [--json=<path>] [--baseline=<path>] [--tolerance=<percent>]\n", prog);
+    fprintf(stderr, "  ops: signup login upload download list stat delete (default %s)\n", cfg.mix);
+    fprintf(stderr, "  --sizes       upload size, or a log-uniform range such as 1k-4m (default %s)\n", cfg.sizes);
+    fprintf(stderr, "  --files       files per simulated user that uploads overwrite (default %d)\n", cfg.files);
+    fprintf(stderr, "  --shared      the first n clients share one account, so their uploads race\n");
+    fprintf(stderr, "  --warmup      seconds run before measuring (default %.0f)\n", cfg.warmup);
+    fprintf(stderr, "  --json        write the results as JSON\n");
+    fprintf(stderr, "  --baseline    compare with an earlier --json file, exit 2 on a regression\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (strncmp(a, "--host=", 7) == 0) cfg.host = a + 7;
+        else if (strncmp(a, "--port=", 7) == 0) cfg.port = atoi(a + 7);
+        else if (strncmp(a, "--clients=", 10) == 0) cfg.clients = atoi(a + 10);
+        else if (strncmp(a, "--duration=", 11) == 0) cfg.duration = atof(a + 11);
+        else if (strncmp(a, "--warmup=", 9) == 0) cfg.warmup = atof(a + 9);
+        else if (strncmp(a, "--think=", 8) == 0) cfg.think_ms = atoi(a + 8);
+        else if (strncmp(a, "--files=", 8) == 0) cfg.files = atoi(a + 8);
+        else if (strncmp(a, "--shared=", 9) == 0) cfg.shared = atoi(a + 9);
+        else if (strncmp(a, "--json=", 7) == 0) cfg.json_path = a + 7;
+        else if (strncmp(a, "--baseline=", 11) == 0) cfg.baseline_path = a + 11;
+        else if (strncmp(a, "--tolerance=", 12) == 0) cfg.tolerance = atof(a + 12);
+        else if (strncmp(a, "--mix=", 6) == 0) { if (parse_mix(a + 6) != 0) usage(argv[0]); }
+        else if (strncmp(a, "--sizes=", 8) == 0) { if (parse_sizes(a + 8) != 0) usage(argv[0]); }
+        else usage(argv[0]);
+    }
+    if (cfg.clients < 1 || cfg.clients > MAX_CLIENTS || cfg.duration <= 0 || cfg.warmup < 0 || cfg.files < 1) usage(argv[0]);
+
+    // Random payload, so compression or dedup on the server cannot flatter the numbers
+    payload = malloc(cfg.size_max);
+    if (!payload) { perror("malloc"); return 1; }
+    uint64_t x = (uint64_t)now_ns() | 1;
+    for (size_t i = 0; i < cfg.size_max; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        payload[i] = (unsigned char)x;
+    }
+
+    Client *clients = calloc(cfg.clients, sizeof(Client));
+    if (!clients) { perror("calloc"); return 1; }
+    for (int i = 0; i < cfg.clients; i++) {
+        Client *c = &clients[i];
+        c->index = i;
+        c->rng = (now_ns() ^ ((uint64_t)(i + 1) * 0x9E3779B97F4A7C15ULL)) | 1;
+        c->file_sizes = calloc(cfg.files, sizeof(size_t));
+        if (!c->file_sizes || pthread_create(&c->thread, NULL, client_thread, c) != 0) {
+            perror("client");
+            return 1;
+        }
+    }
+    // The clock starts once every client is logged in. A thread-per-session
+    // server may not admit them all at once; start without the stragglers.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += START_TIMEOUT;
+    pthread_mutex_lock(&gate_lock);
+    while (gate_ready < cfg.clients &&
+           pthread_cond_timedwait(&gate_cond, &gate_lock, &deadline) == 0)
+        ;
+    if (gate_ready < cfg.clients)
+        fprintf(stderr, "Starting with %d of %d clients logged in\n", gate_ready, cfg.clients);
+    measure_start_ns = now_ns() + (uint64_t)(cfg.warmup * 1e9);
+    run_end_ns = measure_start_ns + (uint64_t)(cfg.duration * 1e9);
+    gate_open = 1;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_lock);
+
+    Summary *sum = calloc(1, sizeof(Summary));
+    if (!sum) { perror("calloc"); return 1; }
+    for (int i = 0; i < cfg.clients; i++) {
+        Client *c = &clients[i];
+        pthread_join(c->thread, NULL);
+        for (int op = 0; op < OP_COUNT; op++) {
+            merge(&sum->ops[op], &c->ops[op]);
+            merge(&sum->all, &c->ops[op]);
+        }
+        sum->bytes_up += c->bytes_up;
+        sum->bytes_down += c->bytes_down;
+    }
+    uint64_t end = now_ns();
+    sum->seconds = (double)((end < run_end_ns ? end : run_end_ns) - measure_start_ns) / 1e9;
+    if (sum->seconds <= 0 || sum->all.count == 0) {
+        fprintf(stderr, "No operations completed\n");
+        return 1;
+    }
+
+    print_report(sum);
+    // Compare first, so a run may overwrite the baseline it was checked against
+    int rc = cfg.baseline_path ? compare_baseline(cfg.baseline_path, sum) : 0;
+    if (cfg.json_path && write_json(cfg.json_path, sum) != 0) perror(cfg.json_path);
+    return rc;
+}
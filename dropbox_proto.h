@@ -0,0 +1,451 @@
+// Helpers shared by the server and the client: content hashing and the
+// rolling checksum used by delta uploads, plus the wire encoding of their
+// binary records. Everything here is header-only so that both programs
+// still build from a single source file each.
+#ifndef DROPBOX_PROTO_H
+#define DROPBOX_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static inline void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void put_u16(unsigned char *p, uint16_t v) {
+    p[0] = v; p[1] = v >> 8;
+}
+
+static inline uint16_t get_u16(const unsigned char *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v) {
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint64_t get_u64(const unsigned char *p) {
+    return get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+// CRC-32C (Castagnoli). It checksums metadata records and whole files, so
+// on x86-64 the SSE4.2 crc32 instruction is used when the CPU has it,
+// eight bytes per step; otherwise a byte-wise table.
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len--) crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+// a * b modulo the CRC polynomial, bit-reflected (x^0 is the top bit)
+static inline uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, prod = 0;
+    for (;;) {
+        if (a & m) {
+            prod ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0x82f63b78 : b >> 1;
+    }
+    return prod;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+// The crc32 instruction has a latency of three cycles but issues every
+// cycle, so large inputs are split into three streams checksummed side by
+// side and joined by shifting the earlier ones past CRC32C_STRIDE bytes
+#define CRC32C_STRIDE 4096
+#define CRC32C_STRIDE_SHIFT 0x35d73a62   // x^(8 * CRC32C_STRIDE) mod P
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc, v, v1, v2;
+    for (; len > 0 && ((uintptr_t)p & 7); len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    for (; len >= 3 * CRC32C_STRIDE; len -= 3 * CRC32C_STRIDE, p += 3 * CRC32C_STRIDE) {
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < CRC32C_STRIDE; i += 8) {
+            memcpy(&v, p + i, 8);
+            memcpy(&v1, p + CRC32C_STRIDE + i, 8);
+            memcpy(&v2, p + 2 * CRC32C_STRIDE + i, 8);
+            c = _mm_crc32_u64(c, v);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        c = crc32c_multmodp(CRC32C_STRIDE_SHIFT, (uint32_t)c) ^ (uint32_t)c1;
+        c = crc32c_multmodp(CRC32C_STRIDE_SHIFT, (uint32_t)c) ^ (uint32_t)c2;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len > 0; len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#endif
+
+// Streaming: crc32c(crc32c(0, a, n), b, m) is the CRC of a followed by b
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2")) return ~crc32c_sse42(~crc, data, len);
+#endif
+    return ~crc32c_sw(~crc, data, len);
+}
+
+// SHA-256 (FIPS 180-4)
+typedef struct Sha256 {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t buf_len;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline void sha256_block(Sha256 *c, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = c->h[0], b = c->h[1], cc = c->h[2], d = c->h[3];
+    uint32_t e = c->h[4], f = c->h[5], g = c->h[6], h = c->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g; g = f; f = e; e = d + t1;
+        d = cc; cc = b; b = a; a = t1 + t2;
+    }
+    c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+    c->h[4] += e; c->h[5] += f; c->h[6] += g; c->h[7] += h;
+}
+
+static inline void sha256_init(Sha256 *c) {
+    static const uint32_t iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(c->h, iv, sizeof(iv));
+    c->len = 0;
+    c->buf_len = 0;
+}
+
+static inline void sha256_update(Sha256 *c, const void *data, size_t len) {
+    const unsigned char *p = data;
+    c->len += len;
+    if (c->buf_len) {
+        size_t take = 64 - c->buf_len < len ? 64 - c->buf_len : len;
+        memcpy(c->buf + c->buf_len, p, take);
+        c->buf_len += take; p += take; len -= take;
+        if (c->buf_len < 64) return;
+        sha256_block(c, c->buf);
+        c->buf_len = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) sha256_block(c, p);
+    memcpy(c->buf, p, len);
+    c->buf_len = len;
+}
+
+static inline void sha256_final(Sha256 *c, unsigned char out[32]) {
+    uint64_t bits = c->len * 8;
+    unsigned char pad = 0x80;
+    sha256_update(c, &pad, 1);
+    pad = 0;
+    while (c->buf_len != 56) sha256_update(c, &pad, 1);
+    unsigned char lenbuf[8];
+    for (int i = 0; i < 8; i++) lenbuf[i] = (unsigned char)(bits >> (56 - 8*i));
+    sha256_update(c, lenbuf, 8);
+    for (int i = 0; i < 8; i++) {
+        out[4*i] = c->h[i] >> 24; out[4*i+1] = c->h[i] >> 16;
+        out[4*i+2] = c->h[i] >> 8; out[4*i+3] = c->h[i];
+    }
+}
+
+// rsync's weak checksum: two 16-bit sums over a window that can slide one
+// byte at a time in constant time
+typedef struct RollSum {
+    uint32_t a, b;
+    size_t len;
+} RollSum;
+
+static inline void rollsum_init(RollSum *r, const unsigned char *p, size_t len) {
+    r->a = r->b = 0;
+    r->len = len;
+    for (size_t i = 0; i < len; i++) {
+        r->a += p[i];
+        r->b += (uint32_t)(len - i) * p[i];
+    }
+}
+
+// Slides the window forward: out leaves at the front, in joins at the back
+static inline void rollsum_rotate(RollSum *r, unsigned char out, unsigned char in) {
+    r->a += in - out;
+    r->b += r->a - (uint32_t)r->len * out;
+}
+
+static inline uint32_t rollsum_digest(const RollSum *r) {
+    return (r->a & 0xffff) | (r->b << 16);
+}
+
+// Delta uploads (DELTA_UPLOAD <name> <size>). The server answers
+//   SIGS <block-size> <count> <base-size>
+// followed by <count> records of DELTA_SIG_SIZE bytes, one per full block
+// of its current copy: the weak checksum (u32, little endian) and the first
+// DELTA_STRONG_LEN bytes of the block's SHA-256. The client then sends
+// instructions, each an op byte and a u32 argument, until DELTA_OP_END:
+//   DELTA_OP_LITERAL <len>  followed by <len> new bytes
+//   DELTA_OP_COPY <index>   block <index> of the server's copy
+#define DELTA_STRONG_LEN 16
+#define DELTA_SIG_SIZE (4 + DELTA_STRONG_LEN)
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK 65536
+#define DELTA_OP_LITERAL 'L'
+#define DELTA_OP_COPY 'C'
+#define DELTA_OP_END 'E'
+
+// About sqrt(size), which balances signature size against literal size
+static inline size_t delta_block_size(uint64_t size) {
+    size_t bs = DELTA_MIN_BLOCK;
+    while (bs < DELTA_MAX_BLOCK && (uint64_t)bs * bs < size) bs <<= 1;
+    return bs;
+}
+
+// Transfer compression. UPLOAD, RESUME and DOWNLOAD take a trailing "LZ"
+// flag, which the server accepts by ending its READY or OK reply with "LZ"
+// too (a pipelined "#<tag> UPLOAD ... LZ" is always accepted). Such a body
+// is a series of frames covering the declared size:
+//   u32 raw length (1..LZ_BLOCK_MAX), u32 wire length, <wire length> bytes
+// A frame whose wire length equals its raw length is stored as is;
+// otherwise it is one LZ4-format block. Blocks are independent, so a
+// resumed or ranged transfer simply starts a new frame.
+#define LZ_BLOCK_MAX 65536
+#define LZ_FRAME_HDR 8
+#define LZ_SAMPLE 4096
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+// Senders stop trying after this many blocks in a row did not shrink
+#define LZ_GIVE_UP 4
+
+// Whether the start of a transfer looks worth compressing. Uses the
+// collision entropy of the byte histogram, which needs no logarithms:
+// -log2(sum p^2) above 7 bits per byte (random, already compressed or
+// encrypted data) is not attempted.
+static inline int lz_sample_compressible(const unsigned char *p, size_t len) {
+    uint32_t hist[256] = { 0 };
+    if (len > LZ_SAMPLE) len = LZ_SAMPLE;
+    if (len < 64) return 0;
+    for (size_t i = 0; i < len; i++) hist[p[i]]++;
+    uint64_t sum = 0;
+    for (int i = 0; i < 256; i++) sum += (uint64_t)hist[i] * hist[i];
+    return sum * 128 >= (uint64_t)len * len;
+}
+
+static inline uint32_t lz_load32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned char *lz_put_len(unsigned char *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// One sequence: literals, then a match of mlen bytes at distance off
+// (mlen 0 for the closing literals-only sequence). Fails if it does not fit.
+static inline int lz_emit(unsigned char **op, unsigned char *end, const unsigned char *lit, size_t lit_len,
+                          size_t off, size_t mlen) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (mlen ? 2 + (mlen - LZ_MIN_MATCH) / 255 + 1 : 0);
+    if ((size_t)(end - *op) < need) return -1;
+    unsigned char *token = (*op)++;
+    *token = (unsigned char)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) *op = lz_put_len(*op, lit_len - 15);
+    memcpy(*op, lit, lit_len);
+    *op += lit_len;
+    if (!mlen) return 0;
+    put_u16(*op, (uint16_t)off);
+    *op += 2;
+    size_t ml = mlen - LZ_MIN_MATCH;
+    *token |= (unsigned char)(ml >= 15 ? 15 : ml);
+    if (ml >= 15) *op = lz_put_len(*op, ml - 15);
+    return 0;
+}
+
+// Greedy single-probe LZ4 compressor for one block of at most LZ_BLOCK_MAX
+// bytes. Returns the compressed length, or 0 if the result would not be
+// smaller than the input (send the block stored). The scan skips ahead
+// faster the longer it goes without a match, so incompressible stretches
+// cost little.
+static inline size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst) {
+    uint16_t table[1 << LZ_HASH_BITS];
+    unsigned char *op = dst, *end = dst + (len ? len - 1 : 0);
+    size_t ip = 0, anchor = 0;
+    if (len > LZ_BLOCK_MAX) return 0;
+    memset(table, 0, sizeof(table));
+    // LZ4 ends every block with literals: no match starts in the last 12
+    // bytes or covers the last 5
+    while (len > 12 && ip < len - 12) {
+        uint32_t seq = lz_load32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = (uint16_t)ip;
+        if (ref >= ip || lz_load32(src + ref) != seq) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        size_t mlen = LZ_MIN_MATCH, max = len - 5 - ip;
+        while (mlen < max && src[ref + mlen] == src[ip + mlen]) mlen++;
+        if (lz_emit(&op, end, src + anchor, ip - anchor, ip - ref, mlen) != 0) return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    if (lz_emit(&op, end, src + anchor, len - anchor, 0, 0) != 0) return 0;
+    return (size_t)(op - dst);
+}
+
+// Decodes one block that must expand to exactly raw_len bytes; -1 if malformed
+static inline int lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t raw_len) {
+    size_t ip = 0, op = 0;
+    for (;;) {
+        if (ip >= len) return -1;
+        unsigned token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            unsigned char b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > len - ip || lit > raw_len - op) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == len) return op == raw_len ? 0 : -1;
+
+        if (len - ip < 2) return -1;
+        size_t off = get_u16(src + ip);
+        ip += 2;
+        if (off == 0 || off > op) return -1;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned char b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > raw_len - op) return -1;
+        // A match closer than its length overlaps its own output
+        if (off >= mlen) memcpy(dst + op, dst + op - off, mlen);
+        else for (size_t i = 0; i < mlen; i++) dst[op + i] = dst[op - off + i];
+        op += mlen;
+    }
+}
+
+// Builds the frame for one block in out (LZ_FRAME_HDR + len bytes at
+// most) and returns its size. With try_lz 0 the block is stored directly.
+static inline size_t lz_frame(const unsigned char *src, size_t len, unsigned char *out, int try_lz) {
+    size_t clen = try_lz ? lz_compress(src, len, out + LZ_FRAME_HDR) : 0;
+    if (clen == 0) {
+        memcpy(out + LZ_FRAME_HDR, src, len);
+        clen = len;
+    }
+    put_u32(out, (uint32_t)len);
+    put_u32(out + 4, (uint32_t)clen);
+    return LZ_FRAME_HDR + clen;
+}
+
+// Latency histograms in the style of HdrHistogram: values (nanoseconds)
+// below 2*HIST_SUB get a bucket each, above that every power of two is
+// split into HIST_SUB linear buckets, so a percentile read back is off by
+// at most 1/HIST_SUB of its value. Used by STATS and dropbox_loadgen.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40         // ~18 minutes, longer samples share the top bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+static inline int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS) * HIST_SUB + (int)(v >> (e - HIST_SUB_BITS));
+}
+
+// Largest value that falls into bucket i
+static inline uint64_t hist_value(int i) {
+    if (i < 2 * HIST_SUB) return (uint64_t)i;
+    int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return ((uint64_t)(i % HIST_SUB + HIST_SUB + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+// The q-quantile of total samples, capped at the largest value seen
+static inline uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double q, uint64_t max) {
+    uint64_t want = (uint64_t)(q * total + 0.999999), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= want) return hist_value(i) < max ? hist_value(i) : max;
+    }
+    return max;
+}
+
+#endif
@@ -1,19 +1,36 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/sendfile.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <time.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <linux/futex.h>
+
+#include "dropbox_proto.h"
 
 #define PORT 8080
 #define BACKLOG 16
@@ -21,11 +38,15 @@
 #define WORKER_POOL_SIZE 4
 #define CLIENT_Q_CAP 256
 #define MAX_FILENAME 256
-#define TMP_DIR "tmp_storage"
 #define STORAGE_DIR "storage"
 #define USERNAME_MAX 64
 #define PASS_MAX 64
 #define MAX_QUOTA (50 * 1024 * 1024)
+#define PROTO_VERSION 2
+#define SESSION_MAX_INFLIGHT 64
+#define TAGGED_FRAME_MAX (256 * 1024)
+#define BATCH_MAX_FILES 100000
+#define RECV_CHUNK (64 * 1024)
 
 static volatile sig_atomic_t running = 1;
 static void sigint_handler(int s) { (void)s; running = 0; }
@@ -45,47 +66,355 @@ static void ensure_dir(const char *path) {
     if (mkdir(path, 0755) != 0 && errno != EEXIST) perror_exit("mkdir");
 }
 
+// FNV-1a
+static uint32_t name_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+// One entry of a user's file index. Names are not allocated per file; they
+// live in the index's name arena and the node keeps their offset.
 typedef struct FileNode {
-    char *name;
+    uint32_t name_off;
+    uint32_t hash;
     size_t size;
-    struct FileNode *next;
+    uint32_t crc;            // CRC-32C of the contents
+    uint32_t has_crc;        // 0 for files found by a scan, never uploaded
 } FileNode;
 
+#define FILE_SLOT_EMPTY UINT32_MAX
+#define FILE_SLOT_DELETED (UINT32_MAX - 1)
+#define FILE_INDEX_INITIAL_SLOTS 16
+
+// Per-user open-addressing hash table of FileNodes (linear probing) with
+// an append-only name arena. Deleted names stay in the arena as garbage
+// until the next rehash compacts it. `sorted` caches slot indices in name
+// order for LIST and is rebuilt lazily after names are added or removed.
+typedef struct FileIndex {
+    FileNode *slots;
+    size_t nslots;
+    size_t count;
+    size_t deleted;
+    char *names;
+    size_t names_len, names_cap, names_garbage;
+    uint32_t *sorted;
+    size_t sorted_len;
+    int sorted_valid;
+} FileIndex;
+
+static const char *file_name(const FileIndex *fi, const FileNode *f) {
+    return fi->names + f->name_off;
+}
+
+static FileNode *file_index_find(FileIndex *fi, const char *name) {
+    if (fi->nslots == 0) return NULL;
+    uint32_t hash = name_hash(name);
+    size_t mask = fi->nslots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        FileNode *f = &fi->slots[i];
+        if (f->name_off == FILE_SLOT_EMPTY) return NULL;
+        if (f->name_off != FILE_SLOT_DELETED && f->hash == hash && strcmp(file_name(fi, f), name) == 0) return f;
+    }
+}
+
+static int file_arena_append(FileIndex *fi, const char *name, uint32_t *off) {
+    size_t len = strlen(name) + 1;
+    if (fi->names_len + len > fi->names_cap) {
+        size_t cap = fi->names_cap ? fi->names_cap : 1024;
+        while (fi->names_len + len > cap) cap *= 2;
+        if (cap >= FILE_SLOT_DELETED) return -1;
+        char *n = realloc(fi->names, cap);
+        if (!n) return -1;
+        fi->names = n; fi->names_cap = cap;
+    }
+    memcpy(fi->names + fi->names_len, name, len);
+    *off = (uint32_t)fi->names_len;
+    fi->names_len += len;
+    return 0;
+}
+
+// Rebuilds the table with nslots slots, dropping tombstones, and compacts
+// the name arena if more than half of it is garbage.
+static int file_index_rehash(FileIndex *fi, size_t nslots) {
+    FileNode *slots = malloc(nslots * sizeof(FileNode));
+    if (!slots) return -1;
+    for (size_t i = 0; i < nslots; i++) slots[i].name_off = FILE_SLOT_EMPTY;
+
+    char *names = fi->names;
+    size_t names_cap = fi->names_cap;
+    int compact = fi->names_garbage * 2 > fi->names_len;
+    if (compact) {
+        names_cap = fi->names_len - fi->names_garbage;
+        names = malloc(names_cap ? names_cap : 1);
+        if (!names) { free(slots); return -1; }
+    }
+
+    size_t names_len = 0;
+    for (size_t i = 0; i < fi->nslots; i++) {
+        FileNode f = fi->slots[i];
+        if (f.name_off >= FILE_SLOT_DELETED) continue;
+        if (compact) {
+            size_t len = strlen(fi->names + f.name_off) + 1;
+            memcpy(names + names_len, fi->names + f.name_off, len);
+            f.name_off = (uint32_t)names_len;
+            names_len += len;
+        }
+        size_t j = f.hash & (nslots - 1);
+        while (slots[j].name_off != FILE_SLOT_EMPTY) j = (j + 1) & (nslots - 1);
+        slots[j] = f;
+    }
+
+    if (compact) {
+        free(fi->names);
+        fi->names = names; fi->names_cap = names_cap;
+        fi->names_len = names_len; fi->names_garbage = 0;
+    }
+    free(fi->slots);
+    fi->slots = slots; fi->nslots = nslots;
+    fi->deleted = 0;
+    fi->sorted_valid = 0;
+    return 0;
+}
+
+// Inserts name or updates it in place. Returns the node, with *created
+// telling whether it is new, or NULL when out of memory.
+static FileNode *file_index_upsert(FileIndex *fi, const char *name, int *created) {
+    FileNode *f = file_index_find(fi, name);
+    *created = (f == NULL);
+    if (f) return f;
+
+    if ((fi->count + fi->deleted + 1) * 4 > fi->nslots * 3) {
+        size_t n = fi->nslots ? fi->nslots : FILE_INDEX_INITIAL_SLOTS;
+        while ((fi->count + 1) * 2 > n) n *= 2;
+        if (file_index_rehash(fi, n) != 0) return NULL;
+    }
+    uint32_t hash = name_hash(name);
+    uint32_t off;
+    if (file_arena_append(fi, name, &off) != 0) return NULL;
+    size_t mask = fi->nslots - 1;
+    size_t i = hash & mask;
+    while (fi->slots[i].name_off < FILE_SLOT_DELETED) i = (i + 1) & mask;
+    f = &fi->slots[i];
+    if (f->name_off == FILE_SLOT_DELETED) fi->deleted--;
+    f->name_off = off;
+    f->hash = hash;
+    f->size = 0;
+    f->has_crc = 0;
+    fi->count++;
+    fi->sorted_valid = 0;
+    return f;
+}
+
+static void file_index_remove(FileIndex *fi, FileNode *f) {
+    fi->names_garbage += strlen(file_name(fi, f)) + 1;
+    f->name_off = FILE_SLOT_DELETED;
+    fi->count--;
+    fi->deleted++;
+    fi->sorted_valid = 0;
+}
+
+static int file_slot_cmp(const void *a, const void *b, void *arg) {
+    const FileIndex *fi = arg;
+    return strcmp(fi->names + fi->slots[*(const uint32_t *)a].name_off,
+                  fi->names + fi->slots[*(const uint32_t *)b].name_off);
+}
+
+static int file_index_sort(FileIndex *fi) {
+    if (fi->sorted_valid) return 0;
+    uint32_t *sorted = realloc(fi->sorted, (fi->count ? fi->count : 1) * sizeof(uint32_t));
+    if (!sorted) return -1;
+    fi->sorted = sorted;
+    size_t n = 0;
+    for (size_t i = 0; i < fi->nslots; i++) {
+        if (fi->slots[i].name_off < FILE_SLOT_DELETED) sorted[n++] = (uint32_t)i;
+    }
+    qsort_r(sorted, n, sizeof(uint32_t), file_slot_cmp, fi);
+    fi->sorted_len = n;
+    fi->sorted_valid = 1;
+    return 0;
+}
+
 typedef struct User {
     char username[USERNAME_MAX];
     char password[PASS_MAX];
+    uint32_t hash;
     size_t used;
-    FileNode *files;
+    size_t reserved;         // declared sizes of uploads not committed yet
+    int committing;          // uploads between storage commit and index update
+    uint64_t commits;        // ... and how many have passed that window
+    FileIndex files;
     pthread_mutex_t ulock;
-    struct User *next;
+    int indexed;             // 0 while the startup scan has not reached it
+    int transfers;           // uploads and downloads in progress, for STATS
+    struct User *next;       // bucket chain within a shard
 } User;
 
-static User *users = NULL;
-static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Users live in a hash table split into independently locked shards, so
+// lookups are O(1) and users in different shards never contend. Users are
+// never removed, which lets sessions resolve their User once at LOGIN and
+// keep the pointer; after that only u->ulock is taken.
+#define USER_SHARDS 64
+#define USER_SHARD_INITIAL_BUCKETS 16
+
+typedef struct UserShard {
+    pthread_rwlock_t lock;
+    User **buckets;
+    size_t nbuckets;
+    size_t count;
+} UserShard;
+
+static UserShard user_shards[USER_SHARDS];
+
+void user_table_init(void) {
+    for (int i = 0; i < USER_SHARDS; i++) {
+        pthread_rwlock_init(&user_shards[i].lock, NULL);
+        user_shards[i].nbuckets = USER_SHARD_INITIAL_BUCKETS;
+        user_shards[i].buckets = calloc(USER_SHARD_INITIAL_BUCKETS, sizeof(User *));
+        if (!user_shards[i].buckets) perror_exit("calloc");
+    }
+}
+
+static UserShard *user_shard(uint32_t hash) {
+    return &user_shards[hash % USER_SHARDS];
+}
 
-static User *user_find_locked(const char *username) {
-    User *u = users;
+static User *shard_find_locked(UserShard *sh, const char *username, uint32_t hash) {
+    User *u = sh->buckets[(hash / USER_SHARDS) & (sh->nbuckets - 1)];
     while (u) {
-        if (strcmp(u->username, username) == 0) return u;
+        if (u->hash == hash && strcmp(u->username, username) == 0) return u;
         u = u->next;
     }
     return NULL;
 }
 
+static void shard_grow_locked(UserShard *sh) {
+    size_t n = sh->nbuckets * 2;
+    User **nb = calloc(n, sizeof(User *));
+    if (!nb) return;                    // keep the longer chains
+    for (size_t i = 0; i < sh->nbuckets; i++) {
+        User *u = sh->buckets[i];
+        while (u) {
+            User *next = u->next;
+            size_t b = (u->hash / USER_SHARDS) & (n - 1);
+            u->next = nb[b]; nb[b] = u;
+            u = next;
+        }
+    }
+    free(sh->buckets);
+    sh->buckets = nb; sh->nbuckets = n;
+}
+
+User *user_lookup(const char *username) {
+    uint32_t hash = name_hash(username);
+    UserShard *sh = user_shard(hash);
+    pthread_rwlock_rdlock(&sh->lock);
+    User *u = shard_find_locked(sh, username, hash);
+    pthread_rwlock_unlock(&sh->lock);
+    return u;
+}
+
+// Persistent metadata. Accounts and file indexes live in memory and are
+// made durable in META_DIR: every change is appended to a write-ahead log,
+// and a background thread compacts the whole table into a snapshot once
+// the log has grown. Logs are numbered by generation and the snapshot
+// records the first generation it does not fully contain, so startup maps
+// the snapshot and replays that log and any newer one. Records are
+// last-writer-wins updates (create user, set file size, remove file), so
+// replaying a log over a snapshot that already holds part of it yields the
+// same state. Like file data, records are written but not fsync'd: they
+// survive a server crash, not a power failure.
+#define META_DIR STORAGE_DIR "/.meta"
+#define META_SNAPSHOT_MAGIC "DBXSNAP2"
+#define META_SNAPSHOT_MAGIC_V1 "DBXSNAP1"   // without checksums
+#define META_COMPACT_BYTES (8 * 1024 * 1024)
+#define META_COMPACT_INTERVAL 300
+#define META_REC_MAX 1024
+
+enum { META_USER = 1, META_FILE_SET = 2, META_FILE_REMOVE = 3 };
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t grown;
+    int fd;                  // current log; -1 while loading, when nothing is logged
+    uint64_t gen;
+    size_t wal_bytes;
+} meta = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1, 0, 0 };
+
+static int meta_restored;    // meta_load found a snapshot or log
+
+static size_t meta_put_str(unsigned char *rec, size_t n, const char *str) {
+    size_t len = strlen(str);
+    put_u16(rec + n, (uint16_t)len);
+    memcpy(rec + n + 2, str, len);
+    return n + 2 + len;
+}
+
+// rec[0..8) is left for the header: payload length and CRC-32C
+static void meta_append(unsigned char *rec, size_t len) {
+    put_u32(rec, (uint32_t)(len - 8));
+    put_u32(rec + 4, crc32c(0, rec + 8, len - 8));
+    pthread_mutex_lock(&meta.lock);
+    if (meta.fd >= 0) {
+        // A short write leaves a torn record, which replay discards
+        if (write(meta.fd, rec, len) != (ssize_t)len) perror("metadata log");
+        meta.wal_bytes += len;
+        if (meta.wal_bytes >= META_COMPACT_BYTES) pthread_cond_signal(&meta.grown);
+    }
+    pthread_mutex_unlock(&meta.lock);
+}
+
+static void meta_log_user(const char *username, const char *password) {
+    unsigned char rec[META_REC_MAX];
+    size_t n = 8;
+    rec[n++] = META_USER;
+    n = meta_put_str(rec, n, username);
+    n = meta_put_str(rec, n, password);
+    meta_append(rec, n);
+}
+
+// Callers hold u->ulock so that log order matches the order of updates.
+// A file's checksum, when known, follows its size.
+static void meta_log_file(const char *username, const char *filename, int removed, size_t size, const uint32_t *crc) {
+    unsigned char rec[META_REC_MAX];
+    size_t n = 8;
+    rec[n++] = removed ? META_FILE_REMOVE : META_FILE_SET;
+    n = meta_put_str(rec, n, username);
+    n = meta_put_str(rec, n, filename);
+    if (!removed) { put_u64(rec + n, size); n += 8; }
+    if (!removed && crc) { put_u32(rec + n, *crc); n += 4; }
+    meta_append(rec, n);
+}
+
+// User directories sit next to the hidden .engine and .chunks entries
+static int valid_username(const char *name) {
+    return name[0] && name[0] != '.' && !strchr(name, '/');
+}
+
 int user_create(const char *username, const char *password) {
-    pthread_mutex_lock(&users_mutex);
-    if (user_find_locked(username) != NULL) {
-        pthread_mutex_unlock(&users_mutex);
+    if (!valid_username(username)) return -1;
+    uint32_t hash = name_hash(username);
+    UserShard *sh = user_shard(hash);
+    pthread_rwlock_wrlock(&sh->lock);
+    if (shard_find_locked(sh, username, hash) != NULL) {
+        pthread_rwlock_unlock(&sh->lock);
         return -1;
     }
     User *u = calloc(1, sizeof(User));
-    if (!u) { pthread_mutex_unlock(&users_mutex); return -1; }
+    if (!u) { pthread_rwlock_unlock(&sh->lock); return -1; }
     strncpy(u->username, username, USERNAME_MAX-1);
     strncpy(u->password, password, PASS_MAX-1);
-    u->used = 0; u->files = NULL;
+    u->hash = hash;
+    u->used = 0;
+    u->indexed = 1;
     pthread_mutex_init(&u->ulock, NULL);
-    u->next = users; users = u;
-    pthread_mutex_unlock(&users_mutex);
+    if (sh->count >= sh->nbuckets * 2) shard_grow_locked(sh);
+    size_t b = (hash / USER_SHARDS) & (sh->nbuckets - 1);
+    u->next = sh->buckets[b]; sh->buckets[b] = u;
+    sh->count++;
+    // Logged before anyone can log in and add files for this user
+    meta_log_user(username, password);
+    pthread_rwlock_unlock(&sh->lock);
 
     char path[512];
     ensure_dir(STORAGE_DIR);
@@ -94,540 +423,4359 @@ int user_create(const char *username, const char *password) {
     return 0;
 }
 
-int user_check_password(const char *username, const char *password) {
-    pthread_mutex_lock(&users_mutex);
-    User *u = user_find_locked(username);
-    if (!u) { pthread_mutex_unlock(&users_mutex); return -1; }
-    int ok = (strcmp(u->password, password) == 0);
-    pthread_mutex_unlock(&users_mutex);
-    return ok ? 0 : -1;
+// Returns the user if the credentials match. Passwords never change after
+// creation, so no lock is needed to compare them.
+User *user_login(const char *username, const char *password) {
+    User *u = user_lookup(username);
+    if (!u || strcmp(u->password, password) != 0) return NULL;
+    return u;
 }
 
-void user_add_file(const char *username, const char *filename, size_t size) {
-    pthread_mutex_lock(&users_mutex);
-    User *u = user_find_locked(username);
-    if (!u) { pthread_mutex_unlock(&users_mutex); return; }
+// *has_crc tells whether *crc holds the file's checksum
+int user_stat_file(User *u, const char *filename, size_t *size, uint32_t *crc, int *has_crc) {
     pthread_mutex_lock(&u->ulock);
-    FileNode *f = calloc(1, sizeof(FileNode));
-    f->name = strdup(filename);
-    f->size = size;
-    f->next = u->files;
-    u->files = f;
-    u->used += size;
+    FileNode *f = file_index_find(&u->files, filename);
+    if (f) {
+        *size = f->size;
+        *crc = f->crc;
+        *has_crc = f->has_crc;
+    }
     pthread_mutex_unlock(&u->ulock);
-    pthread_mutex_unlock(&users_mutex);
+    return f ? 0 : -1;
 }
 
-int user_remove_file(const char *username, const char *filename, size_t *out_size) {
-    pthread_mutex_lock(&users_mutex);
-    User *u = user_find_locked(username);
-    if (!u) { pthread_mutex_unlock(&users_mutex); return -1; }
+// Adds filename or overwrites it in place, replacing its old size in the
+// quota. The upload's reservation turns into used space in the same step.
+// crc is NULL when the contents were never checksummed.
+void user_add_file(User *u, const char *filename, size_t size, const uint32_t *crc, size_t reserved) {
     pthread_mutex_lock(&u->ulock);
-    FileNode **pp = &u->files;
-    while (*pp) {
-        if (strcmp((*pp)->name, filename) == 0) {
-            FileNode *tmp = *pp;
-            *pp = tmp->next;
-            size_t sz = tmp->size;
-            free(tmp->name); free(tmp);
-            u->used -= sz;
-            if (out_size) *out_size = sz;
-            pthread_mutex_unlock(&u->ulock);
-            pthread_mutex_unlock(&users_mutex);
-            return 0;
-        }
-        pp = &((*pp)->next);
+    int created;
+    FileNode *f = file_index_upsert(&u->files, filename, &created);
+    if (f) {
+        u->used -= f->size;
+        f->size = size;
+        f->crc = crc ? *crc : 0;
+        f->has_crc = crc != NULL;
+        u->used += size;
+        meta_log_file(u->username, filename, 0, size, crc);
     }
+    u->reserved -= reserved;
     pthread_mutex_unlock(&u->ulock);
-    pthread_mutex_unlock(&users_mutex);
-    return -1;
 }
 
-char *user_list_files(const char *username) {
-    pthread_mutex_lock(&users_mutex);
-    User *u = user_find_locked(username);
-    if (!u) { pthread_mutex_unlock(&users_mutex); return NULL; }
+int user_remove_file(User *u, const char *filename, size_t *out_size) {
+    pthread_mutex_lock(&u->ulock);
+    FileNode *f = file_index_find(&u->files, filename);
+    if (!f) { pthread_mutex_unlock(&u->ulock); return -1; }
+    size_t sz = f->size;
+    file_index_remove(&u->files, f);
+    u->used -= sz;
+    meta_log_file(u->username, filename, 1, 0, NULL);
+    if (out_size) *out_size = sz;
+    pthread_mutex_unlock(&u->ulock);
+    return 0;
+}
+
+// Reserves size bytes of quota for an upload to filename, counting every
+// other reservation as already stored. An existing file of that name is
+// credited since it would be overwritten; concurrent uploads to one name
+// each get the credit, but only one of them survives, so that is safe.
+int user_quota_reserve(User *u, const char *filename, size_t size) {
+    pthread_mutex_lock(&u->ulock);
+    FileNode *f = file_index_find(&u->files, filename);
+    size_t used = u->used + u->reserved - (f ? f->size : 0);
+    int ok = size <= MAX_QUOTA && used + size <= MAX_QUOTA;
+    if (ok) u->reserved += size;
+    pthread_mutex_unlock(&u->ulock);
+    return ok ? 0 : -1;
+}
+
+// Commits and deletes of one file run one at a time, from reading the
+// version they replace to updating the index, so the stored file, the
+// chunks it references and its index entry all come from the same upload.
+// Locks are striped by user and name.
+#define COMMIT_LOCKS 64
+static pthread_mutex_t commit_locks[COMMIT_LOCKS] = { [0 ... COMMIT_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_mutex_t *commit_lock(const User *u, const char *filename) {
+    return &commit_locks[(u->hash ^ name_hash(filename)) % COMMIT_LOCKS];
+}
+
+// Brackets an upload's storage commit and index update. Data read from
+// storage only matches the index checksums if no commit overlapped the read.
+static void user_commit_begin(User *u) {
+    pthread_mutex_lock(&u->ulock);
+    u->committing++;
+    pthread_mutex_unlock(&u->ulock);
+}
+
+static void user_commit_end(User *u) {
+    pthread_mutex_lock(&u->ulock);
+    u->committing--;
+    u->commits++;
+    pthread_mutex_unlock(&u->ulock);
+}
+
+// The checksum of filename, if known and no commit is running; *commits
+// is then passed to user_commits_changed once the data has been read
+static int user_file_crc(User *u, const char *filename, uint32_t *crc, uint64_t *commits) {
+    pthread_mutex_lock(&u->ulock);
+    FileNode *f = file_index_find(&u->files, filename);
+    int ok = f && f->has_crc && u->committing == 0;
+    if (ok) *crc = f->crc;
+    *commits = u->commits;
+    pthread_mutex_unlock(&u->ulock);
+    return ok ? 0 : -1;
+}
+
+static int user_commits_changed(User *u, uint64_t commits) {
     pthread_mutex_lock(&u->ulock);
+    int changed = u->committing != 0 || u->commits != commits;
+    pthread_mutex_unlock(&u->ulock);
+    return changed;
+}
+
+void user_quota_release(User *u, size_t size) {
+    if (size == 0) return;
+    pthread_mutex_lock(&u->ulock);
+    u->reserved -= size;
+    pthread_mutex_unlock(&u->ulock);
+}
+
+char *user_list_files(User *u) {
+    pthread_mutex_lock(&u->ulock);
+    FileIndex *fi = &u->files;
+    if (file_index_sort(fi) != 0) { pthread_mutex_unlock(&u->ulock); return NULL; }
     size_t cap = 1024;
     char *buf = malloc(cap);
-    if (!buf) { pthread_mutex_unlock(&u->ulock); pthread_mutex_unlock(&users_mutex); return NULL; }
+    if (!buf) { pthread_mutex_unlock(&u->ulock); return NULL; }
     size_t len = 0;
     len += snprintf(buf+len, cap-len, "Storage used: %zu bytes\n", u->used);
-    FileNode *f = u->files;
-    while (f) {
-        size_t needed = strlen(f->name) + 50;
-        if (len + needed + 1 > cap) { cap *= 2; buf = realloc(buf, cap); }
-        len += snprintf(buf+len, cap-len, "%s (%zu bytes)\n", f->name, f->size);
-        f = f->next;
+    for (size_t i = 0; i < fi->sorted_len; i++) {
+        FileNode *f = &fi->slots[fi->sorted[i]];
+        const char *name = file_name(fi, f);
+        size_t needed = strlen(name) + 50;
+        if (len + needed + 1 > cap) {
+            while (len + needed + 1 > cap) cap *= 2;
+            char *nb = realloc(buf, cap);
+            if (!nb) { free(buf); pthread_mutex_unlock(&u->ulock); return NULL; }
+            buf = nb;
+        }
+        if (f->has_crc) len += snprintf(buf+len, cap-len, "%s (%zu bytes, crc32c %08x)\n", name, f->size, f->crc);
+        else len += snprintf(buf+len, cap-len, "%s (%zu bytes)\n", name, f->size);
+    }
+    pthread_mutex_unlock(&u->ulock);
+    return buf;
+}
+
+// Names matching any of the fnmatch patterns, in name order, each followed
+// by a newline; *count gets their number
+char *user_match_files(User *u, char **patterns, int npatterns, size_t *count) {
+    pthread_mutex_lock(&u->ulock);
+    FileIndex *fi = &u->files;
+    size_t cap = 1024, len = 0;
+    char *buf = file_index_sort(fi) == 0 ? malloc(cap) : NULL;
+    *count = 0;
+    for (size_t i = 0; buf && i < fi->sorted_len; i++) {
+        const char *name = file_name(fi, &fi->slots[fi->sorted[i]]);
+        int match = 0;
+        for (int k = 0; k < npatterns && !match; k++) match = fnmatch(patterns[k], name, 0) == 0;
+        if (!match) continue;
+        size_t n = strlen(name);
+        if (len + n + 2 > cap) {
+            while (len + n + 2 > cap) cap *= 2;
+            char *nb = realloc(buf, cap);
+            if (!nb) { free(buf); buf = NULL; break; }
+            buf = nb;
+        }
+        memcpy(buf + len, name, n);
+        buf[len + n] = '\n';
+        len += n + 1;
+        (*count)++;
     }
+    if (buf) buf[len] = '\0';
     pthread_mutex_unlock(&u->ulock);
-    pthread_mutex_unlock(&users_mutex);
     return buf;
 }
 
-enum TaskType { TASK_UPLOAD=1, TASK_DOWNLOAD=2, TASK_DELETE=3, TASK_LIST=4 };
+// Bounds-checked reading of snapshot and log records
+typedef struct MetaCursor {
+    const unsigned char *p, *end;
+} MetaCursor;
+
+static int meta_get_str(MetaCursor *c, char *out, size_t cap) {
+    if (c->end - c->p < 2) return -1;
+    size_t len = get_u16(c->p);
+    if ((size_t)(c->end - c->p) - 2 < len || len >= cap) return -1;
+    memcpy(out, c->p + 2, len);
+    out[len] = '\0';
+    c->p += 2 + len;
+    return 0;
+}
+
+static int meta_get_u64(MetaCursor *c, uint64_t *v) {
+    if (c->end - c->p < 8) return -1;
+    *v = get_u64(c->p);
+    c->p += 8;
+    return 0;
+}
+
+static int meta_apply(const unsigned char *rec, size_t len) {
+    MetaCursor c = { rec + 1, rec + len };
+    char username[USERNAME_MAX], password[PASS_MAX], filename[MAX_FILENAME];
+    uint64_t size;
+    if (len < 1 || meta_get_str(&c, username, sizeof(username)) != 0) return -1;
+    if (rec[0] == META_USER) {
+        if (meta_get_str(&c, password, sizeof(password)) != 0) return -1;
+        user_create(username, password);
+        return 0;
+    }
+    if (meta_get_str(&c, filename, sizeof(filename)) != 0) return -1;
+    User *u = user_lookup(username);
+    if (rec[0] == META_FILE_SET) {
+        if (meta_get_u64(&c, &size) != 0) return -1;
+        // Records written before checksums end after the size
+        int has_crc = c.end - c.p >= 4;
+        uint32_t crc = has_crc ? get_u32(c.p) : 0;
+        if (u) user_add_file(u, filename, (size_t)size, has_crc ? &crc : NULL, 0);
+        return 0;
+    }
+    if (rec[0] == META_FILE_REMOVE) {
+        if (u) user_remove_file(u, filename, NULL);
+        return 0;
+    }
+    return -1;
+}
+
+static void meta_wal_path(uint64_t gen, char *path, size_t len) {
+    snprintf(path, len, "%s/wal.%020llu", META_DIR, (unsigned long long)gen);
+}
+
+// Snapshot: magic, u64 first log generation to replay, u64 user count, then
+// per user its name, password, u64 file count and (name, u64 size, u64
+// checksum) triples; the checksum word is 1 << 32 | CRC-32C, or 0 if the
+// file has none. DBXSNAP1 snapshots have no checksum words.
+// Strings are a u16 length and the bytes.
+static int meta_load_snapshot(uint64_t *gen) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/snapshot", META_DIR);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 24) { close(fd); errno = EINVAL; return -1; }
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    int v1 = memcmp(map, META_SNAPSHOT_MAGIC_V1, 8) == 0;
+    int rc = v1 || memcmp(map, META_SNAPSHOT_MAGIC, 8) == 0 ? 0 : -1;
+    MetaCursor c = { map + 24, map + st.st_size };
+    uint64_t nusers = get_u64(map + 16);
+    *gen = get_u64(map + 8);
+    for (uint64_t i = 0; rc == 0 && i < nusers; i++) {
+        char username[USERNAME_MAX], password[PASS_MAX], filename[MAX_FILENAME];
+        uint64_t nfiles, size, check = 0;
+        if (meta_get_str(&c, username, sizeof(username)) != 0 || meta_get_str(&c, password, sizeof(password)) != 0 ||
+            meta_get_u64(&c, &nfiles) != 0) { rc = -1; break; }
+        user_create(username, password);
+        User *u = user_lookup(username);
+        for (uint64_t k = 0; rc == 0 && k < nfiles; k++) {
+            if (meta_get_str(&c, filename, sizeof(filename)) != 0 || meta_get_u64(&c, &size) != 0 ||
+                (!v1 && meta_get_u64(&c, &check) != 0)) {
+                rc = -1;
+            } else if (u) {
+                uint32_t crc = (uint32_t)check;
+                user_add_file(u, filename, (size_t)size, check >> 32 ? &crc : NULL, 0);
+            }
+        }
+    }
+    munmap(map, st.st_size);
+    if (rc != 0) errno = EINVAL;
+    return rc;
+}
+
+// Applies every intact record of a log. A torn record at the end (a crash
+// mid-write) and anything after it is cut off so new records follow
+// directly after the last good one.
+static void meta_replay(const char *path) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return; }
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) { close(fd); return; }
+    size_t size = st.st_size, off = 0;
+    while (off + 8 <= size) {
+        uint32_t len = get_u32(map + off);
+        if (len == 0 || len > META_REC_MAX || off + 8 + len > size) break;
+        if (crc32c(0, map + off + 8, len) != get_u32(map + off + 4)) break;
+        if (meta_apply(map + off + 8, len) != 0) break;
+        off += 8 + len;
+    }
+    munmap(map, size);
+    if (off < size) {
+        fprintf(stderr, "%s: dropping %zu bytes of torn log\n", path, size - off);
+        if (ftruncate(fd, off) != 0) perror("ftruncate");
+    }
+    close(fd);
+}
+
+static int gen_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Generations of the logs in META_DIR, sorted; returns the count
+static size_t meta_list_wals(uint64_t **gens) {
+    size_t n = 0, cap = 8;
+    *gens = malloc(cap * sizeof(uint64_t));
+    DIR *d = opendir(META_DIR);
+    struct dirent *e;
+    while (*gens && d && (e = readdir(d)) != NULL) {
+        unsigned long long g;
+        char tail;
+        if (sscanf(e->d_name, "wal.%llu%c", &g, &tail) != 1) continue;
+        if (n == cap) {
+            uint64_t *ng = realloc(*gens, cap * 2 * sizeof(uint64_t));
+            if (!ng) break;
+            *gens = ng; cap *= 2;
+        }
+        (*gens)[n++] = g;
+    }
+    if (d) closedir(d);
+    if (*gens) qsort(*gens, n, sizeof(uint64_t), gen_cmp);
+    return n;
+}
+
+// Restores users and file indexes, then opens the log for new records
+int meta_load(void) {
+    ensure_dir(META_DIR);
+    uint64_t gen = 0;
+    if (meta_load_snapshot(&gen) != 0) {
+        fprintf(stderr, "Cannot load %s/snapshot: %s\n", META_DIR, strerror(errno));
+        return -1;
+    }
+    uint64_t *gens;
+    size_t n = meta_list_wals(&gens);
+    char path[512];
+    char snap[512];
+    snprintf(snap, sizeof(snap), "%s/snapshot", META_DIR);
+    meta_restored = n > 0 || access(snap, F_OK) == 0;
+    for (size_t i = 0; i < n; i++) {
+        if (gens[i] < gen) continue;
+        meta_wal_path(gens[i], path, sizeof(path));
+        meta_replay(path);
+        gen = gens[i];
+    }
+    free(gens);
+
+    meta_wal_path(gen, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) { perror(path); if (fd >= 0) close(fd); return -1; }
+    pthread_mutex_lock(&meta.lock);
+    meta.fd = fd;
+    meta.gen = gen;
+    meta.wal_bytes = st.st_size;
+    pthread_mutex_unlock(&meta.lock);
+    return 0;
+}
+
+static void meta_write_str(FILE *fp, const char *str) {
+    unsigned char len[2];
+    put_u16(len, (uint16_t)strlen(str));
+    fwrite(len, 1, 2, fp);
+    fwrite(str, 1, strlen(str), fp);
+}
+
+static void meta_write_u64(FILE *fp, uint64_t v) {
+    unsigned char buf[8];
+    put_u64(buf, v);
+    fwrite(buf, 1, 8, fp);
+}
+
+// Switches to a new log, writes a snapshot that covers everything before
+// it and drops the older logs. Updates made while the snapshot is written
+// go to the new log, which is replayed on top of it.
+static int meta_compact_locked(void) {
+    char path[512], tmp[512];
+    pthread_mutex_lock(&meta.lock);
+    uint64_t gen = meta.gen + 1;
+    meta_wal_path(gen, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) { pthread_mutex_unlock(&meta.lock); return -1; }
+    close(meta.fd);
+    meta.fd = fd;
+    meta.gen = gen;
+    meta.wal_bytes = 0;
+    pthread_mutex_unlock(&meta.lock);
+
+    snprintf(tmp, sizeof(tmp), "%s/snapshot.tmp", META_DIR);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return -1;
+    fwrite(META_SNAPSHOT_MAGIC, 1, 8, fp);
+    meta_write_u64(fp, gen);
+    meta_write_u64(fp, 0);   // user count, filled in below
+    uint64_t nusers = 0;
+    for (int i = 0; i < USER_SHARDS; i++) {
+        UserShard *sh = &user_shards[i];
+        pthread_rwlock_rdlock(&sh->lock);
+        for (size_t b = 0; b < sh->nbuckets; b++) {
+            for (User *u = sh->buckets[b]; u; u = u->next) {
+                pthread_mutex_lock(&u->ulock);
+                FileIndex *fi = &u->files;
+                meta_write_str(fp, u->username);
+                meta_write_str(fp, u->password);
+                meta_write_u64(fp, fi->count);
+                for (size_t k = 0; k < fi->nslots; k++) {
+                    FileNode *f = &fi->slots[k];
+                    if (f->name_off == FILE_SLOT_EMPTY || f->name_off == FILE_SLOT_DELETED) continue;
+                    meta_write_str(fp, file_name(fi, f));
+                    meta_write_u64(fp, f->size);
+                    meta_write_u64(fp, f->has_crc ? (uint64_t)1 << 32 | f->crc : 0);
+                }
+                pthread_mutex_unlock(&u->ulock);
+                nusers++;
+            }
+        }
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    int rc = fseek(fp, 16, SEEK_SET);
+    meta_write_u64(fp, nusers);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) rc = -1;
+    if (fclose(fp) != 0) rc = -1;
+    snprintf(path, sizeof(path), "%s/snapshot", META_DIR);
+    if (rc != 0 || rename(tmp, path) != 0) { unlink(tmp); return -1; }
+    int dfd = open(META_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) { fsync(dfd); close(dfd); }
+
+    uint64_t *gens;
+    size_t n = meta_list_wals(&gens);
+    for (size_t i = 0; i < n && gens[i] < gen; i++) {
+        meta_wal_path(gens[i], path, sizeof(path));
+        unlink(path);
+    }
+    free(gens);
+    return 0;
+}
+
+// The startup scan and the meta thread may both compact
+static int meta_compact(void) {
+    static pthread_mutex_t compacting = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&compacting);
+    int rc = meta_compact_locked();
+    pthread_mutex_unlock(&compacting);
+    return rc;
+}
+
+// Compacts when the log passes META_COMPACT_BYTES, and every
+// META_COMPACT_INTERVAL seconds if anything was logged at all
+void *meta_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&meta.lock);
+    while (running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += META_COMPACT_INTERVAL;
+        while (meta.wal_bytes < META_COMPACT_BYTES && pthread_cond_timedwait(&meta.grown, &meta.lock, &deadline) == 0) {}
+        if (meta.wal_bytes == 0) continue;
+        pthread_mutex_unlock(&meta.lock);
+        if (meta_compact() != 0) perror("metadata snapshot");
+        pthread_mutex_lock(&meta.lock);
+    }
+    pthread_mutex_unlock(&meta.lock);
+    return NULL;
+}
+
+// Metrics. Every recording thread owns a Metrics block that only it writes,
+// so the hot path takes no lock and does no atomic read-modify-write; STATS
+// and the dump file sum all blocks with relaxed loads. Latencies go into
+// the log-linear histograms of dropbox_proto.h.
+#define STATS_DUMP_INTERVAL 10
+
+enum MetricKind { OP_SIGNUP, OP_LOGIN, OP_UPLOAD, OP_DOWNLOAD, OP_DELTA, OP_DELETE, OP_LIST, OP_STAT,
+                  OP_MUPLOAD, OP_MDOWNLOAD, OP_STRIPE, OP_OTHER, WAIT_CLIENTQ, WAIT_TASKQ, METRIC_KINDS };
+static const char *metric_names[METRIC_KINDS] = {
+    "op.signup", "op.login", "op.upload", "op.download", "op.delta_upload", "op.delete", "op.list", "op.stat",
+    "op.mupload", "op.mdownload", "op.stripe", "op.other", "wait.clientq", "wait.taskq" };
+
+typedef struct Metrics {
+    uint64_t count[METRIC_KINDS];
+    uint64_t sum_ns[METRIC_KINDS];
+    uint64_t max_ns[METRIC_KINDS];
+    uint64_t hist[METRIC_KINDS][HIST_BUCKETS];
+    uint64_t bytes_in, bytes_out;
+    struct Metrics *next;
+} Metrics;
+
+static Metrics *metrics_all;             // every thread's block, never freed
+static __thread Metrics *metrics_mine;
+static time_t metrics_started;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static Metrics *metrics_self(void) {
+    Metrics *m = metrics_mine;
+    if (m) return m;
+    m = calloc(1, sizeof(Metrics));
+    if (!m) return NULL;
+    m->next = __atomic_load_n(&metrics_all, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metrics_all, &m->next, m, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    return metrics_mine = m;
+}
+
+// Single writer: a plain add published with a relaxed store
+static inline void metric_add(uint64_t *c, uint64_t v) {
+    __atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+static void metrics_record(enum MetricKind k, uint64_t ns) {
+    Metrics *m = metrics_self();
+    if (!m) return;
+    metric_add(&m->count[k], 1);
+    metric_add(&m->sum_ns[k], ns);
+    if (ns > m->max_ns[k]) __atomic_store_n(&m->max_ns[k], ns, __ATOMIC_RELAXED);
+    metric_add(&m->hist[k][hist_index(ns)], 1);
+}
+
+static void metrics_bytes_in(size_t n) {
+    Metrics *m = metrics_self();
+    if (m) metric_add(&m->bytes_in, n);
+}
+
+static void metrics_bytes_out(size_t n) {
+    Metrics *m = metrics_self();
+    if (m) metric_add(&m->bytes_out, n);
+}
+
+// TASK_SEND does no storage work: it only runs its completion, which
+// streams the next frame of a pipelined download
+enum TaskType { TASK_UPLOAD=1, TASK_DOWNLOAD=2, TASK_DELETE=3, TASK_LIST=4, TASK_SIGNATURES=5, TASK_SEND=6, TASK_STAT=7 };
 
 typedef struct Task {
     enum TaskType type;
-    char username[USERNAME_MAX];
+    User *user;
     char filename[MAX_FILENAME];
-    char tmp_path[512];
+    char tmp_path[512];      // named staging file, empty for O_TMPFILE
     size_t filesize;
+    size_t reserved;         // TASK_UPLOAD: quota its upload holds
+    uint32_t crc;            // contents checksum: known for TASK_UPLOAD
+    int has_crc;             // unless striped, found by TASK_STAT/DOWNLOAD
     char *result_buf;
     size_t result_size;
+    int fd;
+    struct FileReader *reader;   // TASK_DOWNLOAD and TASK_SIGNATURES result
     int status;
     char errmsg[256];
+    uint64_t queued_ns;      // when last pushed, for wait.taskq
+    uint64_t started_ns;     // tagged requests: when their command was read
 
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+    uint32_t done;           // completion word, see completion_wait
+    struct TaskPool *pool;   // pool the task returns to when freed
+
+    // Tagged (pipelined) requests complete asynchronously: instead of
+    // waking a waiter the worker calls complete, which replies and frees t
+    void (*complete)(struct Task *t);
+    struct Session *session;
+    char tag[24];
+    struct Upload *upload;   // upload being committed
+    off_t send_off;          // download range still to be sent
+    size_t send_left;
 
     struct Task *next;
+    struct Task *prev;       // deque link, see push_task
 } Task;
 
+// Task scheduling. By default every worker owns a deque: submitters push
+// to the deque of their connection's home worker, the owner takes the
+// oldest task and idle workers steal the newest task of another deque, so
+// no lock is shared by every enqueue and dequeue. --sched=global keeps the
+// original single queue.
+enum { SCHED_STEAL, SCHED_GLOBAL };
+static int sched_mode = SCHED_STEAL;
+
+typedef struct TaskDeque {
+    pthread_mutex_t lock;
+    Task *head, *tail;              // head is the oldest task
+    size_t count;
+} __attribute__((aligned(64))) TaskDeque;
+
+static TaskDeque *sched_deques;
+static int sched_nqueues;
+static unsigned sched_next_home;    // round robin for threads without a home
+
+// Workers asleep waiting for a task. A worker re-checks every deque after
+// announcing itself idle and a submitter checks sched_idle after publishing
+// a task, so no wakeup is lost and the fast paths share no written counter.
+static int sched_idle;
+static pthread_mutex_t sched_sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_sleep_cond = PTHREAD_COND_INITIALIZER;
+
+// Deque a thread submits to: a worker's own one, or the home worker of
+// the connection a client thread is serving (see session_run)
+static __thread int sched_home = -1;
+
 static Task *task_head = NULL;
 static Task *task_tail = NULL;
+static size_t task_count;
 static pthread_mutex_t taskq_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t taskq_cond = PTHREAD_COND_INITIALIZER;
 
-void push_task(Task *t) {
+void sched_init(int nqueues) {
+    free(sched_deques);
+    sched_nqueues = nqueues;
+    sched_deques = calloc(nqueues, sizeof(TaskDeque));
+    if (!sched_deques) perror_exit("calloc");
+    for (int i = 0; i < nqueues; i++) pthread_mutex_init(&sched_deques[i].lock, NULL);
+}
+
+// A home for a new connection, spread round robin over the workers
+int sched_pick_home(void) {
+    return (int)(__atomic_fetch_add(&sched_next_home, 1, __ATOMIC_RELAXED) % (unsigned)sched_nqueues);
+}
+
+// Keeps a worker, and with it the connections homed on it, on one CPU
+static void pin_to_cpu(int index) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 1) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % ncpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void deque_push(TaskDeque *q, Task *t) {
+    t->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    t->prev = q->tail;
+    if (q->tail) q->tail->next = t; else q->head = t;
+    q->tail = t;
+    __atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// The owner takes from the front, thieves from the back
+static Task *deque_take(TaskDeque *q, int steal) {
+    // Peek first so empty deques are skipped without touching their lock
+    if (__atomic_load_n(&q->count, __ATOMIC_ACQUIRE) == 0) return NULL;
+    Task *t = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (steal && q->tail) {
+        t = q->tail;
+        q->tail = t->prev;
+        if (q->tail) q->tail->next = NULL; else q->head = NULL;
+    } else if (q->head) {
+        t = q->head;
+        q->head = t->next;
+        if (q->head) q->head->prev = NULL; else q->tail = NULL;
+    }
+    if (t) __atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&q->lock);
+    return t;
+}
+
+static void global_push(Task *t) {
     t->next = NULL;
     pthread_mutex_lock(&taskq_mutex);
     if (!task_tail) { task_head = task_tail = t; }
     else { task_tail->next = t; task_tail = t; }
+    __atomic_store_n(&task_count, task_count + 1, __ATOMIC_RELAXED);
     pthread_cond_signal(&taskq_cond);
     pthread_mutex_unlock(&taskq_mutex);
 }
 
-Task *pop_task() {
+static Task *global_pop(void) {
     pthread_mutex_lock(&taskq_mutex);
     while (!task_head) pthread_cond_wait(&taskq_cond, &taskq_mutex);
     Task *t = task_head;
     task_head = t->next;
     if (!task_head) task_tail = NULL;
+    __atomic_store_n(&task_count, task_count - 1, __ATOMIC_RELAXED);
     pthread_mutex_unlock(&taskq_mutex);
     return t;
 }
 
-typedef struct ClientQ {
-    int fds[CLIENT_Q_CAP];
-    int head, tail, count;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-} ClientQ;
+void push_task(Task *t) {
+    t->queued_ns = now_ns();
+    if (sched_mode == SCHED_GLOBAL) { global_push(t); return; }
+    int home = sched_home >= 0 ? sched_home % sched_nqueues : sched_pick_home();
+    deque_push(&sched_deques[home], t);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched_idle, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&sched_sleep_lock);
+        pthread_cond_signal(&sched_sleep_cond);
+        pthread_mutex_unlock(&sched_sleep_lock);
+    }
+}
 
-static ClientQ clientq = { .head=0, .tail=0, .count=0, .mutex=PTHREAD_MUTEX_INITIALIZER, .cond=PTHREAD_COND_INITIALIZER };
+static Task *sched_try_take(int self) {
+    Task *t = deque_take(&sched_deques[self], 0);
+    for (int i = 1; !t && i < sched_nqueues; i++) t = deque_take(&sched_deques[(self + i) % sched_nqueues], 1);
+    return t;
+}
 
-void push_client_fd(int fd) {
-    pthread_mutex_lock(&clientq.mutex);
-    while (clientq.count == CLIENT_Q_CAP) pthread_cond_wait(&clientq.cond, &clientq.mutex);
-    clientq.fds[clientq.tail] = fd;
-    clientq.tail = (clientq.tail + 1) % CLIENT_Q_CAP;
-    clientq.count++;
-    pthread_cond_signal(&clientq.cond);
-    pthread_mutex_unlock(&clientq.mutex);
+// Tasks waiting for a worker, for STATS
+static size_t sched_queued(void) {
+    if (sched_mode == SCHED_GLOBAL) return __atomic_load_n(&task_count, __ATOMIC_RELAXED);
+    size_t n = 0;
+    for (int i = 0; i < sched_nqueues; i++) n += __atomic_load_n(&sched_deques[i].count, __ATOMIC_RELAXED);
+    return n;
 }
 
-int pop_client_fd() {
-    pthread_mutex_lock(&clientq.mutex);
-    while (clientq.count == 0) pthread_cond_wait(&clientq.cond, &clientq.mutex);
-    int fd = clientq.fds[clientq.head];
-    clientq.head = (clientq.head + 1) % CLIENT_Q_CAP;
-    clientq.count--;
-    pthread_cond_signal(&clientq.cond);
-    pthread_mutex_unlock(&clientq.mutex);
-    return fd;
+static int sched_any_queued(void) {
+    for (int i = 0; i < sched_nqueues; i++) {
+        if (__atomic_load_n(&sched_deques[i].count, __ATOMIC_SEQ_CST) > 0) return 1;
+    }
+    return 0;
 }
 
-ssize_t recv_line(int fd, char *buf, size_t maxlen) {
-    size_t idx = 0;
-    while (idx + 1 < maxlen) {
-        char c;
-        ssize_t r = recv(fd, &c, 1, 0);
-        if (r == 0) return 0;
-        if (r < 0) return -1;
-        buf[idx++] = c;
-        if (c == '\n') break;
+// Next task for worker self, sleeping while there is none
+Task *pop_task(int self) {
+    if (sched_mode == SCHED_GLOBAL) return global_pop();
+    for (;;) {
+        Task *t = sched_try_take(self);
+        if (t) return t;
+        pthread_mutex_lock(&sched_sleep_lock);
+        __atomic_add_fetch(&sched_idle, 1, __ATOMIC_SEQ_CST);
+        while (!sched_any_queued()) {
+            pthread_cond_wait(&sched_sleep_cond, &sched_sleep_lock);
+        }
+        __atomic_sub_fetch(&sched_idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&sched_sleep_lock);
     }
-    buf[idx] = '\0';
-    return (ssize_t)idx;
 }
 
-int recv_exact(int sock, char *buf, size_t n) {
-    size_t left = n;
-    while (left > 0) {
-        ssize_t r = recv(sock, buf + (n - left), left, 0);
-        if (r <= 0) return -1;
-        left -= r;
+// One-shot completion on a futex word: 0 while pending, 1 once done and 2
+// while the waiter sleeps. The completer only enters the kernel when the
+// waiter is actually asleep, and FUTEX_WAIT re-checks the word atomically,
+// so a completion that races with the waiter going to sleep is never lost.
+static void completion_wait(uint32_t *word) {
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(word, &expected, 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) expected = 2;
+    while (expected == 2) {
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        expected = __atomic_load_n(word, __ATOMIC_ACQUIRE);
     }
-    return 0;
 }
 
-int send_all(int fd, const void *buf, size_t len) {
-    const char *p = buf; size_t left = len;
-    while (left > 0) {
-        ssize_t s = send(fd, p, left, 0);
-        if (s <= 0) return -1;
-        p += s; left -= s;
+static void completion_signal(uint32_t *word) {
+    if (__atomic_exchange_n(word, 1, __ATOMIC_RELEASE) == 2) {
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
     }
-    return 0;
 }
 
-static void safe_copy_file(const char *src, const char *dst) {
-    int in = open(src, O_RDONLY);
-    if (in < 0) return;
-    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (out < 0) { close(in); return; }
-    char buf[8192];
-    ssize_t r;
-    while ((r = read(in, buf, sizeof(buf))) > 0) write(out, buf, r);
-    close(in); close(out);
+// Blocks until a worker has finished t
+void task_wait(Task *t) {
+    completion_wait(&t->done);
 }
 
+// Tasks are recycled through a pool per thread instead of calloc/free on
+// every request. A task goes back to the pool of the thread that allocated
+// it: directly when that thread frees it, otherwise (a worker finishing a
+// tagged request) through the pool's lock-free remote list, which the owner
+// takes over in one exchange when its local list runs dry.
+#define TASK_POOL_MAX 64
+
+typedef struct TaskPool {
+    Task *local;             // owner only
+    size_t cached;
+    Task *remote;            // pushed by other threads
+} TaskPool;
+
+static __thread TaskPool *task_pool;
+
+static Task *task_alloc(void) {
+    TaskPool *p = task_pool;
+    if (!p) {
+        p = task_pool = calloc(1, sizeof(TaskPool));
+        if (!p) return NULL;
+    }
+    if (!p->local) {
+        p->local = __atomic_exchange_n(&p->remote, NULL, __ATOMIC_ACQUIRE);
+        for (Task *t = p->local; t; t = t->next) p->cached++;
+    }
+    Task *t = p->local;
+    if (t) {
+        p->local = t->next;
+        p->cached--;
+    } else {
+        t = malloc(sizeof(Task));
+        if (!t) return NULL;
+    }
+    memset(t, 0, sizeof(Task));
+    t->pool = p;
+    return t;
+}
+
+Task *task_new(enum TaskType type, User *user, const char *filename) {
+    Task *t = task_alloc();
+    if (!t) return NULL;
+    t->type = type;
+    t->user = user;
+    if (filename) strncpy(t->filename, filename, sizeof(t->filename)-1);
+    t->fd = -1;
+    t->status = -1;
+    return t;
+}
+
+void task_free(Task *t) {
+    if (t->result_buf) free(t->result_buf);
+    TaskPool *p = t->pool;
+    if (p != task_pool) {
+        t->next = __atomic_load_n(&p->remote, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&p->remote, &t->next, t, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    } else if (p->cached < TASK_POOL_MAX) {
+        t->next = p->local;
+        p->local = t;
+        p->cached++;
+    } else {
+        free(t);
+    }
+}
+
+typedef struct ClientQ {
+    int fds[CLIENT_Q_CAP];
+    uint64_t queued_ns[CLIENT_Q_CAP];
+    int head, tail, count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ClientQ;
+
+static ClientQ clientq = { .head=0, .tail=0, .count=0, .mutex=PTHREAD_MUTEX_INITIALIZER, .cond=PTHREAD_COND_INITIALIZER };
+
+void push_client_fd(int fd) {
+    pthread_mutex_lock(&clientq.mutex);
+    while (clientq.count == CLIENT_Q_CAP) pthread_cond_wait(&clientq.cond, &clientq.mutex);
+    clientq.fds[clientq.tail] = fd;
+    clientq.queued_ns[clientq.tail] = now_ns();
+    clientq.tail = (clientq.tail + 1) % CLIENT_Q_CAP;
+    __atomic_store_n(&clientq.count, clientq.count + 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&clientq.cond);
+    pthread_mutex_unlock(&clientq.mutex);
+}
+
+int pop_client_fd() {
+    pthread_mutex_lock(&clientq.mutex);
+    while (clientq.count == 0) pthread_cond_wait(&clientq.cond, &clientq.mutex);
+    int fd = clientq.fds[clientq.head];
+    uint64_t queued = clientq.queued_ns[clientq.head];
+    clientq.head = (clientq.head + 1) % CLIENT_Q_CAP;
+    __atomic_store_n(&clientq.count, clientq.count - 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&clientq.cond);
+    pthread_mutex_unlock(&clientq.mutex);
+    metrics_record(WAIT_CLIENTQ, now_ns() - queued);
+    return fd;
+}
+
+// Storage backends. All file I/O done on behalf of clients goes through
+// `storage`, picked once at startup: plain POSIX calls, or io_uring. Every
+// thread gets its own ring and submits and reaps on it directly, so no
+// other thread sits between a caller and the kernel; a large read or write
+// is split into several SQEs that are in flight together. Both follow the
+// POSIX convention of returning -1 with errno set.
+typedef struct StorageOps {
+    const char *name;
+    int (*open)(const char *path, int flags, mode_t mode);
+    ssize_t (*pread)(int fd, void *buf, size_t len, off_t off);
+    ssize_t (*pwrite)(int fd, const void *buf, size_t len, off_t off);
+    int (*rename)(const char *from, const char *to);
+    int (*link)(const char *from, const char *to);   // follows a symlink in from
+    int (*unlink)(const char *path);
+} StorageOps;
+
+static int posix_open(const char *path, int flags, mode_t mode) { return open(path, flags, mode); }
+static int posix_rename(const char *from, const char *to) { return rename(from, to); }
+static int posix_link(const char *from, const char *to) { return linkat(AT_FDCWD, from, AT_FDCWD, to, AT_SYMLINK_FOLLOW); }
+static int posix_unlink(const char *path) { return unlink(path); }
+
+static const StorageOps posix_storage = {
+    "posix", posix_open, pread, pwrite, posix_rename, posix_link, posix_unlink
+};
+
+static const StorageOps *storage = &posix_storage;
+
+#define URING_QUEUE_DEPTH 16
+#define URING_IO_SPLIT (64 * 1024)   // one SQE's share of a larger read or write
+
+// Largest read or write the copy loops below issue at once
+#define STORAGE_IO_BATCH (URING_QUEUE_DEPTH * URING_IO_SPLIT)
+
+typedef struct UringRing {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len;
+} UringRing;
+
+static pthread_key_t uring_key;
+static __thread UringRing *uring_ring;
+
+static void uring_free(void *arg) {
+    UringRing *r = arg;
+    munmap(r->sqes, URING_QUEUE_DEPTH * sizeof(struct io_uring_sqe));
+    if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_len);
+    munmap(r->sq_map, r->sq_len);
+    close(r->fd);
+    free(r);
+}
+
+static UringRing *uring_setup(void) {
+    UringRing *r = calloc(1, sizeof(UringRing));
+    if (!r) return NULL;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &p);
+    if (r->fd < 0) { free(r); return NULL; }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    char *sq = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) { close(r->fd); free(r); return NULL; }
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) { munmap(sq, r->sq_len); close(r->fd); free(r); return NULL; }
+    }
+    r->sq_map = sq;
+    r->cq_map = cq;
+    r->sqes = mmap(NULL, URING_QUEUE_DEPTH * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (cq != sq) munmap(cq, r->cq_len);
+        munmap(sq, r->sq_len);
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+}
+
+// The calling thread's ring, created on first use and torn down when the
+// thread exits
+static UringRing *uring_self(void) {
+    if (!uring_ring) {
+        uring_ring = uring_setup();
+        if (uring_ring) pthread_setspecific(uring_key, uring_ring);
+    }
+    return uring_ring;
+}
+
+// Submits n (at most URING_QUEUE_DEPTH) SQEs with one io_uring_enter and
+// reaps them all; res[i] gets the CQE result of sqes[i] (negative errno on
+// failure, including SQEs the kernel refused). Returns -1 only when nothing
+// could be submitted. The ring is only ever idle between calls.
+static int uring_run(const struct io_uring_sqe *sqes, int *res, unsigned n) {
+    UringRing *r = uring_self();
+    if (!r) return -1;
+    unsigned tail = *r->sq_tail;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned idx = (tail + i) & *r->sq_mask;
+        r->sqes[idx] = sqes[i];
+        r->sqes[idx].user_data = i;
+        r->sq_array[idx] = idx;
+    }
+    __atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    unsigned submitted = 0, reaped = 0;
+    while (submitted < n || reaped < submitted) {
+        // A short submit returns without waiting, so n - reaped is safe here
+        int got = (int)syscall(__NR_io_uring_enter, r->fd, n - submitted, n - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (got < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // Nothing more went in: take the rest back off the ring, fail
+            // them and only reap what the kernel already has
+            int err = errno;
+            __atomic_store_n(r->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+            for (unsigned i = submitted; i < n; i++) res[i] = -err;
+            if (submitted == 0) { errno = err; return -1; }
+            n = submitted;
+            continue;
+        }
+        if (got > 0) submitted += (unsigned)got;
+        unsigned head = *r->cq_head;
+        unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            res[cqe->user_data] = cqe->res;
+            reaped++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static ssize_t uring_result(int res) {
+    if (res < 0) { errno = -res; return -1; }
+    return res;
+}
+
+static ssize_t uring_op(const struct io_uring_sqe *sqe) {
+    int res;
+    if (uring_run(sqe, &res, 1) != 0) return -1;
+    return uring_result(res);
+}
+
+static int uring_open(const char *path, int flags, mode_t mode) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_OPENAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = (uint64_t)(uintptr_t)path;
+    sqe.open_flags = flags;
+    sqe.len = mode;
+    return (int)uring_op(&sqe);
+}
+
+// Splits len into URING_IO_SPLIT pieces, all submitted at once. Returns the
+// bytes done up to the first short or failed piece, like a short pread.
+static ssize_t uring_rw(int opcode, int fd, const void *buf, size_t len, off_t off) {
+    struct io_uring_sqe sqes[URING_QUEUE_DEPTH];
+    int res[URING_QUEUE_DEPTH];
+    size_t want[URING_QUEUE_DEPTH];
+    unsigned n = 0;
+    if (len == 0) return 0;
+    for (size_t pos = 0; pos < len && n < URING_QUEUE_DEPTH; n++) {
+        want[n] = len - pos < URING_IO_SPLIT ? len - pos : URING_IO_SPLIT;
+        memset(&sqes[n], 0, sizeof(sqes[n]));
+        sqes[n].opcode = opcode;
+        sqes[n].fd = fd;
+        sqes[n].addr = (uint64_t)(uintptr_t)((const char *)buf + pos);
+        sqes[n].len = want[n];
+        sqes[n].off = off + pos;
+        pos += want[n];
+    }
+    if (uring_run(sqes, res, n) != 0) return -1;
+    if (res[0] < 0) return uring_result(res[0]);
+    size_t done = 0;
+    for (unsigned i = 0; i < n && res[i] >= 0; i++) {
+        done += (size_t)res[i];
+        if ((size_t)res[i] < want[i]) break;
+    }
+    return done;
+}
+
+static ssize_t uring_pread(int fd, void *buf, size_t len, off_t off) {
+    return uring_rw(IORING_OP_READ, fd, buf, len, off);
+}
+
+static ssize_t uring_pwrite(int fd, const void *buf, size_t len, off_t off) {
+    return uring_rw(IORING_OP_WRITE, fd, buf, len, off);
+}
+
+static int uring_rename(const char *from, const char *to) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_RENAMEAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = (uint64_t)(uintptr_t)from;
+    sqe.len = AT_FDCWD;
+    sqe.addr2 = (uint64_t)(uintptr_t)to;
+    return (int)uring_op(&sqe);
+}
+
+static int uring_link(const char *from, const char *to) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_LINKAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = (uint64_t)(uintptr_t)from;
+    sqe.len = AT_FDCWD;
+    sqe.addr2 = (uint64_t)(uintptr_t)to;
+    sqe.hardlink_flags = AT_SYMLINK_FOLLOW;
+    return (int)uring_op(&sqe);
+}
+
+static int uring_unlink(const char *path) {
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_UNLINKAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = (uint64_t)(uintptr_t)path;
+    return (int)uring_op(&sqe);
+}
+
+static const StorageOps uring_storage = {
+    "io_uring", uring_open, uring_pread, uring_pwrite, uring_rename, uring_link, uring_unlink
+};
+
+// The kernel must support every opcode the backend issues
+static int uring_probe_ops(void) {
+    static const int needed[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE,
+                                  IORING_OP_RENAMEAT, IORING_OP_LINKAT, IORING_OP_UNLINKAT };
+    UringRing *r = uring_self();
+    if (!r) return -1;
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe) return -1;
+    int ok = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+// Switches to the io_uring backend if the kernel allows it
+static int storage_use_uring(void) {
+    if (pthread_key_create(&uring_key, uring_free) != 0) return -1;
+    if (uring_probe_ops() != 0) return -1;
+    storage = &uring_storage;
+    return 0;
+}
+
+// Blocks until fd is ready for the given poll events. Client sockets are
+// non-blocking; only the thread driving a connection ever waits on one.
+static int wait_fd(int fd, short events) {
+    struct pollfd p = { .fd = fd, .events = events, .revents = 0 };
+    while (poll(&p, 1, -1) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+static int send_all_flags(int fd, const void *buf, size_t len, int flags) {
+    const char *p = buf; size_t left = len;
+    while (left > 0) {
+        ssize_t s = send(fd, p, left, flags);
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_fd(fd, POLLOUT) != 0) return -1;
+            continue;
+        }
+        if (s <= 0) return -1;
+        metrics_bytes_out(s);
+        p += s; left -= s;
+    }
+    return 0;
+}
+
+int send_all(int fd, const void *buf, size_t len) {
+    return send_all_flags(fd, buf, len, 0);
+}
+
+// Drops the first n bytes of msg's iovecs, and any empty ones
+static void iov_advance(struct msghdr *msg, size_t n) {
+    while (msg->msg_iovlen > 0 && n >= msg->msg_iov->iov_len) {
+        n -= msg->msg_iov->iov_len;
+        msg->msg_iov++;
+        msg->msg_iovlen--;
+    }
+    if (msg->msg_iovlen > 0) {
+        msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + n;
+        msg->msg_iov->iov_len -= n;
+    }
+}
+
+// A reply made of several pieces, written with one sendmsg so that they
+// leave together; iov is consumed
+static int sendv_all(int fd, struct iovec *iov, int cnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    iov_advance(&msg, 0);
+    while (msg.msg_iovlen > 0) {
+        ssize_t s = sendmsg(fd, &msg, 0);
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_fd(fd, POLLOUT) != 0) return -1;
+            continue;
+        }
+        if (s <= 0) return -1;
+        metrics_bytes_out(s);
+        iov_advance(&msg, s);
+    }
+    return 0;
+}
+
+// A reply header whose body follows at once: MSG_MORE holds it back so that
+// it leaves in the same segment as the start of the body
+static int send_header(int fd, const void *buf, size_t len) {
+    return send_all_flags(fd, buf, len, MSG_MORE);
+}
+
+// Sends part of the len bytes of in at *off to sock and advances *off.
+// sendfile moves the data kernel-side; if the fd pair does not support it
+// we fall back to a bounded pread/send chunk. Returns the number of bytes
+// sent, 0 if a non-blocking socket is full, -1 on error or early EOF.
+ssize_t send_file_some(int sock, int in, off_t *off, size_t len) {
+    size_t chunk = len < (1u << 30) ? len : (1u << 30);
+    ssize_t s = sendfile(sock, in, off, chunk);
+    if (s > 0) { metrics_bytes_out(s); return s; }
+    if (s == 0) return -1;
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    if (errno != EINVAL && errno != ENOSYS) return -1;
+
+    char chunk_buf[65536];
+    size_t want = len < sizeof(chunk_buf) ? len : sizeof(chunk_buf);
+    ssize_t r = storage->pread(in, chunk_buf, want, *off);
+    if (r <= 0) return -1;
+    if (send_all(sock, chunk_buf, r) != 0) return -1;
+    *off += r;
+    return r;
+}
+
+// Uploads are staged directly in the user's storage directory as an
+// anonymous O_TMPFILE, so an aborted or crashed upload leaves nothing
+// behind and nothing is copied on commit. Committing links the file under
+// a hidden name and renames it over the target, which atomically replaces
+// an older version. Filesystems without O_TMPFILE get a named hidden
+// staging file instead; leftovers of either kind are swept at startup.
+#define STAGING_PREFIX ".upload-"
+
+static volatile unsigned long staging_seq = 0;
+
+static void staging_name(const User *u, char *path, size_t len) {
+    unsigned long seq = __atomic_add_fetch(&staging_seq, 1, __ATOMIC_RELAXED);
+    snprintf(path, len, "%s/%s/%s%lx-%lx", STORAGE_DIR, u->username, STAGING_PREFIX, (unsigned long)getpid(), seq);
+}
+
+// Returns a writable staging fd; tmp_path is left empty for an O_TMPFILE
+int staging_open(const User *u, char *tmp_path, size_t len) {
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/%s", STORAGE_DIR, u->username);
+    tmp_path[0] = '\0';
+    int fd = storage->open(dir, O_TMPFILE | O_RDWR, 0644);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) return fd;
+    staging_name(u, tmp_path, len);
+    return storage->open(tmp_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+}
+
+// Publishes the staged file as filename, replacing any previous version
+int staging_commit(const User *u, int fd, const char *tmp_path, const char *filename) {
+    char dest[1024];
+    snprintf(dest, sizeof(dest), "%s/%s/%s", STORAGE_DIR, u->username, filename);
+    if (tmp_path[0]) return storage->rename(tmp_path, dest);
+
+    char proc_path[64], hidden[512];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    staging_name(u, hidden, sizeof(hidden));
+    if (storage->link(proc_path, hidden) != 0) return -1;
+    if (storage->rename(hidden, dest) != 0) {
+        int saved = errno;
+        storage->unlink(hidden);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// CRC-32C of the first size bytes of a staging file
+static int staging_crc(int fd, size_t size, uint32_t *crc) {
+    char *buf = malloc(STORAGE_IO_BATCH);
+    if (!buf) return -1;
+    uint32_t c = 0;
+    for (size_t off = 0; off < size;) {
+        ssize_t n = storage->pread(fd, buf, size - off < STORAGE_IO_BATCH ? size - off : STORAGE_IO_BATCH, (off_t)off);
+        if (n <= 0) { free(buf); return -1; }
+        c = crc32c(c, buf, (size_t)n);
+        off += n;
+    }
+    free(buf);
+    *crc = c;
+    return 0;
+}
+
+// Drops a staging file that was not (or could not be) committed
+void staging_discard(int fd, const char *tmp_path) {
+    close(fd);
+    if (tmp_path[0]) storage->unlink(tmp_path);
+}
+
+// Removes staging files left over by a crash
+void staging_sweep(void) {
+    DIR *top = opendir(STORAGE_DIR);
+    if (!top) return;
+    struct dirent *ud;
+    while ((ud = readdir(top)) != NULL) {
+        if (ud->d_name[0] == '.') continue;
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s/%s", STORAGE_DIR, ud->d_name);
+        DIR *d = opendir(dir);
+        if (!d) continue;
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            if (strncmp(e->d_name, STAGING_PREFIX, strlen(STAGING_PREFIX)) != 0) continue;
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unlink(path);
+        }
+        closedir(d);
+    }
+    closedir(top);
+}
+
+// Stored names are plain entries of the user's directory
+int valid_filename(const char *name) {
+    if (!name[0] || strchr(name, '/')) return 0;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    return strncmp(name, STAGING_PREFIX, strlen(STAGING_PREFIX)) != 0;
+}
+
+// An upload whose body is being received. Protocol 2 uploads are
+// registered under a random id: if the connection drops the upload is
+// parked with its staging fd still open, and a new session can RESUME it
+// from `received` instead of starting over. Parked uploads that are not
+// resumed within UPLOAD_PARK_TIMEOUT are discarded.
+#define UPLOAD_PARK_TIMEOUT 600
+
+typedef struct Upload {
+    uint64_t id;             // 0 for unregistered (legacy) uploads
+    User *user;
+    char name[MAX_FILENAME];
+    char tmp_path[512];
+    int fd;
+    size_t size;             // declared size, protocol 2 only
+    size_t reserved;         // quota held for it until commit or discard
+    size_t received;         // bytes persisted to the staging file
+    uint32_t crc;            // CRC-32C of those bytes (not kept for stripes)
+    int attached;            // sessions streaming into it (stripes: any number)
+    time_t parked_at;
+    // Striped uploads: merged, sorted byte ranges written so far
+    int striped;
+    struct { size_t start, end; } *ranges;
+    size_t nranges, covered;
+    struct Upload *next;
+} Upload;
+
+static Upload *uploads = NULL;
+static pthread_mutex_t uploads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void upload_free(Upload *up, int committed) {
+    // A committed staging file has a name of its own by now, and its
+    // reservation became used space; otherwise closing it is all it takes
+    // to throw the data away
+    if (committed) close(up->fd);
+    else {
+        staging_discard(up->fd, up->tmp_path);
+        user_quota_release(up->user, up->reserved);
+    }
+    free(up->ranges);
+    free(up);
+}
+
+static void uploads_reap_locked(time_t now) {
+    Upload **pp = &uploads;
+    while (*pp) {
+        Upload *up = *pp;
+        if (!up->attached && now - up->parked_at > UPLOAD_PARK_TIMEOUT) {
+            *pp = up->next;
+            upload_free(up, 0);
+        } else {
+            pp = &up->next;
+        }
+    }
+}
+
+static void uploads_unlink_locked(Upload *up) {
+    for (Upload **pp = &uploads; *pp; pp = &(*pp)->next) {
+        if (*pp == up) { *pp = up->next; return; }
+    }
+}
+
+// Reserves the declared size up front, so an upload that would not fit is
+// refused before any of its body is read (size 0: protocol 1, checked at commit)
+Upload *upload_new(User *u, const char *name, size_t size, int resumable, const char **err) {
+    if (user_quota_reserve(u, name, size) != 0) { *err = "Quota exceeded"; return NULL; }
+    Upload *up = calloc(1, sizeof(Upload));
+    if (up) up->fd = staging_open(u, up->tmp_path, sizeof(up->tmp_path));
+    if (!up || up->fd < 0) {
+        free(up);
+        user_quota_release(u, size);
+        *err = "Temp create failed";
+        return NULL;
+    }
+    up->user = u;
+    strncpy(up->name, name, sizeof(up->name)-1);
+    up->size = size;
+    up->reserved = size;
+    up->attached = 1;
+    if (resumable) {
+        while (up->id == 0) {
+            if (getrandom(&up->id, sizeof(up->id), 0) != sizeof(up->id)) up->id = ((uint64_t)time(NULL) << 20) ^ (uintptr_t)up;
+        }
+        pthread_mutex_lock(&uploads_mutex);
+        uploads_reap_locked(time(NULL));
+        up->next = uploads; uploads = up;
+        pthread_mutex_unlock(&uploads_mutex);
+    }
+    return up;
+}
+
+// Takes over a parked upload of user u
+Upload *upload_resume(User *u, uint64_t id, const char **err) {
+    pthread_mutex_lock(&uploads_mutex);
+    uploads_reap_locked(time(NULL));
+    Upload *up = uploads;
+    while (up && !(up->id == id && up->user == u)) up = up->next;
+    if (!up) *err = "No such upload";
+    else if (up->attached) { *err = "Upload in progress"; up = NULL; }
+    else up->attached = 1;
+    pthread_mutex_unlock(&uploads_mutex);
+    return up;
+}
+
+// The session streaming into up went away; keep resumable uploads around
+void upload_park(Upload *up) {
+    if (up->id == 0) { upload_free(up, 0); return; }
+    pthread_mutex_lock(&uploads_mutex);
+    up->attached = 0;
+    up->parked_at = time(NULL);
+    pthread_mutex_unlock(&uploads_mutex);
+}
+
+// Striped uploads are filled by STRIPE requests for disjoint (or even
+// overlapping) ranges, possibly on several connections at once, each
+// pwrite-ing straight into the one staging file. They stay registered like
+// parked uploads until STRIPE_COMMIT finds every byte written.
+Upload *upload_new_striped(User *u, const char *name, size_t size, const char **err) {
+    Upload *up = upload_new(u, name, size, 1, err);
+    if (!up) return NULL;
+    pthread_mutex_lock(&uploads_mutex);
+    up->striped = 1;
+    up->attached = 0;
+    up->parked_at = time(NULL);
+    pthread_mutex_unlock(&uploads_mutex);
+    return up;
+}
+
+static Upload *uploads_find_striped_locked(User *u, uint64_t id) {
+    Upload *up = uploads;
+    while (up && !(up->id == id && up->user == u && up->striped)) up = up->next;
+    return up;
+}
+
+// Registers a stripe [off, off+len) of upload id as being written
+Upload *upload_stripe_attach(User *u, uint64_t id, size_t off, size_t len, const char **err) {
+    pthread_mutex_lock(&uploads_mutex);
+    uploads_reap_locked(time(NULL));
+    Upload *up = uploads_find_striped_locked(u, id);
+    if (!up) *err = "No such upload";
+    else if (off > up->size || len > up->size - off) { *err = "Range outside the upload"; up = NULL; }
+    else up->attached++;
+    pthread_mutex_unlock(&uploads_mutex);
+    return up;
+}
+
+// Adds [start, end) to the written ranges, merging neighbours
+static int upload_add_range_locked(Upload *up, size_t start, size_t end) {
+    if (start >= end) return 0;
+    size_t i = 0;
+    while (i < up->nranges && up->ranges[i].end < start) i++;
+    size_t j = i;
+    while (j < up->nranges && up->ranges[j].start <= end) {
+        if (up->ranges[j].start < start) start = up->ranges[j].start;
+        if (up->ranges[j].end > end) end = up->ranges[j].end;
+        up->covered -= up->ranges[j].end - up->ranges[j].start;
+        j++;
+    }
+    if (i == j) {
+        void *nr = realloc(up->ranges, (up->nranges + 1) * sizeof(*up->ranges));
+        if (!nr) return -1;
+        up->ranges = nr;
+        memmove(&up->ranges[i + 1], &up->ranges[i], (up->nranges - i) * sizeof(*up->ranges));
+        up->nranges++;
+    } else if (j - i > 1) {
+        memmove(&up->ranges[i + 1], &up->ranges[j], (up->nranges - j) * sizeof(*up->ranges));
+        up->nranges -= j - i - 1;
+    }
+    up->ranges[i].start = start;
+    up->ranges[i].end = end;
+    up->covered += end - start;
+    return 0;
+}
+
+// A stripe ended after [start, end) reached the staging file
+void upload_stripe_detach(Upload *up, size_t start, size_t end) {
+    pthread_mutex_lock(&uploads_mutex);
+    // Unrecorded bytes are only sent again, so running out of memory is harmless
+    upload_add_range_locked(up, start, end);
+    up->attached--;
+    up->parked_at = time(NULL);
+    pthread_mutex_unlock(&uploads_mutex);
+}
+
+// Takes a striped upload over for its commit once it is complete
+Upload *upload_stripe_take(User *u, uint64_t id, const char **err) {
+    pthread_mutex_lock(&uploads_mutex);
+    uploads_reap_locked(time(NULL));
+    Upload *up = uploads_find_striped_locked(u, id);
+    if (!up) *err = "No such upload";
+    else if (up->attached) { *err = "Stripes still in progress"; up = NULL; }
+    else if (up->covered != up->size) { *err = "Missing ranges"; up = NULL; }
+    else up->attached = 1;
+    pthread_mutex_unlock(&uploads_mutex);
+    return up;
+}
+
+// The upload was committed or failed for good
+void upload_finish(Upload *up, int committed) {
+    if (up->id) {
+        pthread_mutex_lock(&uploads_mutex);
+        uploads_unlink_locked(up);
+        pthread_mutex_unlock(&uploads_mutex);
+    }
+    upload_free(up, committed);
+}
+
+// Storage engines decide how a committed upload is laid out on disk. The
+// plain engine keeps every file as storage/<user>/<name>. The dedup engine
+// splits uploads into content-defined chunks, stores each distinct chunk
+// once under storage/.chunks/ and leaves a manifest in place of the file.
+// Either way downloads go through a FileReader.
+typedef struct ChunkRef {
+    unsigned char sha[32];
+    uint32_t len;
+} ChunkRef;
+
+typedef struct Manifest {
+    uint64_t size;
+    uint32_t count;
+    ChunkRef *chunks;
+    uint64_t *starts;        // file offset of each chunk, filled when reading
+} Manifest;
+
+typedef struct FileReader {
+    size_t size;
+    int fd;                  // plain engine: the stored file
+    Manifest *m;             // dedup engine
+    int chunk_fd;
+    uint32_t chunk_idx;
+    struct CacheEntry *cached;  // served from the hot file cache
+} FileReader;
+
+typedef struct StorageEngine {
+    const char *name;
+    // Publishes the staged upload as filename
+    int (*commit)(User *u, int fd, const char *tmp_path, const char *filename, size_t size);
+    FileReader *(*open)(User *u, const char *filename);
+    int (*remove)(User *u, const char *filename);
+    // Size of the stored file name in the directory dirfd, for the startup
+    // scan; fails for entries that are not stored files
+    int (*stat)(int dirfd, const char *name, size_t *size);
+} StorageEngine;
+
+static void user_file_path(const User *u, const char *filename, char *path, size_t len) {
+    snprintf(path, len, "%s/%s/%s", STORAGE_DIR, u->username, filename);
+}
+
+static int plain_commit(User *u, int fd, const char *tmp_path, const char *filename, size_t size) {
+    (void)size;
+    return staging_commit(u, fd, tmp_path, filename);
+}
+
+static FileReader *plain_open(User *u, const char *filename) {
+    char path[1024];
+    user_file_path(u, filename, path, sizeof(path));
+    int fd = storage->open(path, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    struct stat st;
+    FileReader *r = calloc(1, sizeof(FileReader));
+    if (!r || fstat(fd, &st) != 0) { free(r); close(fd); return NULL; }
+    r->size = st.st_size;
+    r->fd = fd;
+    r->chunk_fd = -1;
+    return r;
+}
+
+static int plain_remove(User *u, const char *filename) {
+    char path[1024];
+    user_file_path(u, filename, path, sizeof(path));
+    return storage->unlink(path);
+}
+
+static int plain_stat(int dirfd, const char *name, size_t *size) {
+    struct statx stx;
+    if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE, &stx) != 0) return -1;
+    if (!S_ISREG(stx.stx_mode)) return -1;
+    *size = stx.stx_size;
+    return 0;
+}
+
+static const StorageEngine plain_engine = { "plain", plain_commit, plain_open, plain_remove, plain_stat };
+
+// Content-defined chunking with a gear rolling hash: a boundary is declared
+// where the low bits of the hash are zero, so an insertion only changes the
+// chunks around it. Chunks are kept between 2 KB and 64 KB, 8 KB on average.
+#define CHUNK_MIN (2 * 1024)
+#define CHUNK_AVG_MASK ((1u << 13) - 1)
+#define CHUNK_MAX (64 * 1024)
+#define CHUNK_DIR STORAGE_DIR "/.chunks"
+// A manifest is the magic, the file size (u64) and the chunk count (u32),
+// then the sha256 and length (u32) of every chunk, little-endian throughout
+#define MANIFEST_MAGIC "DBXMAN01"
+#define MANIFEST_HDR 20
+#define MANIFEST_ENTRY 36
+
+static uint64_t gear_table[256];
+
+static void gear_init(void) {
+    uint64_t x = 0x9e3779b97f4a7c15ULL;          // splitmix64, fixed seed
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+// Returns the length of the next chunk in data[0..len); eof says whether
+// more data follows the buffer
+static size_t chunk_boundary(const unsigned char *data, size_t len, int eof) {
+    if (len <= CHUNK_MIN) return eof ? len : 0;
+    size_t limit = len < CHUNK_MAX ? len : CHUNK_MAX;
+    uint64_t h = 0;
+    for (size_t i = CHUNK_MIN; i < limit; i++) {
+        h = (h << 1) + gear_table[data[i]];
+        if ((h & CHUNK_AVG_MASK) == 0) return i + 1;
+    }
+    if (limit == CHUNK_MAX || eof) return limit;
+    return 0;
+}
+
+// Reference counts of stored chunks, in shards keyed by the first hash byte.
+// A chunk file is written and unlinked under its shard lock, so a chunk
+// that is being released can never be resurrected half way.
+#define CHUNK_SHARDS 64
+
+typedef struct ChunkEntry {
+    unsigned char sha[32];
+    uint32_t refs;           // 0 marks a free slot
+} ChunkEntry;
+
+typedef struct ChunkShard {
+    pthread_mutex_t lock;
+    ChunkEntry *slots;
+    size_t nslots, count;
+} ChunkShard;
+
+static ChunkShard chunk_shards[CHUNK_SHARDS];
+
+static ChunkShard *chunk_shard(const unsigned char *sha) { return &chunk_shards[sha[0] % CHUNK_SHARDS]; }
+
+static uint64_t chunk_key(const unsigned char *sha) {
+    uint64_t k;
+    memcpy(&k, sha + 8, sizeof(k));
+    return k;
+}
+
+static ChunkEntry *chunk_find_locked(ChunkShard *sh, const unsigned char *sha) {
+    if (sh->nslots == 0) return NULL;
+    size_t mask = sh->nslots - 1;
+    for (size_t i = chunk_key(sha) & mask;; i = (i + 1) & mask) {
+        ChunkEntry *e = &sh->slots[i];
+        if (e->refs == 0) return NULL;
+        if (memcmp(e->sha, sha, 32) == 0) return e;
+    }
+}
+
+static void chunk_insert_slot(ChunkEntry *slots, size_t nslots, const ChunkEntry *e) {
+    size_t i = chunk_key(e->sha) & (nslots - 1);
+    while (slots[i].refs) i = (i + 1) & (nslots - 1);
+    slots[i] = *e;
+}
+
+static int chunk_insert_locked(ChunkShard *sh, const unsigned char *sha, uint32_t refs) {
+    if ((sh->count + 1) * 4 > sh->nslots * 3) {
+        size_t n = sh->nslots ? sh->nslots * 2 : 256;
+        ChunkEntry *slots = calloc(n, sizeof(ChunkEntry));
+        if (!slots) return -1;
+        for (size_t i = 0; i < sh->nslots; i++) {
+            if (sh->slots[i].refs) chunk_insert_slot(slots, n, &sh->slots[i]);
+        }
+        free(sh->slots);
+        sh->slots = slots; sh->nslots = n;
+    }
+    ChunkEntry e;
+    memcpy(e.sha, sha, 32);
+    e.refs = refs;
+    chunk_insert_slot(sh->slots, sh->nslots, &e);
+    sh->count++;
+    return 0;
+}
+
+// Removing from a linear-probing table: re-seat the rest of the cluster
+static void chunk_delete_locked(ChunkShard *sh, ChunkEntry *e) {
+    size_t mask = sh->nslots - 1;
+    size_t i = (size_t)(e - sh->slots);
+    sh->slots[i].refs = 0;
+    sh->count--;
+    for (size_t j = (i + 1) & mask; sh->slots[j].refs; j = (j + 1) & mask) {
+        ChunkEntry moved = sh->slots[j];
+        sh->slots[j].refs = 0;
+        chunk_insert_slot(sh->slots, sh->nslots, &moved);
+    }
+}
+
+static void chunk_path(const unsigned char *sha, char *path, size_t len) {
+    char hex[65];
+    for (int i = 0; i < 32; i++) snprintf(hex + 2*i, 3, "%02x", sha[i]);
+    snprintf(path, len, "%s/%.2s/%s", CHUNK_DIR, hex, hex + 2);
+}
+
+static int chunk_write_file(const unsigned char *sha, const void *data, size_t len) {
+    char path[512], tmp[600], dir[512];
+    chunk_path(sha, path, sizeof(path));
+    snprintf(dir, sizeof(dir), "%.*s", (int)(strrchr(path, '/') - path), path);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = storage->open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    size_t off = 0;
+    while (off < len) {
+        ssize_t w = storage->pwrite(fd, (const char *)data + off, len - off, off);
+        if (w <= 0) { close(fd); storage->unlink(tmp); return -1; }
+        off += w;
+    }
+    close(fd);
+    if (storage->rename(tmp, path) != 0) { storage->unlink(tmp); return -1; }
+    return 0;
+}
+
+// Takes a reference on the chunk, storing it if it is new
+static int chunk_store(const unsigned char *sha, const void *data, size_t len) {
+    ChunkShard *sh = chunk_shard(sha);
+    pthread_mutex_lock(&sh->lock);
+    ChunkEntry *e = chunk_find_locked(sh, sha);
+    int rc = 0;
+    if (e) e->refs++;
+    else if ((rc = chunk_write_file(sha, data, len)) == 0) rc = chunk_insert_locked(sh, sha, 1);
+    pthread_mutex_unlock(&sh->lock);
+    return rc;
+}
+
+// Another reference on a stored chunk; fails if the chunk is unknown
+static int chunk_retain(const unsigned char *sha) {
+    ChunkShard *sh = chunk_shard(sha);
+    pthread_mutex_lock(&sh->lock);
+    ChunkEntry *e = chunk_find_locked(sh, sha);
+    if (e) e->refs++;
+    pthread_mutex_unlock(&sh->lock);
+    return e ? 0 : -1;
+}
+
+static void chunk_release(const unsigned char *sha) {
+    ChunkShard *sh = chunk_shard(sha);
+    pthread_mutex_lock(&sh->lock);
+    ChunkEntry *e = chunk_find_locked(sh, sha);
+    if (e && --e->refs == 0) {
+        char path[512];
+        chunk_path(sha, path, sizeof(path));
+        chunk_delete_locked(sh, e);
+        storage->unlink(path);
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void manifest_free(Manifest *m) {
+    if (!m) return;
+    free(m->chunks);
+    free(m->starts);
+    free(m);
+}
+
+static Manifest *manifest_read_path(const char *path) {
+    int fd = storage->open(path, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    unsigned char hdr[MANIFEST_HDR];
+    Manifest *m = calloc(1, sizeof(Manifest));
+    if (!m || storage->pread(fd, hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) || memcmp(hdr, MANIFEST_MAGIC, 8) != 0) {
+        free(m); close(fd); errno = EIO; return NULL;
+    }
+    m->size = get_u64(hdr + 8);
+    m->count = get_u32(hdr + 16);
+    m->chunks = malloc((m->count ? m->count : 1) * sizeof(ChunkRef));
+    m->starts = malloc((m->count + 1) * sizeof(uint64_t));
+    size_t want = (size_t)m->count * MANIFEST_ENTRY;
+    unsigned char *rec = malloc(want ? want : 1);
+    if (!m->chunks || !m->starts || !rec || storage->pread(fd, rec, want, sizeof(hdr)) != (ssize_t)want) {
+        close(fd); free(rec); manifest_free(m); errno = EIO; return NULL;
+    }
+    close(fd);
+    uint64_t off = 0;
+    for (uint32_t i = 0; i < m->count; i++) {
+        memcpy(m->chunks[i].sha, rec + i * MANIFEST_ENTRY, 32);
+        m->chunks[i].len = get_u32(rec + i * MANIFEST_ENTRY + 32);
+        m->starts[i] = off;
+        off += m->chunks[i].len;
+    }
+    free(rec);
+    m->starts[m->count] = off;
+    if (off != m->size) { manifest_free(m); errno = EIO; return NULL; }
+    return m;
+}
+
+static Manifest *manifest_read(User *u, const char *filename) {
+    char path[1024];
+    user_file_path(u, filename, path, sizeof(path));
+    return manifest_read_path(path);
+}
+
+// Chunks the staged upload, stores new chunks and publishes a manifest in
+// its place. The chunks of an overwritten version are released afterwards.
+static int dedup_commit(User *u, int fd, const char *tmp_path, const char *filename, size_t size) {
+    size_t cap = 64, count = 0;
+    ChunkRef *chunks = malloc(cap * sizeof(ChunkRef));
+    unsigned char *buf = malloc(2 * CHUNK_MAX);
+    if (!chunks || !buf) { free(chunks); free(buf); errno = ENOMEM; return -1; }
+
+    int rc = 0;
+    size_t have = 0, off = 0;
+    while (rc == 0) {
+        if (have < CHUNK_MAX && off < size) {
+            ssize_t r = storage->pread(fd, buf + have, 2 * CHUNK_MAX - have, off);
+            if (r <= 0) { rc = -1; errno = EIO; break; }
+            have += r; off += r;
+            continue;
+        }
+        if (have == 0) break;
+        size_t n = chunk_boundary(buf, have, off >= size);
+        if (count == cap) {
+            ChunkRef *nc = realloc(chunks, cap * 2 * sizeof(ChunkRef));
+            if (!nc) { rc = -1; errno = ENOMEM; break; }
+            chunks = nc; cap *= 2;
+        }
+        Sha256 c;
+        sha256_init(&c);
+        sha256_update(&c, buf, n);
+        sha256_final(&c, chunks[count].sha);
+        chunks[count].len = (uint32_t)n;
+        if ((rc = chunk_store(chunks[count].sha, buf, n)) != 0) break;
+        count++;
+        memmove(buf, buf + n, have - n);
+        have -= n;
+    }
+    free(buf);
+
+    // Write the manifest through a staging file of its own
+    char mtmp[512];
+    int mfd = -1;
+    if (rc == 0) {
+        mfd = staging_open(u, mtmp, sizeof(mtmp));
+        if (mfd < 0) rc = -1;
+    }
+    if (rc == 0) {
+        unsigned char hdr[MANIFEST_HDR];
+        memcpy(hdr, MANIFEST_MAGIC, 8);
+        put_u64(hdr + 8, size);
+        put_u32(hdr + 16, (uint32_t)count);
+        size_t body = count * MANIFEST_ENTRY;
+        unsigned char *rec = malloc(body ? body : 1);
+        if (!rec) { rc = -1; errno = ENOMEM; }
+        for (size_t i = 0; rec && i < count; i++) {
+            memcpy(rec + i * MANIFEST_ENTRY, chunks[i].sha, 32);
+            put_u32(rec + i * MANIFEST_ENTRY + 32, chunks[i].len);
+        }
+        if (rec && (storage->pwrite(mfd, hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+                    storage->pwrite(mfd, rec, body, sizeof(hdr)) != (ssize_t)body)) rc = -1;
+        free(rec);
+    }
+    // The caller holds the file's commit lock, so no other commit or delete
+    // can release the manifest being replaced a second time. One that cannot
+    // be read fails the commit, or its chunks would never be released.
+    Manifest *old = NULL;
+    if (rc == 0) {
+        old = manifest_read(u, filename);
+        if (!old && errno != ENOENT) rc = -1;
+        else rc = staging_commit(u, mfd, mtmp, filename);
+    }
+    if (mfd >= 0) { if (rc == 0) close(mfd); else staging_discard(mfd, mtmp); }
+
+    int saved = errno;
+    if (rc != 0) {
+        // Undo the references this upload took
+        for (size_t i = 0; i < count; i++) chunk_release(chunks[i].sha);
+    } else if (old) {
+        for (uint32_t i = 0; i < old->count; i++) chunk_release(old->chunks[i].sha);
+    }
+    manifest_free(old);
+    free(chunks);
+    // The upload's own staging file is not kept; a named one must go now
+    if (rc == 0 && tmp_path[0]) storage->unlink(tmp_path);
+    errno = saved;
+    return rc;
+}
+
+// A reader holds a reference on every chunk of the version it opened, so a
+// commit or delete of the same file cannot remove them mid-download
+static FileReader *dedup_open(User *u, const char *filename) {
+    pthread_mutex_t *lock = commit_lock(u, filename);
+    pthread_mutex_lock(lock);
+    Manifest *m = manifest_read(u, filename);
+    uint32_t held = 0;
+    while (m && held < m->count && chunk_retain(m->chunks[held].sha) == 0) held++;
+    pthread_mutex_unlock(lock);
+    if (!m) return NULL;
+    FileReader *r = held == m->count ? calloc(1, sizeof(FileReader)) : NULL;
+    if (!r) {
+        int saved = held == m->count ? ENOMEM : EIO;
+        while (held > 0) chunk_release(m->chunks[--held].sha);
+        manifest_free(m);
+        errno = saved;
+        return NULL;
+    }
+    r->size = m->size;
+    r->fd = -1;
+    r->m = m;
+    r->chunk_fd = -1;
+    return r;
+}
+
+// Like dedup_commit, called with the file's commit lock held
+static int dedup_remove(User *u, const char *filename) {
+    Manifest *m = manifest_read(u, filename);
+    char path[1024];
+    user_file_path(u, filename, path, sizeof(path));
+    if (storage->unlink(path) != 0) { manifest_free(m); return -1; }
+    if (m) {
+        for (uint32_t i = 0; i < m->count; i++) chunk_release(m->chunks[i].sha);
+        manifest_free(m);
+    }
+    return 0;
+}
+
+// Only the manifest header is read; dedup_load has checked the rest
+static int dedup_stat(int dirfd, const char *name, size_t *size) {
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -1;
+    unsigned char hdr[16];
+    ssize_t n = pread(fd, hdr, sizeof(hdr), 0);
+    close(fd);
+    if (n != (ssize_t)sizeof(hdr) || memcmp(hdr, MANIFEST_MAGIC, 8) != 0) return -1;
+    *size = (size_t)get_u64(hdr + 8);
+    return 0;
+}
+
+static const StorageEngine dedup_engine = { "dedup", dedup_commit, dedup_open, dedup_remove, dedup_stat };
+
+static const StorageEngine *engine = &plain_engine;
+
+// Hot file cache: whole files that were downloaded recently, kept in memory
+// under a byte budget (--cache=<MB>) and evicted with CLOCK. Readers hold a
+// reference and send straight from the buffer, so an entry evicted or
+// invalidated mid-download is freed by its last reader. Every commit and
+// delete bumps the generation of its file's stripe; a fill that raced one
+// is not inserted, while fills of other files go on.
+#define CACHE_DEFAULT_MB 64
+#define CACHE_ENTRY_SHARE 8      // one file takes at most 1/8 of the budget
+#define CACHE_INITIAL_BUCKETS 64
+#define CACHE_GEN_STRIPES 1024   // generations, by user and name
+
+typedef struct CacheEntry {
+    User *user;
+    char *name;
+    uint32_t hash;
+    unsigned char *data;
+    size_t size;
+    int refs;                // readers, plus one while in the table
+    int referenced;          // CLOCK bit, set by hits
+    size_t slot;             // position in the ring
+    struct CacheEntry *next; // hash chain
+} CacheEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    size_t nbuckets, count;
+    CacheEntry **ring;       // the clock hand sweeps this
+    size_t ring_cap, hand;
+    size_t budget, used;
+    uint64_t gens[CACHE_GEN_STRIPES];
+    uint64_t hits, misses, evictions, invalidations;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .budget = (size_t)CACHE_DEFAULT_MB << 20 };
+
+static uint32_t cache_hash(const User *u, const char *name) {
+    return name_hash(name) ^ (uint32_t)((uintptr_t)u >> 4) * 2654435761u;
+}
+
+static CacheEntry *cache_find_locked(const User *u, const char *name, uint32_t hash) {
+    if (!cache.nbuckets) return NULL;
+    CacheEntry *e = cache.buckets[hash & (cache.nbuckets - 1)];
+    while (e && !(e->hash == hash && e->user == u && strcmp(e->name, name) == 0)) e = e->next;
+    return e;
+}
+
+static void cache_release(CacheEntry *e) {
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    free(e->data);
+    free(e->name);
+    free(e);
+}
+
+// Takes e out of the table and drops the table's reference
+static void cache_unlink_locked(CacheEntry *e) {
+    CacheEntry **pp = &cache.buckets[e->hash & (cache.nbuckets - 1)];
+    while (*pp != e) pp = &(*pp)->next;
+    *pp = e->next;
+    CacheEntry *last = cache.ring[--cache.count];
+    cache.ring[e->slot] = last;
+    last->slot = e->slot;
+    cache.used -= e->size;
+    cache_release(e);
+}
+
+// Second chance: a hit since the hand last passed spares the entry once
+static void cache_evict_locked(size_t need) {
+    while (cache.count > 0 && cache.used + need > cache.budget) {
+        if (cache.hand >= cache.count) cache.hand = 0;
+        CacheEntry *e = cache.ring[cache.hand];
+        if (e->referenced) {
+            e->referenced = 0;
+            cache.hand++;
+            continue;
+        }
+        cache_unlink_locked(e);
+        cache.evictions++;
+    }
+}
+
+static int cache_grow_locked(void) {
+    if (cache.count < cache.ring_cap) return 0;
+    size_t cap = cache.ring_cap ? cache.ring_cap * 2 : CACHE_INITIAL_BUCKETS;
+    CacheEntry **ring = realloc(cache.ring, cap * sizeof(*ring));
+    CacheEntry **buckets = calloc(cap, sizeof(*buckets));
+    if (!ring || !buckets) { if (ring) cache.ring = ring; free(buckets); return -1; }
+    cache.ring = ring;
+    cache.ring_cap = cap;
+    for (size_t i = 0; i < cache.count; i++) {
+        CacheEntry *e = cache.ring[i];
+        e->next = buckets[e->hash & (cap - 1)];
+        buckets[e->hash & (cap - 1)] = e;
+    }
+    free(cache.buckets);
+    cache.buckets = buckets;
+    cache.nbuckets = cap;
+    return 0;
+}
+
+// Like send_file_some, from the cached buffer
+static ssize_t cache_send_some(int sock, CacheEntry *e, off_t *off, size_t len) {
+    if ((uint64_t)*off >= e->size) return -1;
+    size_t n = e->size - (size_t)*off < len ? e->size - (size_t)*off : len;
+    ssize_t s = send(sock, e->data + *off, n, 0);
+    if (s > 0) { metrics_bytes_out(s); *off += s; return s; }
+    if (s < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
+}
+
+// Positions r on the chunk holding off and returns that chunk's fd
+static int reader_chunk_fd(FileReader *r, uint64_t off) {
+    Manifest *m = r->m;
+    if (r->chunk_fd >= 0 && off >= m->starts[r->chunk_idx] && off < m->starts[r->chunk_idx + 1]) return r->chunk_fd;
+    uint32_t lo = 0, hi = m->count;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (m->starts[mid] <= off) lo = mid; else hi = mid;
+    }
+    if (r->chunk_fd >= 0) close(r->chunk_fd);
+    char path[512];
+    chunk_path(m->chunks[lo].sha, path, sizeof(path));
+    r->chunk_idx = lo;
+    r->chunk_fd = storage->open(path, O_RDONLY, 0);
+    return r->chunk_fd;
+}
+
+// Like send_file_some, for any engine
+ssize_t reader_send_some(int sock, FileReader *r, off_t *off, size_t len) {
+    if (r->cached) return cache_send_some(sock, r->cached, off, len);
+    if (!r->m) return send_file_some(sock, r->fd, off, len);
+    int cfd = reader_chunk_fd(r, (uint64_t)*off);
+    if (cfd < 0) return -1;
+    uint64_t start = r->m->starts[r->chunk_idx];
+    uint64_t end = r->m->starts[r->chunk_idx + 1];
+    size_t n = end - (uint64_t)*off < len ? (size_t)(end - (uint64_t)*off) : len;
+    off_t coff = (off_t)((uint64_t)*off - start);
+    ssize_t s = send_file_some(sock, cfd, &coff, n);
+    if (s > 0) *off += s;
+    return s;
+}
+
+ssize_t reader_pread(FileReader *r, void *buf, size_t len, off_t off) {
+    if (r->cached) {
+        if ((uint64_t)off >= r->size) return 0;
+        size_t n = r->size - (size_t)off < len ? r->size - (size_t)off : len;
+        memcpy(buf, r->cached->data + off, n);
+        return n;
+    }
+    if (!r->m) return storage->pread(r->fd, buf, len, off);
+    if ((uint64_t)off >= r->m->size) return 0;
+    int cfd = reader_chunk_fd(r, (uint64_t)off);
+    if (cfd < 0) return -1;
+    uint64_t start = r->m->starts[r->chunk_idx];
+    uint64_t end = r->m->starts[r->chunk_idx + 1];
+    size_t n = end - (uint64_t)off < len ? (size_t)(end - (uint64_t)off) : len;
+    return storage->pread(cfd, buf, n, (off_t)((uint64_t)off - start));
+}
+
+// Reads exactly len bytes unless the file ends first
+ssize_t reader_read_full(FileReader *r, void *buf, size_t len, off_t off) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = reader_pread(r, (char *)buf + got, len - got, off + got);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+void reader_close(FileReader *r) {
+    if (!r) return;
+    if (r->fd >= 0) close(r->fd);
+    if (r->chunk_fd >= 0) close(r->chunk_fd);
+    if (r->cached) cache_release(r->cached);
+    if (r->m) {
+        for (uint32_t i = 0; i < r->m->count; i++) chunk_release(r->m->chunks[i].sha);
+    }
+    manifest_free(r->m);
+    free(r);
+}
+
+static FileReader *cache_reader(CacheEntry *e) {
+    FileReader *r = calloc(1, sizeof(FileReader));
+    if (!r) { cache_release(e); return NULL; }
+    r->size = e->size;
+    r->fd = -1;
+    r->chunk_fd = -1;
+    r->cached = e;
+    return r;
+}
+
+// A reader on the cached copy, or NULL on a miss; *gen is for cache_fill
+static FileReader *cache_open(User *u, const char *name, uint64_t *gen) {
+    uint32_t hash = cache_hash(u, name);
+    pthread_mutex_lock(&cache.lock);
+    *gen = cache.gens[hash % CACHE_GEN_STRIPES];
+    CacheEntry *e = cache_find_locked(u, name, hash);
+    if (e) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        e->referenced = 1;
+        cache.hits++;
+    } else {
+        cache.misses++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return e ? cache_reader(e) : NULL;
+}
+
+// Loads the file behind r into the cache and returns a reader on the copy;
+// r itself is returned if the file is not admitted
+static FileReader *cache_fill(FileReader *r, User *u, const char *name, uint64_t gen) {
+    if (r->size == 0 || r->size > cache.budget / CACHE_ENTRY_SHARE) return r;
+    CacheEntry *e = calloc(1, sizeof(CacheEntry));
+    if (!e) return r;
+    e->user = u;
+    e->name = strdup(name);
+    e->hash = cache_hash(u, name);
+    e->size = r->size;
+    e->data = malloc(r->size);
+    e->refs = 2;
+    if (!e->name || !e->data || reader_read_full(r, e->data, r->size, 0) != (ssize_t)r->size) {
+        free(e->data); free(e->name); free(e);
+        return r;
+    }
+    pthread_mutex_lock(&cache.lock);
+    int ok = gen == cache.gens[e->hash % CACHE_GEN_STRIPES] && !cache_find_locked(u, name, e->hash) && cache_grow_locked() == 0;
+    if (ok) {
+        cache_evict_locked(e->size);
+        e->slot = cache.count;
+        cache.ring[cache.count++] = e;
+        e->next = cache.buckets[e->hash & (cache.nbuckets - 1)];
+        cache.buckets[e->hash & (cache.nbuckets - 1)] = e;
+        cache.used += e->size;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    if (!ok) {
+        free(e->data); free(e->name); free(e);
+        return r;
+    }
+    FileReader *cr = cache_reader(e);
+    if (!cr) return r;
+    reader_close(r);
+    return cr;
+}
+
+// The stored file changed or is gone
+static void cache_invalidate(User *u, const char *name) {
+    uint32_t hash = cache_hash(u, name);
+    pthread_mutex_lock(&cache.lock);
+    cache.gens[hash % CACHE_GEN_STRIPES]++;
+    CacheEntry *e = cache_find_locked(u, name, hash);
+    if (e) {
+        cache_unlink_locked(e);
+        cache.invalidations++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Rebuilds chunk reference counts from every manifest and removes chunks
+// that no manifest uses any more (left behind by a crash)
+static void dedup_load(void) {
+    gear_init();
+    for (int i = 0; i < CHUNK_SHARDS; i++) pthread_mutex_init(&chunk_shards[i].lock, NULL);
+    ensure_dir(CHUNK_DIR);
+
+    DIR *top = opendir(STORAGE_DIR);
+    if (!top) return;
+    struct dirent *ud;
+    while ((ud = readdir(top)) != NULL) {
+        if (ud->d_name[0] == '.') continue;
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s/%s", STORAGE_DIR, ud->d_name);
+        DIR *d = opendir(dir);
+        if (!d) continue;
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            if (e->d_name[0] == '.' && (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))) continue;
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            Manifest *m = manifest_read_path(path);
+            if (!m) continue;
+            for (uint32_t i = 0; i < m->count; i++) {
+                ChunkShard *sh = chunk_shard(m->chunks[i].sha);
+                ChunkEntry *ce = chunk_find_locked(sh, m->chunks[i].sha);
+                if (ce) ce->refs++;
+                else chunk_insert_locked(sh, m->chunks[i].sha, 1);
+            }
+            manifest_free(m);
+        }
+        closedir(d);
+    }
+    closedir(top);
+
+    DIR *cd = opendir(CHUNK_DIR);
+    if (!cd) return;
+    while ((ud = readdir(cd)) != NULL) {
+        if (ud->d_name[0] == '.') continue;
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s/%s", CHUNK_DIR, ud->d_name);
+        DIR *d = opendir(dir);
+        if (!d) continue;
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            if (e->d_name[0] == '.') continue;
+            char hex[65], path[1024];
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unsigned char sha[32];
+            int ok = strlen(ud->d_name) == 2 && strlen(e->d_name) == 62;
+            if (ok) { memcpy(hex, ud->d_name, 2); memcpy(hex + 2, e->d_name, 63); }
+            for (int i = 0; ok && i < 32; i++) ok = sscanf(hex + 2*i, "%2hhx", &sha[i]) == 1;
+            if (!ok || !chunk_find_locked(chunk_shard(sha), sha)) unlink(path);
+        }
+        closedir(d);
+    }
+    closedir(cd);
+}
+
+// The engine a storage tree was written with is recorded in
+// storage/.engine; trees without the marker predate engines and are plain.
+static int storage_select_engine(const char *want) {
+    char marker[512], found[32] = "";
+    snprintf(marker, sizeof(marker), "%s/.engine", STORAGE_DIR);
+    FILE *fp = fopen(marker, "r");
+    if (fp) {
+        if (!fgets(found, sizeof(found), fp)) found[0] = '\0';
+        found[strcspn(found, "\n")] = '\0';
+        fclose(fp);
+    } else {
+        // An empty tree can start with any engine
+        int empty = 1;
+        DIR *top = opendir(STORAGE_DIR);
+        struct dirent *ud;
+        while (top && empty && (ud = readdir(top)) != NULL) {
+            if (ud->d_name[0] == '.') continue;
+            char dir[512];
+            snprintf(dir, sizeof(dir), "%s/%s", STORAGE_DIR, ud->d_name);
+            DIR *d = opendir(dir);
+            struct dirent *e;
+            while (d && empty && (e = readdir(d)) != NULL) empty = (e->d_name[0] == '.');
+            if (d) closedir(d);
+        }
+        if (top) closedir(top);
+        snprintf(found, sizeof(found), "%s", empty ? (want ? want : "plain") : "plain");
+        fp = fopen(marker, "w");
+        if (fp) { fprintf(fp, "%s\n", found); fclose(fp); }
+    }
+
+    if (want && strcmp(want, found) != 0) {
+        fprintf(stderr, "%s was written with the %s engine, not %s\n", STORAGE_DIR, found, want);
+        return -1;
+    }
+    if (strcmp(found, "dedup") == 0) { engine = &dedup_engine; dedup_load(); }
+    else if (strcmp(found, "plain") == 0) engine = &plain_engine;
+    else { fprintf(stderr, "Unknown storage engine '%s'\n", found); return -1; }
+    return 0;
+}
+
+// Startup scan that rebuilds every user's file index from the storage
+// tree, for adopting a tree without metadata or recovering from metadata
+// that no longer matches the disk. User directories are claimed one at a
+// time by scanner threads, each reading its directory in large
+// getdents64 batches and sizing entries through the engine's stat. The
+// listener opens once the scan is done, or with --rescan-serve right away,
+// refusing logins of users whose directory has not been scanned yet.
+#define INDEX_SCAN_THREADS_MAX 32
+#define INDEX_DENTS_BUF (64 * 1024)
+
+struct index_dirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static struct {
+    User **users;
+    size_t nusers;
+    size_t next;             // next user to claim
+    size_t done, files;
+    size_t adopted;          // directories that had no account
+} index_scan;
+
+static void file_index_free(FileIndex *fi) {
+    free(fi->slots);
+    free(fi->names);
+    free(fi->sorted);
+    memset(fi, 0, sizeof(*fi));
+}
+
+// Calls fn for every entry of dirfd; returns -1 if the directory cannot be read
+static int index_read_dir(int dirfd, char *buf, void (*fn)(int dirfd, const struct index_dirent *d, void *arg), void *arg) {
+    for (;;) {
+        long n = syscall(SYS_getdents64, dirfd, buf, INDEX_DENTS_BUF);
+        if (n < 0) return -1;
+        if (n == 0) return 0;
+        for (long off = 0; off < n;) {
+            const struct index_dirent *d = (const struct index_dirent *)(buf + off);
+            off += d->d_reclen;
+            fn(dirfd, d, arg);
+        }
+    }
+}
+
+typedef struct IndexUserScan {
+    FileIndex files;
+    size_t used;
+    int failed;
+} IndexUserScan;
+
+static void index_add_entry(int dirfd, const struct index_dirent *d, void *arg) {
+    IndexUserScan *scan = arg;
+    size_t size;
+    int created;
+    // Staging leftovers and . / .. fail valid_filename
+    if (!valid_filename(d->d_name)) return;
+    if (d->d_type != DT_REG && d->d_type != DT_UNKNOWN) return;
+    if (engine->stat(dirfd, d->d_name, &size) != 0) return;
+    FileNode *f = file_index_upsert(&scan->files, d->d_name, &created);
+    if (!f) { scan->failed = 1; return; }
+    f->size = size;
+    scan->used += size;
+    __atomic_add_fetch(&index_scan.files, 1, __ATOMIC_RELAXED);
+}
+
+// Builds u's index aside and swaps it in, so the user is never seen half scanned
+static void index_scan_user(User *u, char *buf) {
+    char dir[512];
+    IndexUserScan scan = { 0 };
+    snprintf(dir, sizeof(dir), "%s/%s", STORAGE_DIR, u->username);
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0 || index_read_dir(dfd, buf, index_add_entry, &scan) != 0 || scan.failed) {
+        fprintf(stderr, "Cannot index %s: %s, keeping its recorded files\n", dir, scan.failed ? "out of memory" : strerror(errno));
+        file_index_free(&scan.files);
+    } else {
+        pthread_mutex_lock(&u->ulock);
+        FileIndex old = u->files;
+        // Checksums are kept for files whose size did not change
+        for (size_t k = 0; k < scan.files.nslots; k++) {
+            FileNode *f = &scan.files.slots[k];
+            if (f->name_off >= FILE_SLOT_DELETED) continue;
+            FileNode *was = file_index_find(&old, file_name(&scan.files, f));
+            if (was && was->has_crc && was->size == f->size) {
+                f->crc = was->crc;
+                f->has_crc = 1;
+            }
+        }
+        u->files = scan.files;
+        u->used = scan.used;
+        pthread_mutex_unlock(&u->ulock);
+        file_index_free(&old);
+    }
+    if (dfd >= 0) close(dfd);
+    __atomic_store_n(&u->indexed, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&index_scan.done, 1, __ATOMIC_RELEASE);
+}
+
+static void *index_scan_thread(void *arg) {
+    (void)arg;
+    char *buf = malloc(INDEX_DENTS_BUF);
+    if (!buf) perror_exit("malloc");
+    size_t i;
+    while ((i = __atomic_fetch_add(&index_scan.next, 1, __ATOMIC_RELAXED)) < index_scan.nusers) {
+        index_scan_user(index_scan.users[i], buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void index_add_user(int dirfd, const struct index_dirent *d, void *arg) {
+    size_t *cap = arg;
+    if (!valid_username(d->d_name) || strlen(d->d_name) >= USERNAME_MAX) return;
+    if (d->d_type != DT_DIR) {
+        struct stat st;
+        if (d->d_type != DT_UNKNOWN || fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode)) return;
+    }
+    User *u = user_lookup(d->d_name);
+    if (!u) {
+        // A directory without an account: its files are indexed, but with
+        // no password the account stays locked
+        user_create(d->d_name, "");
+        u = user_lookup(d->d_name);
+        if (!u) return;
+        index_scan.adopted++;
+    }
+    if (index_scan.nusers == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        User **nu = realloc(index_scan.users, *cap * sizeof(User *));
+        if (!nu) perror_exit("realloc");
+        index_scan.users = nu;
+    }
+    __atomic_store_n(&u->indexed, 0, __ATOMIC_RELEASE);
+    index_scan.users[index_scan.nusers++] = u;
+}
+
+// Lists the user directories and marks those users unindexed; must run
+// before the listener opens
+static void index_prepare(void) {
+    size_t cap = 0;
+    char *buf = malloc(INDEX_DENTS_BUF);
+    int dfd = open(STORAGE_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!buf || dfd < 0 || index_read_dir(dfd, buf, index_add_user, &cap) != 0) perror_exit("scan " STORAGE_DIR);
+    close(dfd);
+    free(buf);
+    if (index_scan.adopted) printf("Adopted %zu directories without an account as locked accounts\n", index_scan.adopted);
+}
+
+// Runs the scanner threads, reporting progress every second, then
+// snapshots the rebuilt indexes so the next start need not scan again
+static void *index_rebuild(void *arg) {
+    (void)arg;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = ncpu > 0 ? (size_t)ncpu : 1;
+    if (nthreads > INDEX_SCAN_THREADS_MAX) nthreads = INDEX_SCAN_THREADS_MAX;
+    if (nthreads > index_scan.nusers) nthreads = index_scan.nusers ? index_scan.nusers : 1;
+    pthread_t tids[INDEX_SCAN_THREADS_MAX];
+    for (size_t i = 0; i < nthreads; i++) pthread_create(&tids[i], NULL, index_scan_thread, NULL);
+
+    for (int ticks = 1; __atomic_load_n(&index_scan.done, __ATOMIC_ACQUIRE) < index_scan.nusers; ticks++) {
+        struct timespec tick = { 0, 50 * 1000 * 1000 };
+        nanosleep(&tick, NULL);
+        if (ticks % 20) continue;
+        printf("Indexing storage: %zu/%zu users, %zu files\n", __atomic_load_n(&index_scan.done, __ATOMIC_RELAXED),
+               index_scan.nusers, __atomic_load_n(&index_scan.files, __ATOMIC_RELAXED));
+        fflush(stdout);
+    }
+    for (size_t i = 0; i < nthreads; i++) pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("Indexed %zu files of %zu users in %.2fs with %zu threads\n", index_scan.files, index_scan.nusers,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, nthreads);
+    fflush(stdout);
+    free(index_scan.users);
+    if (meta_compact() != 0) perror("metadata snapshot");
+    return NULL;
+}
+
+// The upload's reservation is consumed on success and left to the caller
+// (upload_finish) otherwise
 void handle_upload(Task *t) {
-    pthread_mutex_lock(&users_mutex);
-    User *u = user_find_locked(t->username);
-    if (!u) { pthread_mutex_unlock(&users_mutex); t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "User not found"); unlink(t->tmp_path); return; }
-    pthread_mutex_lock(&u->ulock);
-    if (u->used + t->filesize > MAX_QUOTA) {
-        pthread_mutex_unlock(&u->ulock);
-        pthread_mutex_unlock(&users_mutex);
-        t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "Quota exceeded"); unlink(t->tmp_path); return;
+    User *u = t->user;
+    // Protocol 1 uploads learn their size only now
+    size_t extra = t->filesize > t->reserved ? t->filesize - t->reserved : 0;
+    if (extra && user_quota_reserve(u, t->filename, extra) != 0) {
+        t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "Quota exceeded"); return;
+    }
+
+    // Stripes arrive out of order, so their checksum is taken from the staged file
+    if (!t->has_crc) t->has_crc = staging_crc(t->fd, t->filesize, &t->crc) == 0;
+
+    pthread_mutex_t *lock = commit_lock(u, t->filename);
+    pthread_mutex_lock(lock);
+    user_commit_begin(u);
+    if (engine->commit(u, t->fd, t->tmp_path, t->filename, t->filesize) != 0) {
+        user_commit_end(u);
+        pthread_mutex_unlock(lock);
+        user_quota_release(u, extra);
+        t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "Commit failed: %s", strerror(errno));
+        return;
+    }
+    user_add_file(t->user, t->filename, t->filesize, t->has_crc ? &t->crc : NULL, t->reserved + extra);
+    user_commit_end(u);
+    cache_invalidate(t->user, t->filename);
+    pthread_mutex_unlock(lock);
+    t->status = 0;
+    t->result_buf = strdup("OK\n"); t->result_size = strlen(t->result_buf);
+}
+
+void handle_download(Task *t) {
+    uint64_t gen, commits;
+    t->has_crc = user_file_crc(t->user, t->filename, &t->crc, &commits) == 0;
+    FileReader *r = cache_open(t->user, t->filename, &gen);
+    if (!r) {
+        r = engine->open(t->user, t->filename);
+        if (!r) { t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "File not found"); return; }
+        r = cache_fill(r, t->user, t->filename, gen);
+        // Files read whole into the cache are checked here; the client
+        // checks the others against the checksum in the reply
+        if (r->cached && t->has_crc && crc32c(0, r->cached->data, r->size) != t->crc &&
+            !user_commits_changed(t->user, commits)) {
+            fprintf(stderr, "Checksum mismatch in %s/%s\n", t->user->username, t->filename);
+            cache_invalidate(t->user, t->filename);
+            reader_close(r);
+            t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "Checksum mismatch");
+            return;
+        }
+    }
+    if (t->has_crc && user_commits_changed(t->user, commits)) t->has_crc = 0;
+    t->status = 0;
+    t->reader = r; t->result_size = r->size;
+}
+
+void handle_delete(Task *t) {
+    pthread_mutex_t *lock = commit_lock(t->user, t->filename);
+    pthread_mutex_lock(lock);
+    if (engine->remove(t->user, t->filename) != 0) {
+        pthread_mutex_unlock(lock);
+        // Safe string copying
+        strncpy(t->errmsg, errno == ENOENT ? "File not found" : strerror(errno), sizeof(t->errmsg) - 1);
+        t->errmsg[sizeof(t->errmsg) - 1] = '\0';
+        t->status = -1;
+        return;
+    }
+
+    cache_invalidate(t->user, t->filename);
+    user_remove_file(t->user, t->filename, NULL);
+    pthread_mutex_unlock(lock);
+    t->status = 0;
+    t->result_buf = strdup("OK\n");
+    t->result_size = strlen(t->result_buf);
+}
+
+// Signatures of every full block of the current version, for a delta
+// upload against it. A file that does not exist yet has no blocks.
+void handle_signatures(Task *t) {
+    t->reader = engine->open(t->user, t->filename);
+    if (!t->reader) {
+        if (errno == ENOENT) { t->status = 0; return; }
+        t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "Cannot read file: %s", strerror(errno));
+        return;
+    }
+    size_t bs = delta_block_size(t->reader->size);
+    size_t count = t->reader->size / bs;
+    unsigned char *block = malloc(bs);
+    t->result_buf = malloc(count ? count * DELTA_SIG_SIZE : 1);
+    if (!block || !t->result_buf) {
+        free(block);
+        t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "OOM");
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (reader_read_full(t->reader, block, bs, (off_t)(i * bs)) != (ssize_t)bs) {
+            free(block);
+            t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "Read failed");
+            return;
+        }
+        unsigned char *sig = (unsigned char *)t->result_buf + i * DELTA_SIG_SIZE;
+        RollSum rs;
+        rollsum_init(&rs, block, bs);
+        put_u32(sig, rollsum_digest(&rs));
+        Sha256 c;
+        unsigned char digest[32];
+        sha256_init(&c);
+        sha256_update(&c, block, bs);
+        sha256_final(&c, digest);
+        memcpy(sig + 4, digest, DELTA_STRONG_LEN);
+    }
+    free(block);
+    t->status = 0;
+    t->result_size = count * DELTA_SIG_SIZE;
+}
+
+void handle_list(Task *t) {
+    char *list = user_list_files(t->user);
+    if (!list) { t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "user not found"); return; }
+    t->status = 0; t->result_buf = list; t->result_size = strlen(list);
+}
+
+void handle_stat(Task *t) {
+    if (user_stat_file(t->user, t->filename, &t->filesize, &t->crc, &t->has_crc) != 0) {
+        t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "File not found"); return;
+    }
+    t->status = 0;
+}
+
+void task_execute(Task *t) {
+    if (t->type == TASK_UPLOAD) handle_upload(t);
+    else if (t->type == TASK_DOWNLOAD) handle_download(t);
+    else if (t->type == TASK_DELETE) handle_delete(t);
+    else if (t->type == TASK_LIST) handle_list(t);
+    else if (t->type == TASK_SIGNATURES) handle_signatures(t);
+    else if (t->type == TASK_STAT) handle_stat(t);
+}
+
+void *worker_thread(void *arg) {
+    int self = (int)(intptr_t)arg;
+    // Tasks a worker queues itself (download frames) stay on its deque
+    sched_home = self;
+    if (sched_mode == SCHED_STEAL) pin_to_cpu(self);
+    while (running) {
+        Task *t = pop_task(self);
+        if (!t) continue;
+        metrics_record(WAIT_TASKQ, now_ns() - t->queued_ns);
+        task_execute(t);
+
+        if (t->complete) { t->complete(t); continue; }
+        completion_signal(&t->done);
+    }
+    return NULL;
+}
+
+void send_error(int client_fd, const char *msg) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "ERR %s\n", msg);
+    send_all(client_fd, buf, strlen(buf));
+}
+
+void send_ok(int client_fd) {
+    send_all(client_fd, "OK\n", 3);
+}
+
+// " <crc>" after the size in replies about a whole file, if it has one
+static const char *crc_word(const Task *t, char buf[10]) {
+    if (!t->has_crc) return "";
+    snprintf(buf, 10, " %08x", t->crc);
+    return buf;
+}
+
+// Each connection is a small state machine so that it can be driven either
+// by a dedicated blocking thread (client_service) or, in reactor mode, by
+// whichever epoll thread sees it become ready:
+//   AUTH -> COMMAND -> PAYLOAD (upload body) / DELTA (delta upload
+//   instructions) / RESPONSE (download body) -> COMMAND
+// A command that needs a worker's result, or fewer tagged requests in
+// flight, parks the session in WAIT instead of blocking the thread.
+enum SessionState { SESS_AUTH, SESS_COMMAND, SESS_PAYLOAD, SESS_DELTA, SESS_RESPONSE, SESS_WAIT, SESS_CLOSED };
+
+// Result of one session step
+enum { STEP_MORE, STEP_WANT_READ, STEP_WANT_WRITE, STEP_PARKED, STEP_CLOSE };
+
+// Input is read ahead into a per-session buffer: command lines are parsed
+// in place, and body readers take whatever followed the command first
+#define SESSION_IN_BUF 4096
+#define SESSION_LINE_MAX 2048
+
+typedef struct Session {
+    int fd;
+    enum SessionState state;
+    int proto;
+    User *user;              // resolved once at LOGIN
+    int home;                // worker whose deque gets this connection's tasks
+    int admin;               // connected from the server host, may use STATS
+
+    // Untagged command being timed, and when the last line was read
+    enum MetricKind op;
+    uint64_t op_start;
+    uint64_t line_at;
+
+    // Bytes received but not consumed yet are in[in_off, in_len); partial
+    // lines survive short reads on non-blocking sockets
+    char in[SESSION_IN_BUF];
+    size_t in_off, in_len;
+    int in_skip;             // dropping the rest of an overlong line
+    char *line;              // current command, NUL-terminated inside in
+    size_t line_len;
+
+    // SESS_PAYLOAD: upload body being written to up's staging file
+    Upload *up;
+    int up_legacy;
+    int up_write_failed;
+
+    // SESS_PAYLOAD without up: bytes of a refused pipelined upload to skip
+    size_t drain_left;
+
+    // SESS_PAYLOAD for a STRIPE: the range being written into up
+    int up_stripe;
+    size_t stripe_start, stripe_off, stripe_end;
+
+    // MUPLOAD in progress: file headers still expected, and the batch's size
+    int batch_open;
+    int batch_left;
+    int batch_count;
+    char up_tag[24];         // tag of the upload being received, "" if untagged
+
+    // SESS_DELTA: instructions rebuilding up from the blocks of delta_base
+    FileReader *delta_base;
+    size_t delta_bs;
+    uint32_t delta_blocks;
+    unsigned char delta_op[5];
+    size_t delta_op_len;
+    uint32_t delta_lit_left;
+    const char *delta_err;
+
+    // SESS_RESPONSE: download body being sent from dl
+    FileReader *dl;
+    off_t dl_off;
+    size_t dl_left;
+    int dl_ranged;           // DOWNLOAD asked for a byte range
+
+    // MDOWNLOAD: names still to dispatch, one per line
+    char *mdl_names;
+    char *mdl_next;
+    size_t mdl_index, mdl_count;
+
+    // LZ-framed body (dropbox_proto.h) of the current upload or download.
+    // lz_buf holds one frame followed by room for one raw block.
+    int up_lz, dl_lz;
+    unsigned char *lz_buf;
+    size_t lz_have;          // frame bytes received, or built for sending
+    size_t lz_sent;
+    int lz_misses;           // blocks in a row that did not shrink
+
+    // Tagged requests still running on workers. Workers write their
+    // replies themselves, one frame at a time under send_lock.
+    pthread_mutex_t lock;
+    pthread_cond_t finished; // signalled whenever one completes
+    int inflight;
+    pthread_mutex_t send_lock;
+    int send_failed;
+
+    // Tagged output the socket would not take yet, see tx_thread (send_lock)
+    unsigned char *tx_buf;
+    size_t tx_off, tx_len, tx_cap;
+    int tx_held;             // in-flight slots the backlog holds
+    Task *tx_waiters;        // download frames waiting for it to drain
+
+    // SESS_WAIT: parked until wait_task has run or, without one, until at
+    // most wait_max tagged requests are left; then resume(s, wait_task)
+    // carries on from there
+    Task *wait_task;
+    void (*resume)(struct Session *s, Task *t);
+    int wait_max;
+    int idle_waiter;         // reactor mode: session_task_done wakes it
+    int closing;             // reactor mode: freed once idle
+    struct Session *ready_next;
+} Session;
+
+// Reactor mode, see reactor_thread. Parked sessions that may go on are
+// queued here; an eventfd in the epoll set wakes one thread per session.
+static int reactor_mode = 0;
+static int reactor_wake_fd = -1;
+static pthread_mutex_t reactor_ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static Session *reactor_ready_head, *reactor_ready_tail;
+
+static void reactor_wake(Session *s) {
+    s->ready_next = NULL;
+    pthread_mutex_lock(&reactor_ready_lock);
+    if (reactor_ready_tail) reactor_ready_tail->ready_next = s; else reactor_ready_head = s;
+    reactor_ready_tail = s;
+    pthread_mutex_unlock(&reactor_ready_lock);
+    uint64_t one = 1;
+    if (write(reactor_wake_fd, &one, sizeof(one)) < 0) perror("eventfd write");
+}
+
+Session *session_new(int fd) {
+    Session *s = calloc(1, sizeof(Session));
+    if (!s) return NULL;
+    s->fd = fd;
+    s->state = SESS_AUTH;
+    s->proto = 1;
+    s->home = sched_pick_home();
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr *)&peer, &peer_len) == 0 && peer.sin_family == AF_INET)
+        s->admin = (ntohl(peer.sin_addr.s_addr) >> 24) == 127;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->finished, NULL);
+    pthread_mutex_init(&s->send_lock, NULL);
+    return s;
+}
+
+// Waits until at most max tagged requests of s are running. Only the
+// thread driving the session ever waits.
+static void session_wait_inflight(Session *s, int max) {
+    pthread_mutex_lock(&s->lock);
+    while (s->inflight > max) pthread_cond_wait(&s->finished, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void session_wait_idle(Session *s) { session_wait_inflight(s, 0); }
+
+// Parks s until a worker has run t; the thread driving s next calls
+// resume(s, t) to finish the command
+static void session_await(Session *s, Task *t, void (*resume)(Session *, Task *)) {
+    t->session = s;
+    s->wait_task = t;
+    s->resume = resume;
+    s->state = SESS_WAIT;
+}
+
+// Returns 1 if at most max tagged requests of s are running. Otherwise s
+// is parked until that holds and 0 is returned; resume(s, NULL) runs then,
+// or without resume the current command line again.
+static int session_await_inflight(Session *s, int max, void (*resume)(Session *, Task *)) {
+    pthread_mutex_lock(&s->lock);
+    int inflight = s->inflight;
+    pthread_mutex_unlock(&s->lock);
+    if (inflight <= max) return 1;
+    s->wait_task = NULL;
+    s->wait_max = max;
+    s->resume = resume;
+    s->state = SESS_WAIT;
+    return 0;
+}
+
+// Threaded mode: the connection thread waits for what s is parked on
+static void session_block(Session *s) {
+    if (s->wait_task) {
+        push_task(s->wait_task);
+        task_wait(s->wait_task);
+    } else {
+        session_wait_inflight(s, s->wait_max);
+    }
+}
+
+static void session_task_ready(Task *t) {
+    reactor_wake(t->session);
+}
+
+// Reactor mode: hands a parked s over to what it waits for, which wakes it
+// once done. Returns 1 if that is already the case.
+static int session_park(Session *s) {
+    if (s->wait_task) {
+        s->wait_task->complete = session_task_ready;
+        push_task(s->wait_task);
+        return 0;
+    }
+    pthread_mutex_lock(&s->lock);
+    int ready = s->inflight <= s->wait_max;
+    if (!ready) s->idle_waiter = 1;
+    pthread_mutex_unlock(&s->lock);
+    return ready;
+}
+
+// Body transfers in progress count towards the user's active transfers
+static int session_transferring(const Session *s) {
+    return s->state == SESS_PAYLOAD || s->state == SESS_DELTA || s->state == SESS_RESPONSE;
+}
+
+static void session_inflight_add(Session *s, int n) {
+    pthread_mutex_lock(&s->lock);
+    s->inflight += n;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// s may be freed right after
+static void session_inflight_sub(Session *s, int n) {
+    pthread_mutex_lock(&s->lock);
+    s->inflight -= n;
+    int wake = s->idle_waiter && s->inflight <= s->wait_max;
+    if (wake) s->idle_waiter = 0;
+    pthread_cond_signal(&s->finished);
+    pthread_mutex_unlock(&s->lock);
+    if (wake) reactor_wake(s);
+}
+
+// Called last by a tagged request's completion; s may be freed right after
+static void session_task_done(Session *s) {
+    __atomic_sub_fetch(&s->user->transfers, 1, __ATOMIC_RELAXED);
+    session_inflight_sub(s, 1);
+}
+
+// Hands a tagged request to the workers; complete replies once it is done.
+// Callers have made sure there is room (session_await_inflight).
+static void session_dispatch(Session *s, Task *t, const char *tag, void (*complete)(Task *)) {
+    session_inflight_add(s, 1);
+    __atomic_add_fetch(&s->user->transfers, 1, __ATOMIC_RELAXED);
+    t->started_ns = s->line_at;
+    t->session = s;
+    t->complete = complete;
+    snprintf(t->tag, sizeof(t->tag), "%s", tag);
+    push_task(t);
+}
+
+// Tagged output never waits for a slow client. What the socket does not
+// take is queued on the session as its backlog, which tx_thread sends once
+// the socket drains; everything written meanwhile goes behind it, and
+// download frames wait on tx_waiters until it is gone. The backlog holds an
+// in-flight slot, so untagged replies and session_free wait for it, and a
+// large one holds all of them, so no further tagged commands are read.
+#define TX_BACKLOG_MAX (1024 * 1024)
+
+static int tx_epfd = -1;
+
+static int session_tx_idle(const Session *s) { return s->tx_off == s->tx_len; }
+
+// A failed send leaves the stream unframed, so the connection is shut down
+// and later replies are dropped
+static void session_tx_fail(Session *s) {
+    s->send_failed = 1;
+    shutdown(s->fd, SHUT_RDWR);
+}
+
+// Room for len more backlog bytes at tx_buf + tx_len
+static int session_tx_reserve(Session *s, size_t len) {
+    if (s->tx_off > 0 && s->tx_off == s->tx_len) s->tx_off = s->tx_len = 0;
+    if (s->tx_len + len <= s->tx_cap) return 0;
+    size_t cap = s->tx_cap ? s->tx_cap : 65536;
+    while (cap < s->tx_len + len) cap *= 2;
+    unsigned char *buf = realloc(s->tx_buf, cap);
+    if (!buf) return -1;
+    s->tx_buf = buf;
+    s->tx_cap = cap;
+    return 0;
+}
+
+// Accounts for len bytes just added at tx_buf + tx_len; the first ones hand
+// the socket to tx_thread
+static int session_tx_queued(Session *s, size_t len) {
+    int was_idle = session_tx_idle(s);
+    s->tx_len += len;
+    int held = s->tx_len - s->tx_off > TX_BACKLOG_MAX ? SESSION_MAX_INFLIGHT : 1;
+    if (held > s->tx_held) {
+        session_inflight_add(s, held - s->tx_held);
+        s->tx_held = held;
+    }
+    if (!was_idle) return 0;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLONESHOT;
+    ev.data.ptr = s;
+    if (epoll_ctl(tx_epfd, EPOLL_CTL_ADD, s->fd, &ev) == 0) return 0;
+    // Nobody will send it, so the stream is lost
+    s->tx_off = s->tx_len = 0;
+    session_inflight_sub(s, s->tx_held);
+    s->tx_held = 0;
+    return -1;
+}
+
+static int session_tx_queue(Session *s, const void *buf, size_t len) {
+    if (len == 0) return 0;
+    if (session_tx_reserve(s, len) != 0) return -1;
+    memcpy(s->tx_buf + s->tx_len, buf, len);
+    return session_tx_queued(s, len);
+}
+
+// Sends what the socket takes right away, all pieces in one sendmsg, and
+// queues the rest. Returns -1 once the stream is broken.
+static int session_tx_writev(Session *s, struct iovec *iov, int cnt, int flags) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    iov_advance(&msg, 0);
+    while (session_tx_idle(s) && msg.msg_iovlen > 0) {
+        ssize_t w = sendmsg(s->fd, &msg, flags | MSG_DONTWAIT);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (w <= 0) return -1;
+        metrics_bytes_out(w);
+        iov_advance(&msg, w);
+    }
+    for (size_t i = 0; i < msg.msg_iovlen; i++) {
+        if (session_tx_queue(s, msg.msg_iov[i].iov_base, msg.msg_iov[i].iov_len) != 0) return -1;
+    }
+    return 0;
+}
+
+static int session_tx_write(Session *s, const void *buf, size_t len, int flags) {
+    struct iovec iov = { (void *)buf, len };
+    return session_tx_writev(s, &iov, 1, flags);
+}
+
+// Sends the backlog until the socket is full: 1 if some is left, 0 once it
+// is gone, -1 if the stream broke
+static int session_tx_flush(Session *s) {
+    while (!session_tx_idle(s)) {
+        ssize_t w = send(s->fd, s->tx_buf + s->tx_off, s->tx_len - s->tx_off, MSG_DONTWAIT);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+        if (w <= 0) return -1;
+        metrics_bytes_out(w);
+        s->tx_off += w;
+    }
+    return 0;
+}
+
+// tx_thread found s writable (or broken): sends what it can, and once the
+// backlog is gone requeues the waiting frames and gives up its slots
+static void session_tx_resume(Session *s) {
+    pthread_mutex_lock(&s->send_lock);
+    int rc = s->send_failed ? -1 : session_tx_flush(s);
+    if (rc > 0) {
+        struct epoll_event ev;
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        ev.data.ptr = s;
+        if (epoll_ctl(tx_epfd, EPOLL_CTL_MOD, s->fd, &ev) == 0) {
+            pthread_mutex_unlock(&s->send_lock);
+            return;
+        }
+        rc = -1;
+    }
+    if (rc < 0 && !s->send_failed) session_tx_fail(s);
+    epoll_ctl(tx_epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    s->tx_off = s->tx_len = 0;
+    Task *waiters = s->tx_waiters;
+    s->tx_waiters = NULL;
+    int held = s->tx_held;
+    s->tx_held = 0;
+    pthread_mutex_unlock(&s->send_lock);
+    while (waiters) {
+        Task *t = waiters;
+        waiters = t->next;
+        push_task(t);
+    }
+    session_inflight_sub(s, held);
+}
+
+void *tx_thread(void *arg) {
+    (void)arg;
+    struct epoll_event evs[64];
+    while (1) {
+        int n = epoll_wait(tx_epfd, evs, 64, -1);
+        if (n < 0 && errno != EINTR) { perror("epoll_wait"); break; }
+        for (int i = 0; i < n; i++) session_tx_resume(evs[i].data.ptr);
+    }
+    return NULL;
+}
+
+// Sends "#<tag> <line>" (just the line for tag "") and an optional body as
+// one frame
+static void session_send_tagged(Session *s, const char *tag, const char *line, const void *body, size_t len) {
+    char head[512];
+    if (tag[0]) snprintf(head, sizeof(head), "#%s %s\n", tag, line);
+    else snprintf(head, sizeof(head), "%s\n", line);
+    struct iovec iov[2] = { { head, strlen(head) }, { (void *)body, len } };
+    pthread_mutex_lock(&s->send_lock);
+    if (!s->send_failed && session_tx_writev(s, iov, 2, 0) != 0) session_tx_fail(s);
+    pthread_mutex_unlock(&s->send_lock);
+}
+
+static void session_error(Session *s, const char *tag, const char *msg) {
+    char line[300];
+    snprintf(line, sizeof(line), "ERR %s", msg);
+    session_send_tagged(s, tag, line, NULL, 0);
+}
+
+void session_free(Session *s) {
+    // Workers may still be writing replies to the socket
+    session_wait_idle(s);
+    if (s->user && session_transferring(s)) __atomic_sub_fetch(&s->user->transfers, 1, __ATOMIC_RELAXED);
+    if (s->up && s->up_stripe) {
+        // What did arrive of the stripe is kept
+        upload_stripe_detach(s->up, s->stripe_start, s->up_write_failed ? s->stripe_start : s->stripe_off);
+    } else if (s->up) {
+        // A dropped protocol 2 upload can still be resumed
+        if (s->up_write_failed) upload_finish(s->up, 0);
+        else upload_park(s->up);
+    }
+    reader_close(s->dl);
+    reader_close(s->delta_base);
+    free(s->lz_buf);
+    free(s->mdl_names);
+    free(s->tx_buf);
+    close(s->fd);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->finished);
+    pthread_mutex_destroy(&s->send_lock);
+    free(s);
+}
+
+// Tops up the input buffer with one recv, moving what is left to the front
+static ssize_t session_fill(Session *s) {
+    if (s->in_off > 0) {
+        memmove(s->in, s->in + s->in_off, s->in_len - s->in_off);
+        s->in_len -= s->in_off;
+        s->in_off = 0;
+    }
+    ssize_t r = recv(s->fd, s->in + s->in_len, sizeof(s->in) - s->in_len, 0);
+    if (r > 0) {
+        metrics_bytes_in(r);
+        s->in_len += r;
+    }
+    return r;
+}
+
+// All body reads go through here. Buffered bytes come first; with none
+// left, reads of at least a buffer's worth go straight to buf.
+static ssize_t session_recv(Session *s, void *buf, size_t len) {
+    if (s->in_off == s->in_len && len < sizeof(s->in)) {
+        ssize_t r = session_fill(s);
+        if (r <= 0) return r;
+    }
+    if (s->in_off < s->in_len) {
+        size_t n = s->in_len - s->in_off;
+        if (n > len) n = len;
+        memcpy(buf, s->in + s->in_off, n);
+        s->in_off += n;
+        return (ssize_t)n;
+    }
+    ssize_t r = recv(s->fd, buf, len, 0);
+    if (r > 0) metrics_bytes_in(r);
+    return r;
+}
+
+// Returns STEP_MORE once s->line holds a full line, cut out of the input
+// buffer without copying. Lines that do not fit are skipped; s->line is
+// NULL for them so the caller can refuse them.
+static int session_read_line(Session *s) {
+    for (;;) {
+        char *start = s->in + s->in_off;
+        size_t have = s->in_len - s->in_off;
+        char *nl = memchr(start, '\n', have);
+        if (nl) {
+            s->in_off += nl - start + 1;
+            if (s->in_skip) { s->in_skip = 0; continue; }
+            *nl = '\0';
+            s->line = start;
+            s->line_len = nl - start;
+            return STEP_MORE;
+        }
+        if (s->in_skip || have >= SESSION_LINE_MAX) {
+            int refused = !s->in_skip;
+            s->in_skip = 1;
+            s->in_off = s->in_len;
+            if (refused) { s->line = NULL; return STEP_MORE; }
+        }
+        ssize_t r = session_fill(s);
+        if (r == 0) return STEP_CLOSE;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WANT_READ;
+            return STEP_CLOSE;
+        }
+    }
+}
+
+static void session_auth_command(Session *s, char *buf) {
+    int client_fd = s->fd;
+    if (strncmp(buf, "SIGNUP ", 7) == 0) {
+        char user[USERNAME_MAX], pass[PASS_MAX];
+        if (sscanf(buf+7, "%63s %63s", user, pass) != 2) { send_error(client_fd, "Usage: SIGNUP <user> <pass>"); return; }
+        if (!valid_username(user)) send_error(client_fd, "Invalid username");
+        else if (user_create(user, pass) == 0) send_ok(client_fd);
+        else send_error(client_fd, "User exists");
+    } else if (strncmp(buf, "LOGIN ", 6) == 0) {
+        char user[USERNAME_MAX], pass[PASS_MAX];
+        if (sscanf(buf+6, "%63s %63s", user, pass) != 2) { send_error(client_fd, "Usage: LOGIN <user> <pass>"); return; }
+        User *u = user_login(user, pass);
+        if (u && !__atomic_load_n(&u->indexed, __ATOMIC_ACQUIRE)) {
+            send_error(client_fd, "Storage is being indexed, try again shortly");
+        } else if (u) {
+            s->user = u;
+            s->state = SESS_COMMAND;
+            send_ok(client_fd);
+        } else {
+            send_error(client_fd, "Invalid credentials");
+        }
+    } else {
+        send_error(client_fd, "Authenticate first with SIGNUP or LOGIN");
+    }
+}
+
+// Strips the trailing LZ transfer flag from args; returns whether it was there
+static int take_lz_flag(char *args) {
+    size_t n = strlen(args);
+    while (n > 0 && args[n-1] == ' ') args[--n] = '\0';
+    if (n < 3 || strcmp(args + n - 3, " LZ") != 0) return 0;
+    args[n - 3] = '\0';
+    return 1;
+}
+
+// Sets up an LZ transfer; without memory for the frame buffer it falls back to raw
+static int session_want_lz(Session *s, int lz) {
+    if (lz && !s->lz_buf) s->lz_buf = malloc(2 * (LZ_FRAME_HDR + LZ_BLOCK_MAX));
+    s->lz_have = s->lz_sent = 0;
+    s->lz_misses = 0;
+    return lz && s->lz_buf;
+}
+
+static void session_send_ready(Session *s) {
+    char reply[64];
+    // Echoing LZ confirms that the body may come compressed
+    snprintf(reply, sizeof(reply), "READY %016llx %zu%s\n", (unsigned long long)s->up->id, s->up->received, s->up_lz ? " LZ" : "");
+    send_all(s->fd, reply, strlen(reply));
+}
+
+static void session_start_upload(Session *s, char *args) {
+    int client_fd = s->fd;
+    char fname[MAX_FILENAME];
+    unsigned long long declared = 0;
+    int lz = s->proto >= 2 && take_lz_flag(args);
+    int nargs = sscanf(args, "%255s %llu", fname, &declared);
+    if (nargs < 1 || (s->proto >= 2 && nargs != 2)) {
+        send_error(client_fd, s->proto >= 2 ? "Usage: UPLOAD <filename> <size> [LZ]" : "Usage: UPLOAD <filename>");
+        return;
+    }
+    if (!valid_filename(fname)) {
+        send_error(client_fd, "Invalid filename");
+        return;
+    }
+
+    // Sized uploads are rejected before the client sends any payload
+    const char *err = NULL;
+    s->up = upload_new(s->user, fname, s->proto >= 2 ? (size_t)declared : 0, s->proto >= 2, &err);
+    if (!s->up) {
+        send_error(client_fd, err);
+        return;
+    }
+    s->up_legacy = (s->proto < 2);
+    s->up_write_failed = 0;
+    s->up_lz = session_want_lz(s, lz);
+    s->state = SESS_PAYLOAD;
+    if (!s->up_legacy) session_send_ready(s);
+}
+
+// RESUME <id>: continue a protocol 2 upload whose connection dropped
+static void session_resume_upload(Session *s, char *args) {
+    unsigned long long id;
+    int lz = take_lz_flag(args);
+    if (s->proto < 2 || sscanf(args, "%llx", &id) != 1) {
+        send_error(s->fd, "Usage: RESUME <upload-id> [LZ]");
+        return;
+    }
+    const char *err = NULL;
+    s->up = upload_resume(s->user, (uint64_t)id, &err);
+    if (!s->up) { send_error(s->fd, err); return; }
+    s->up_legacy = 0;
+    s->up_write_failed = 0;
+    s->up_lz = session_want_lz(s, lz);
+    s->state = SESS_PAYLOAD;
+    session_send_ready(s);
+}
+
+// STRIPE_OPEN <name> <size> -> OK <id>: a striped upload that STRIPE
+// requests fill, possibly on several connections of the same user
+static void session_stripe_open(Session *s, char *args) {
+    char fname[MAX_FILENAME], reply[64];
+    unsigned long long declared;
+    if (s->proto < 2 || sscanf(args, "%255s %llu", fname, &declared) != 2) {
+        send_error(s->fd, "Usage: STRIPE_OPEN <filename> <size>");
+        return;
+    }
+    if (!valid_filename(fname)) { send_error(s->fd, "Invalid filename"); return; }
+    const char *err = NULL;
+    Upload *up = upload_new_striped(s->user, fname, (size_t)declared, &err);
+    if (!up) { send_error(s->fd, err); return; }
+    snprintf(reply, sizeof(reply), "OK %016llx\n", (unsigned long long)up->id);
+    send_all(s->fd, reply, strlen(reply));
+}
+
+// STRIPE <id> <offset> <len> -> READY, <len> raw bytes, OK <len>
+static void session_stripe_start(Session *s, char *args) {
+    unsigned long long id, off, len;
+    if (s->proto < 2 || sscanf(args, "%llx %llu %llu", &id, &off, &len) != 3) {
+        send_error(s->fd, "Usage: STRIPE <upload-id> <offset> <len>");
+        return;
+    }
+    const char *err = NULL;
+    s->up = upload_stripe_attach(s->user, (uint64_t)id, (size_t)off, (size_t)len, &err);
+    if (!s->up) { send_error(s->fd, err); return; }
+    s->up_stripe = 1;
+    s->up_lz = 0;
+    s->up_legacy = 0;
+    s->up_write_failed = 0;
+    s->stripe_start = s->stripe_off = (size_t)off;
+    s->stripe_end = (size_t)(off + len);
+    s->state = SESS_PAYLOAD;
+    send_all(s->fd, "READY\n", 6);
+}
+
+static int session_recv_stripe(Session *s) {
+    char buf[RECV_CHUNK];
+    if (s->stripe_off == s->stripe_end) {
+        char reply[64];
+        int failed = s->up_write_failed;
+        upload_stripe_detach(s->up, s->stripe_start, failed ? s->stripe_start : s->stripe_end);
+        snprintf(reply, sizeof(reply), "OK %zu\n", s->stripe_end - s->stripe_start);
+        if (failed) send_error(s->fd, "Write failed");
+        else send_all(s->fd, reply, strlen(reply));
+        s->up = NULL;
+        s->up_stripe = 0;
+        s->state = SESS_COMMAND;
+        return STEP_MORE;
+    }
+    size_t left = s->stripe_end - s->stripe_off;
+    ssize_t r = session_recv(s, buf, left < sizeof(buf) ? left : sizeof(buf));
+    if (r == 0) return STEP_CLOSE;
+    if (r < 0) {
+        if (errno == EINTR) return STEP_MORE;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WANT_READ;
+        return STEP_CLOSE;
+    }
+    for (ssize_t done = 0; done < r && !s->up_write_failed;) {
+        ssize_t w = storage->pwrite(s->up->fd, buf + done, r - done, (off_t)(s->stripe_off + done));
+        if (w <= 0) s->up_write_failed = 1;
+        else done += w;
+    }
+    s->stripe_off += r;
+    return STEP_MORE;
+}
+
+// Untagged upload or STRIPE_COMMIT, once the worker has committed it
+static void session_upload_done(Session *s, Task *t) {
+    upload_finish(t->upload, t->status == 0);
+    if (t->status == 0) {
+        if (s->proto >= 2) {
+            char reply[64], crc[10];
+            snprintf(reply, sizeof(reply), "OK %zu%s\n", t->filesize, crc_word(t, crc));
+            send_all(s->fd, reply, strlen(reply));
+        } else {
+            send_ok(s->fd);
+        }
+    }
+    else send_error(s->fd, t->errmsg[0] ? t->errmsg : "UPLOAD failed");
+    task_free(t);
+}
+
+// STRIPE_COMMIT <id> -> OK <size> once every byte has been written
+static void session_stripe_commit(Session *s, char *args) {
+    unsigned long long id;
+    if (s->proto < 2 || sscanf(args, "%llx", &id) != 1) {
+        send_error(s->fd, "Usage: STRIPE_COMMIT <upload-id>");
+        return;
+    }
+    const char *err = NULL;
+    Upload *up = upload_stripe_take(s->user, (uint64_t)id, &err);
+    if (!up) { send_error(s->fd, err); return; }
+    Task *t = task_new(TASK_UPLOAD, s->user, up->name);
+    if (!t) { upload_finish(up, 0); send_error(s->fd, "OOM"); return; }
+    memcpy(t->tmp_path, up->tmp_path, sizeof(t->tmp_path));
+    t->fd = up->fd;
+    t->filesize = up->size;
+    t->reserved = up->reserved;
+    t->upload = up;
+    session_await(s, t, session_upload_done);
+}
+
+static void session_write_payload(Session *s, const char *data, size_t len) {
+    off_t off = s->up->received;
+    s->up->received += len;
+    s->up->crc = crc32c(s->up->crc, data, len);
+    while (len > 0 && !s->up_write_failed) {
+        ssize_t w = storage->pwrite(s->up->fd, data, len, off);
+        if (w <= 0) { s->up_write_failed = 1; break; }
+        data += w; len -= w; off += w;
+    }
+}
+
+// Called once the whole body is on disk: hands the commit to a worker.
+static void session_upload_committed(Task *t) {
+    Session *s = t->session;
+    upload_finish(t->upload, t->status == 0);
+    char line[300], crc[10];
+    if (t->status == 0) snprintf(line, sizeof(line), "OK %zu%s", t->filesize, crc_word(t, crc));
+    else snprintf(line, sizeof(line), "ERR %s", t->errmsg[0] ? t->errmsg : "UPLOAD failed");
+    session_send_tagged(s, t->tag, line, NULL, 0);
+    metrics_record(OP_UPLOAD, now_ns() - t->started_ns);
+    task_free(t);
+    session_task_done(s);
+}
+
+static void session_finish_upload(Session *s) {
+    int client_fd = s->fd;
+    Upload *up = s->up;
+    char tag[sizeof(s->up_tag)];
+    memcpy(tag, s->up_tag, sizeof(tag));
+    s->up_tag[0] = '\0';
+    s->up = NULL;
+    s->state = SESS_COMMAND;
+
+    if (s->up_write_failed) {
+        upload_finish(up, 0);
+        session_error(s, tag, "Write failed");
+        return;
+    }
+    if (s->up_legacy && up->received == 0) {
+        upload_finish(up, 0);
+        send_error(client_fd, "No data received");
+        return;
+    }
+
+    // Create and process the upload task
+    Task *t = task_new(TASK_UPLOAD, s->user, up->name);
+    if (!t) { upload_finish(up, 0); session_error(s, tag, "OOM"); return; }
+    memcpy(t->tmp_path, up->tmp_path, sizeof(t->tmp_path));
+    t->fd = up->fd;
+    t->filesize = up->received;
+    t->reserved = up->reserved;
+    t->crc = up->crc;
+    t->has_crc = 1;
+
+    t->upload = up;
+    if (tag[0]) {
+        // Pipelined: the worker replies while we read the next command
+        session_dispatch(s, t, tag, session_upload_committed);
+        return;
+    }
+    session_await(s, t, session_upload_done);
+}
+
+// A compressed body that cannot be decoded also cannot be skipped
+static int session_lz_broken(Session *s) {
+    session_error(s, s->up_tag, "Malformed compressed data");
+    if (s->up) upload_finish(s->up, 0);
+    s->up = NULL;
+    s->up_tag[0] = '\0';
+    return STEP_CLOSE;
+}
+
+// Compressed body: each frame is collected in lz_buf, decoded into the
+// block area behind it and written like a plain body. Refused pipelined
+// uploads (no up) are skipped frame by frame.
+static int session_recv_lz(Session *s) {
+    unsigned char *frame = s->lz_buf;
+    size_t left = s->up ? s->up->size - s->up->received : s->drain_left;
+    if (left == 0 && s->lz_have == 0) {
+        s->up_lz = 0;
+        if (s->up) session_finish_upload(s);
+        else s->state = SESS_COMMAND;
+        return STEP_MORE;
+    }
+    size_t want = s->lz_have < LZ_FRAME_HDR ? LZ_FRAME_HDR - s->lz_have : LZ_FRAME_HDR + get_u32(frame + 4) - s->lz_have;
+    ssize_t r = session_recv(s, frame + s->lz_have, want);
+    if (r == 0) return STEP_CLOSE;
+    if (r < 0) {
+        if (errno == EINTR) return STEP_MORE;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WANT_READ;
+        return STEP_CLOSE;
+    }
+    s->lz_have += r;
+    if (s->lz_have < LZ_FRAME_HDR) return STEP_MORE;
+    uint32_t raw = get_u32(frame), wire = get_u32(frame + 4);
+    if (raw == 0 || raw > LZ_BLOCK_MAX || raw > left || wire == 0 || wire > raw) return session_lz_broken(s);
+    if (s->lz_have < LZ_FRAME_HDR + wire) return STEP_MORE;
+
+    s->lz_have = 0;
+    if (!s->up) { s->drain_left -= raw; return STEP_MORE; }
+    const unsigned char *data = frame + LZ_FRAME_HDR;
+    if (wire < raw) {
+        unsigned char *block = frame + LZ_FRAME_HDR + LZ_BLOCK_MAX;
+        if (lz_decompress(data, wire, block, raw) != 0) return session_lz_broken(s);
+        data = block;
+    }
+    session_write_payload(s, (const char *)data, raw);
+    return STEP_MORE;
+}
+
+static int session_recv_payload(Session *s) {
+    char file_buf[RECV_CHUNK];
+
+    if (s->up_lz) return session_recv_lz(s);
+    if (s->up_stripe) return session_recv_stripe(s);
+
+    if (!s->up) {
+        // Reading past the body of a refused pipelined upload
+        if (s->drain_left == 0) { s->state = SESS_COMMAND; return STEP_MORE; }
+        size_t want = s->drain_left < sizeof(file_buf) ? s->drain_left : sizeof(file_buf);
+        ssize_t r = session_recv(s, file_buf, want);
+        if (r == 0) return STEP_CLOSE;
+        if (r < 0) {
+            if (errno == EINTR) return STEP_MORE;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WANT_READ;
+            return STEP_CLOSE;
+        }
+        s->drain_left -= r;
+        return STEP_MORE;
     }
-    pthread_mutex_unlock(&u->ulock);
-    pthread_mutex_unlock(&users_mutex);
 
-    char dest[1024];
-    snprintf(dest, sizeof(dest), "%s/%s/%s", STORAGE_DIR, t->username, t->filename);
-    if (rename(t->tmp_path, dest) != 0) {
-        safe_copy_file(t->tmp_path, dest);
-        unlink(t->tmp_path);
+    if (!s->up_legacy) {
+        size_t left = s->up->size - s->up->received;
+        if (left == 0) { session_finish_upload(s); return STEP_MORE; }
+        size_t want = left < sizeof(file_buf) ? left : sizeof(file_buf);
+        ssize_t r = session_recv(s, file_buf, want);
+        if (r == 0) return STEP_CLOSE;
+        if (r < 0) {
+            if (errno == EINTR) return STEP_MORE;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WANT_READ;
+            return STEP_CLOSE;
+        }
+        // Disk errors keep draining so the stream stays framed
+        session_write_payload(s, file_buf, r);
+        return STEP_MORE;
     }
-    user_add_file(t->username, t->filename, t->filesize);
-    t->status = 0;
-    t->result_buf = strdup("OK\n"); t->result_size = strlen(t->result_buf);
+
+    // Legacy (protocol 1) body: raw bytes terminated by an "EOF" marker.
+    // It is scanned in the input buffer so whatever was pipelined after the
+    // marker stays there for the next command; the last 2 bytes are held
+    // back in case the marker is split across reads.
+    char *start = s->in + s->in_off;
+    size_t have = s->in_len - s->in_off;
+    char *eof = memmem(start, have, "EOF", 3);
+    if (eof) {
+        session_write_payload(s, start, eof - start);
+        s->in_off += eof - start + 3;
+        session_finish_upload(s);
+        return STEP_MORE;
+    }
+    if (have > 2) {
+        session_write_payload(s, start, have - 2);
+        s->in_off += have - 2;
+    }
+    ssize_t bytes = session_fill(s);
+    if (bytes < 0 && errno == EINTR) return STEP_MORE;
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return STEP_WANT_READ;
+    if (bytes <= 0) {
+        // No marker is coming: the held back bytes are body too
+        session_write_payload(s, s->in + s->in_off, s->in_len - s->in_off);
+        s->in_off = s->in_len;
+        session_finish_upload(s);
+    }
+    return STEP_MORE;
 }
 
-void handle_download(Task *t) {
-    char path[1024];
-    snprintf(path, sizeof(path), "%s/%s/%s", STORAGE_DIR, t->username, t->filename);
-    int in = open(path, O_RDONLY);
-    if (in < 0) { t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "File not found"); return; }
-    struct stat st; if (fstat(in, &st) != 0) { close(in); t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "fstat failed"); return; }
-    size_t sz = st.st_size;
-    char *buf = malloc(sz);
-    if (!buf) { close(in); t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "OOM"); return; }
-    size_t off = 0;
-    while (off < sz) {
-        ssize_t r = read(in, buf+off, sz-off);
-        if (r <= 0) break;
-        off += r;
+// The signatures of the current version are ready: send them and take the delta
+static void session_delta_signed(Session *s, Task *t) {
+    int client_fd = s->fd;
+    Upload *up = t->upload;
+    if (t->status != 0) {
+        reader_close(t->reader);
+        upload_finish(up, 0);
+        send_error(client_fd, t->errmsg);
+        task_free(t);
+        return;
     }
-    close(in);
-    if (off != sz) { free(buf); t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "Partial read"); return; }
-    t->status = 0;
-    t->result_buf = buf; t->result_size = sz;
+
+    s->up = up;
+    s->up_legacy = 0;
+    s->up_write_failed = 0;
+    s->delta_base = t->reader;
+    s->delta_bs = delta_block_size(t->reader ? t->reader->size : 0);
+    s->delta_blocks = (uint32_t)(t->result_size / DELTA_SIG_SIZE);
+    s->delta_op_len = 0;
+    s->delta_lit_left = 0;
+    s->delta_err = NULL;
+    s->state = SESS_DELTA;
+
+    char reply[128];
+    snprintf(reply, sizeof(reply), "SIGS %zu %u %zu\n", s->delta_bs, s->delta_blocks,
+             t->reader ? t->reader->size : (size_t)0);
+    struct iovec iov[2] = { { reply, strlen(reply) }, { t->result_buf, t->result_size } };
+    sendv_all(client_fd, iov, 2);
+    task_free(t);
 }
 
-void handle_delete(Task *t) {
-    printf("DEBUG: Handling delete for user '%s', file '%s'\n", t->username, t->filename);
-   
-    char path[1024];
-    snprintf(path, sizeof(path), "%s/%s/%s", STORAGE_DIR, t->username, t->filename);
-   
-    printf("DEBUG: Attempting to delete file: %s\n", path);
-   
-    // Check if file exists first
-    if (access(path, F_OK) != 0) {
-        // Safe string copying
-        strncpy(t->errmsg, "File not found", sizeof(t->errmsg) - 1);
-        t->errmsg[sizeof(t->errmsg) - 1] = '\0';
-        t->status = -1;
-        printf("DEBUG: File does not exist\n");
+// DELTA_UPLOAD <name> <size>: like UPLOAD, but the client first gets the
+// block signatures of the current version and then only sends the bytes
+// the server does not have (see dropbox_proto.h for the wire format)
+static void session_start_delta(Session *s, char *args) {
+    int client_fd = s->fd;
+    char fname[MAX_FILENAME];
+    unsigned long long declared = 0;
+    if (s->proto < 2 || sscanf(args, "%255s %llu", fname, &declared) != 2) {
+        send_error(client_fd, "Usage: DELTA_UPLOAD <filename> <size>");
         return;
     }
-   
-    if (unlink(path) != 0) {
-        // Safe string copying
-        strncpy(t->errmsg, strerror(errno), sizeof(t->errmsg) - 1);
-        t->errmsg[sizeof(t->errmsg) - 1] = '\0';
-        t->status = -1;
-        printf("DEBUG: unlink failed: %s\n", strerror(errno));
+    if (!valid_filename(fname)) {
+        send_error(client_fd, "Invalid filename");
         return;
     }
-   
-    size_t removed = 0;
-    int remove_result = user_remove_file(t->username, t->filename, &removed);
-    printf("DEBUG: user_remove_file returned: %d, removed size: %zu\n", remove_result, removed);
-   
-    t->status = 0;
-    t->result_buf = strdup("OK\n");
-    t->result_size = strlen(t->result_buf);
-    printf("DEBUG: Delete completed successfully\n");
+    const char *err = NULL;
+    Upload *up = upload_new(s->user, fname, (size_t)declared, 0, &err);
+    if (!up) {
+        send_error(client_fd, err);
+        return;
+    }
+
+    Task *t = task_new(TASK_SIGNATURES, s->user, fname);
+    if (!t) { upload_finish(up, 0); send_error(client_fd, "OOM"); return; }
+    t->upload = up;
+    session_await(s, t, session_delta_signed);
 }
 
-void handle_list(Task *t) {
-    char *list = user_list_files(t->username);
-    if (!list) { t->status = -1; snprintf(t->errmsg, sizeof(t->errmsg), "user not found"); return; }
-    t->status = 0; t->result_buf = list; t->result_size = strlen(list);
+// Bytes that would overrun the declared size are dropped; the stream is
+// still read to its end so the connection stays usable
+static void session_delta_write(Session *s, const char *data, size_t len) {
+    if (s->up->received + len > s->up->size) {
+        if (!s->delta_err) s->delta_err = "Delta larger than declared size";
+        return;
+    }
+    session_write_payload(s, data, len);
 }
 
-void *worker_thread(void *arg) {
-    (void)arg;
-    while (running) {
-        Task *t = pop_task();
-        if (!t) continue;
-        if (t->type == TASK_UPLOAD) handle_upload(t);
-        else if (t->type == TASK_DOWNLOAD) handle_download(t);
-        else if (t->type == TASK_DELETE) handle_delete(t);
-        else if (t->type == TASK_LIST) handle_list(t);
+static void session_delta_copy(Session *s, uint32_t index) {
+    if (index >= s->delta_blocks) {
+        if (!s->delta_err) s->delta_err = "Bad block reference";
+        return;
+    }
+    char block[DELTA_MAX_BLOCK];
+    if (reader_read_full(s->delta_base, block, s->delta_bs, (off_t)index * s->delta_bs) != (ssize_t)s->delta_bs) {
+        s->up_write_failed = 1;
+        return;
+    }
+    session_delta_write(s, block, s->delta_bs);
+}
 
-        pthread_mutex_lock(&t->mutex);
-        pthread_cond_signal(&t->cond);
-        pthread_mutex_unlock(&t->mutex);
+static void session_finish_delta(Session *s) {
+    reader_close(s->delta_base);
+    s->delta_base = NULL;
+    if (!s->delta_err && s->up->received != s->up->size) s->delta_err = "Delta does not match declared size";
+    if (s->delta_err) {
+        upload_finish(s->up, 0);
+        s->up = NULL;
+        s->state = SESS_COMMAND;
+        send_error(s->fd, s->delta_err);
+        return;
     }
-    return NULL;
+    session_finish_upload(s);
 }
 
-void send_error(int client_fd, const char *msg) {
-    char buf[512];
-    snprintf(buf, sizeof(buf), "ERR %s\n", msg);
-    send_all(client_fd, buf, strlen(buf));
+static int session_recv_delta(Session *s) {
+    ssize_t r;
+    if (s->delta_lit_left == 0) {
+        // Op byte first, then its argument: END has none
+        size_t need = s->delta_op_len == 0 ? 1 : sizeof(s->delta_op);
+        r = session_recv(s, s->delta_op + s->delta_op_len, need - s->delta_op_len);
+    } else {
+        char buf[8192];
+        size_t want = s->delta_lit_left < sizeof(buf) ? s->delta_lit_left : sizeof(buf);
+        r = session_recv(s, buf, want);
+        if (r > 0) {
+            session_delta_write(s, buf, r);
+            s->delta_lit_left -= r;
+            return STEP_MORE;
+        }
+    }
+    if (r == 0) return STEP_CLOSE;
+    if (r < 0) {
+        if (errno == EINTR) return STEP_MORE;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WANT_READ;
+        return STEP_CLOSE;
+    }
+
+    s->delta_op_len += r;
+    if (s->delta_op[0] == DELTA_OP_END) {
+        s->delta_op_len = 0;
+        session_finish_delta(s);
+        return STEP_MORE;
+    }
+    if (s->delta_op_len < sizeof(s->delta_op)) return STEP_MORE;
+    s->delta_op_len = 0;
+    uint32_t arg = get_u32(s->delta_op + 1);
+    if (s->delta_op[0] == DELTA_OP_LITERAL) s->delta_lit_left = arg;
+    else if (s->delta_op[0] == DELTA_OP_COPY) session_delta_copy(s, arg);
+    else {
+        // Nothing after an unknown op can be framed
+        send_error(s->fd, "Bad delta instruction");
+        return STEP_CLOSE;
+    }
+    return STEP_MORE;
 }
 
-void send_ok(int client_fd) {
-    send_all(client_fd, "OK\n", 3);
+// The file is open: reply and start sending the body
+static void session_download_ready(Session *s, Task *t) {
+    int client_fd = s->fd;
+    int lz = s->dl_lz;
+    s->dl_lz = 0;
+    if (t->status != 0) {
+        send_error(client_fd, t->errmsg);
+        task_free(t);
+        return;
+    }
+
+    size_t total = t->result_size;
+    off_t offset = t->send_off;
+    if ((size_t)offset > total) {
+        reader_close(t->reader);
+        task_free(t);
+        send_error(client_fd, "Range not satisfiable");
+        return;
+    }
+    size_t len = total - (size_t)offset;
+    if (t->send_left < len) len = t->send_left;
+
+    // Compress only what a sample of the start suggests will shrink
+    if (lz) {
+        unsigned char sample[LZ_SAMPLE];
+        size_t n = len < sizeof(sample) ? len : sizeof(sample);
+        lz = reader_read_full(t->reader, sample, n, offset) == (ssize_t)n && lz_sample_compressible(sample, n);
+    }
+    s->dl_lz = session_want_lz(s, lz);
+
+    if (s->proto >= 2) {
+        // Length-prefixed reply, no trailing marker; ranges also report the
+        // full size, whole files their checksum for the client to verify.
+        // A trailing LZ means the body comes as frames.
+        char reply[96], crc[10];
+        if (s->dl_ranged) snprintf(reply, sizeof(reply), "OK %zu %zu%s\n", len, total, s->dl_lz ? " LZ" : "");
+        else snprintf(reply, sizeof(reply), "OK %zu%s%s\n", len, crc_word(t, crc), s->dl_lz ? " LZ" : "");
+        if (len > 0) send_header(client_fd, reply, strlen(reply));
+        else send_all(client_fd, reply, strlen(reply));
+    }
+    s->dl = t->reader;
+    s->dl_off = offset;
+    s->dl_left = len;
+    s->state = SESS_RESPONSE;
+    task_free(t);
 }
 
-void client_service(int client_fd) {
-    char buf[2048];
-    char current_user[USERNAME_MAX] = "";
-    int logged_in = 0;
+// DOWNLOAD <name> [<offset> [<len>]]: protocol 2 clients may ask for a byte
+// range, e.g. to finish an interrupted download or to fetch the tail of a
+// growing log. A missing length means up to the end of the file.
+static void session_start_download(Session *s, char *args) {
+    int client_fd = s->fd;
+    char fname[MAX_FILENAME];
+    unsigned long long offset = 0, length = 0;
+    int lz = s->proto >= 2 && take_lz_flag(args);
+    int nargs = sscanf(args, "%255s %llu %llu", fname, &offset, &length);
+    if (nargs < 1 || (s->proto < 2 && nargs > 1)) {
+        send_error(client_fd, s->proto >= 2 ? "Usage: DOWNLOAD <filename> [<offset> [<len>]] [LZ]" : "Usage: DOWNLOAD <filename>");
+        return;
+    }
+    if (!valid_filename(fname)) {
+        send_error(client_fd, "Invalid filename");
+        return;
+    }
 
-    while (1) {
-        ssize_t r = recv_line(client_fd, buf, sizeof(buf));
-        if (r <= 0) { close(client_fd); return; }
-        while (r>0 && (buf[r-1]=='\n' || buf[r-1]=='\r')) { buf[r-1]=0; r--; }
-        if (r==0) continue;
-
-        if (!logged_in) {
-            if (strncmp(buf, "SIGNUP ", 7) == 0) {
-                char user[USERNAME_MAX], pass[PASS_MAX];
-                if (sscanf(buf+7, "%63s %63s", user, pass) != 2) { send_error(client_fd, "Usage: SIGNUP <user> <pass>"); continue; }
-                if (user_create(user, pass) == 0) send_ok(client_fd); else send_error(client_fd, "User exists");
-                continue;
-            } else if (strncmp(buf, "LOGIN ", 6) == 0) {
-                char user[USERNAME_MAX], pass[PASS_MAX];
-                if (sscanf(buf+6, "%63s %63s", user, pass) != 2) { send_error(client_fd, "Usage: LOGIN <user> <pass>"); continue; }
-                if (user_check_password(user, pass) == 0) {
-                    strncpy(current_user, user, sizeof(current_user)-1);
-                    logged_in = 1;
-                    send_ok(client_fd);
-                } else {
-                    send_error(client_fd, "Invalid credentials");
-                }
-                continue;
-            } else {
-                send_error(client_fd, "Authenticate first with SIGNUP or LOGIN");
-                continue;
-            }
+    Task *t = task_new(TASK_DOWNLOAD, s->user, fname);
+    if (!t) { send_error(client_fd, "OOM"); return; }
+    t->send_off = (off_t)offset;
+    t->send_left = nargs == 3 ? (size_t)length : SIZE_MAX;
+    s->dl_ranged = nargs > 1;
+    s->dl_lz = lz;
+    session_await(s, t, session_download_ready);
+}
+
+// Sends the download as frames, building the next one once the previous
+// one is out. Blocks that do not shrink are sent stored, and after
+// LZ_GIVE_UP of those in a row the rest is not even tried.
+static int session_send_lz(Session *s) {
+    for (;;) {
+        if (s->lz_sent == s->lz_have) {
+            if (s->dl_left == 0) break;
+            size_t n = s->dl_left < LZ_BLOCK_MAX ? s->dl_left : LZ_BLOCK_MAX;
+            unsigned char *block = s->lz_buf + LZ_FRAME_HDR + LZ_BLOCK_MAX;
+            if (reader_read_full(s->dl, block, n, s->dl_off) != (ssize_t)n) return STEP_CLOSE;
+            s->lz_have = lz_frame(block, n, s->lz_buf, s->lz_misses < LZ_GIVE_UP);
+            s->lz_misses = s->lz_have == LZ_FRAME_HDR + n ? s->lz_misses + 1 : 0;
+            s->lz_sent = 0;
+            s->dl_off += n;
+            s->dl_left -= n;
         }
+        ssize_t w = send(s->fd, s->lz_buf + s->lz_sent, s->lz_have - s->lz_sent, 0);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return STEP_WANT_WRITE;
+        if (w <= 0) return STEP_CLOSE;
+        metrics_bytes_out(w);
+        s->lz_sent += w;
+    }
+    s->lz_have = s->lz_sent = 0;
+    s->dl_lz = 0;
+    reader_close(s->dl);
+    s->dl = NULL;
+    s->state = SESS_COMMAND;
+    return STEP_MORE;
+}
 
-        // Handle commands after login
-        if (strncmp(buf, "UPLOAD ", 7) == 0) {
-            char fname[MAX_FILENAME];
-            if (sscanf(buf+7, "%255s", fname) != 1) {
-                send_error(client_fd, "Usage: UPLOAD <filename>");
-                continue;
-            }
-           
-            // Create temp file for upload
-            ensure_dir(TMP_DIR);
-            char tmpfn[512];
-            snprintf(tmpfn, sizeof(tmpfn), "%s/%s_%ld.tmp", TMP_DIR, fname, (long)time(NULL));
-            int out = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (out < 0) {
-                send_error(client_fd, "Temp create failed");
-                continue;
-            }
-           
-            // Receive file data until EOF marker
-            char file_buf[8192];
-            size_t total_received = 0;
-            int eof_found = 0;
-           
-            while (!eof_found) {
-                ssize_t bytes = recv(client_fd, file_buf, sizeof(file_buf), 0);
-                if (bytes <= 0) break;
-               
-                // Check for EOF marker in the received data
-                if (bytes >= 3) {
-                    for (int i = 0; i <= bytes - 3; i++) {
-                        if (memcmp(file_buf + i, "EOF", 3) == 0) {
-                            // Write data before EOF marker
-                            if (i > 0) {
-                                write(out, file_buf, i);
-                                total_received += i;
-                            }
-                            eof_found = 1;
-                            break;
-                        }
-                    }
-                }
-               
-                if (!eof_found) {
-                    write(out, file_buf, bytes);
-                    total_received += bytes;
-                }
-            }
-            close(out);
-           
-            if (total_received == 0) {
-                send_error(client_fd, "No data received");
-                unlink(tmpfn);
-                continue;
-            }
-           
-            // Create and process the upload task
-            Task *t = calloc(1, sizeof(Task));
-            pthread_mutex_init(&t->mutex, NULL);
-            pthread_cond_init(&t->cond, NULL);
-            t->type = TASK_UPLOAD;
-            strncpy(t->username, current_user, sizeof(t->username)-1);
-            strncpy(t->filename, fname, sizeof(t->filename)-1);
-            strncpy(t->tmp_path, tmpfn, sizeof(t->tmp_path)-1);
-            t->filesize = total_received;
-            t->status = -1;
-
-            push_task(t);
-
-            pthread_mutex_lock(&t->mutex);
-            pthread_cond_wait(&t->cond, &t->mutex);
-            pthread_mutex_unlock(&t->mutex);
-
-            if (t->status == 0) send_ok(client_fd);
-            else send_error(client_fd, t->errmsg[0] ? t->errmsg : "UPLOAD failed");
-
-            if (t->result_buf) free(t->result_buf);
-            pthread_mutex_destroy(&t->mutex);
-            pthread_cond_destroy(&t->cond);
-            free(t);
-            continue;
+static int session_send_body(Session *s) {
+    if (s->dl_lz) return session_send_lz(s);
+    while (s->dl_left > 0) {
+        ssize_t n = reader_send_some(s->fd, s->dl, &s->dl_off, s->dl_left);
+        if (n == 0) return STEP_WANT_WRITE;
+        // A short send leaves the stream unframed, so drop the connection
+        if (n < 0) return STEP_CLOSE;
+        s->dl_left -= n;
+    }
+    reader_close(s->dl);
+    s->dl = NULL;
+    // Legacy clients look for the EOF marker after the data
+    if (s->proto < 2) send_all(s->fd, "EOF", 3);
+    s->state = SESS_COMMAND;
+    return STEP_MORE;
+}
+
+static void session_deleted(Session *s, Task *t) {
+    if (t->status == 0) send_ok(s->fd);
+    else send_error(s->fd, t->errmsg);
+    task_free(t);
+}
+
+static void session_delete(Session *s, char *args) {
+    int client_fd = s->fd;
+    char fname[MAX_FILENAME];
+    if (sscanf(args, "%255s", fname) != 1) {
+        send_error(client_fd, "Usage: DELETE <filename>");
+        return;
+    }
+    if (!valid_filename(fname)) {
+        send_error(client_fd, "Invalid filename");
+        return;
+    }
+
+    // Metadata commands (DELETE, LIST, STAT) only touch the in-memory index
+    // and at most a directory entry, so they run on the connection thread:
+    // a worker handoff would cost more than the work itself. Reactor
+    // threads must not wait for the disk, so there DELETE still goes to a
+    // worker.
+    Task *t = task_new(TASK_DELETE, s->user, fname);
+    if (!t) { send_error(client_fd, "OOM"); return; }
+    if (reactor_mode) { session_await(s, t, session_deleted); return; }
+    task_execute(t);
+    session_deleted(s, t);
+}
+
+static void session_list(Session *s) {
+    int client_fd = s->fd;
+    Task *t = task_new(TASK_LIST, s->user, NULL);
+    if (!t) { send_error(client_fd, "OOM"); return; }
+    task_execute(t);
+
+    if (t->status == 0) {
+        // The list and its END_OF_LIST marker go out as one write
+        struct iovec iov[2] = { { t->result_buf, t->result_size }, { "END_OF_LIST\n", 12 } };
+        sendv_all(client_fd, iov, 2);
+    } else {
+        send_error(client_fd, t->errmsg);
+    }
+    task_free(t);
+}
+
+// STAT <name>: metadata of one file, "OK <size>"
+static void session_stat(Session *s, char *args) {
+    char fname[MAX_FILENAME];
+    if (sscanf(args, "%255s", fname) != 1 || !valid_filename(fname)) {
+        send_error(s->fd, "Usage: STAT <filename>");
+        return;
+    }
+    Task *t = task_new(TASK_STAT, s->user, fname);
+    if (!t) { send_error(s->fd, "OOM"); return; }
+    task_execute(t);
+    if (t->status == 0) {
+        char reply[64], crc[10];
+        snprintf(reply, sizeof(reply), "OK %zu%s\n", t->filesize, crc_word(t, crc));
+        send_all(s->fd, reply, strlen(reply));
+    } else {
+        send_error(s->fd, t->errmsg);
+    }
+    task_free(t);
+}
+
+static enum MetricKind metric_kind(const char *cmd) {
+    static const struct { const char *prefix; enum MetricKind kind; } kinds[] = {
+        { "SIGNUP ", OP_SIGNUP }, { "LOGIN ", OP_LOGIN }, { "UPLOAD ", OP_UPLOAD }, { "RESUME ", OP_UPLOAD },
+        { "DOWNLOAD ", OP_DOWNLOAD }, { "DELTA_UPLOAD ", OP_DELTA }, { "DELETE ", OP_DELETE }, { "LIST", OP_LIST },
+        { "STAT ", OP_STAT }, { "MUPLOAD ", OP_MUPLOAD }, { "MDOWNLOAD ", OP_MDOWNLOAD }, { "STRIPE", OP_STRIPE } };
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        if (strncmp(cmd, kinds[i].prefix, strlen(kinds[i].prefix)) == 0) return kinds[i].kind;
+    }
+    return OP_OTHER;
+}
+
+// Text report for STATS and the dump file, one metric per line
+static char *stats_report(size_t *len) {
+    uint64_t count[METRIC_KINDS] = {0}, sum[METRIC_KINDS] = {0}, max[METRIC_KINDS] = {0};
+    uint64_t bytes_in = 0, bytes_out = 0;
+    uint64_t (*hist)[HIST_BUCKETS] = calloc(METRIC_KINDS, sizeof(*hist));
+    char *buf = NULL;
+    FILE *fp = hist ? open_memstream(&buf, len) : NULL;
+    if (!fp) { free(hist); return NULL; }
+
+    for (Metrics *m = __atomic_load_n(&metrics_all, __ATOMIC_ACQUIRE); m; m = m->next) {
+        for (int k = 0; k < METRIC_KINDS; k++) {
+            count[k] += __atomic_load_n(&m->count[k], __ATOMIC_RELAXED);
+            sum[k] += __atomic_load_n(&m->sum_ns[k], __ATOMIC_RELAXED);
+            uint64_t mx = __atomic_load_n(&m->max_ns[k], __ATOMIC_RELAXED);
+            if (mx > max[k]) max[k] = mx;
+            for (int i = 0; i < HIST_BUCKETS; i++) hist[k][i] += __atomic_load_n(&m->hist[k][i], __ATOMIC_RELAXED);
         }
-        else if (strncmp(buf, "DOWNLOAD ", 9) == 0) {
-            char fname[MAX_FILENAME];
-            if (sscanf(buf+9, "%255s", fname) != 1) {
-                send_error(client_fd, "Usage: DOWNLOAD <filename>");
-                continue;
-            }
-           
-            Task *t = calloc(1, sizeof(Task));
-            pthread_mutex_init(&t->mutex, NULL);
-            pthread_cond_init(&t->cond, NULL);
-            t->type = TASK_DOWNLOAD;
-            strncpy(t->username, current_user, sizeof(t->username)-1);
-            strncpy(t->filename, fname, sizeof(t->filename)-1);
-            t->status = -1;
-           
-            push_task(t);
-
-            pthread_mutex_lock(&t->mutex);
-            pthread_cond_wait(&t->cond, &t->mutex);
-            pthread_mutex_unlock(&t->mutex);
-
-            if (t->status != 0) {
-                send_error(client_fd, t->errmsg);
-                if (t->result_buf) free(t->result_buf);
-                pthread_mutex_destroy(&t->mutex);
-                pthread_cond_destroy(&t->cond);
-                free(t);
-                continue;
-            }
+        bytes_in += __atomic_load_n(&m->bytes_in, __ATOMIC_RELAXED);
+        bytes_out += __atomic_load_n(&m->bytes_out, __ATOMIC_RELAXED);
+    }
+
+    fprintf(fp, "uptime_seconds %ld\n", (long)(time(NULL) - metrics_started));
+    fprintf(fp, "bytes_in %llu\nbytes_out %llu\n", (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+    fprintf(fp, "clientq_depth %d\ntaskq_depth %zu\n", __atomic_load_n(&clientq.count, __ATOMIC_RELAXED), sched_queued());
+    pthread_mutex_lock(&cache.lock);
+    fprintf(fp, "cache hits=%llu misses=%llu evictions=%llu entries=%zu bytes=%zu\n",
+            (unsigned long long)cache.hits, (unsigned long long)cache.misses, (unsigned long long)cache.evictions,
+            cache.count, cache.used);
+    pthread_mutex_unlock(&cache.lock);
+    for (int k = 0; k < METRIC_KINDS; k++) {
+        uint64_t total = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) total += hist[k][i];
+        if (!total) continue;
+        fprintf(fp, "%s count=%llu mean_us=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+                metric_names[k], (unsigned long long)count[k], count[k] ? sum[k] / 1000.0 / count[k] : 0.0,
+                hist_percentile(hist[k], total, 0.5, max[k]) / 1000.0, hist_percentile(hist[k], total, 0.99, max[k]) / 1000.0,
+                hist_percentile(hist[k], total, 0.999, max[k]) / 1000.0, max[k] / 1000.0);
+    }
+    free(hist);
 
-            // Send file data
-            if (t->result_size > 0) {
-                send_all(client_fd, t->result_buf, t->result_size);
+    for (int i = 0; i < USER_SHARDS; i++) {
+        UserShard *sh = &user_shards[i];
+        pthread_rwlock_rdlock(&sh->lock);
+        for (size_t b = 0; b < sh->nbuckets; b++) {
+            for (User *u = sh->buckets[b]; u; u = u->next) {
+                int active = __atomic_load_n(&u->transfers, __ATOMIC_RELAXED);
+                if (active > 0) fprintf(fp, "transfers user=%s active=%d\n", u->username, active);
             }
-            // Send EOF marker
-            send_all(client_fd, "EOF", 3);
+        }
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    fclose(fp);
+    return buf;
+}
 
-            if (t->result_buf) free(t->result_buf);
-            pthread_mutex_destroy(&t->mutex);
-            pthread_cond_destroy(&t->cond);
-            free(t);
-            continue;
+// STATS -> OK <len> and the report; only for connections from the server host
+static void session_stats(Session *s) {
+    if (!s->admin) { send_error(s->fd, "STATS is only available on the server host"); return; }
+    size_t len = 0;
+    char *report = stats_report(&len);
+    if (!report) { send_error(s->fd, "OOM"); return; }
+    char reply[64];
+    snprintf(reply, sizeof(reply), "OK %zu\n", len);
+    struct iovec iov[2] = { { reply, strlen(reply) }, { report, len } };
+    sendv_all(s->fd, iov, 2);
+    free(report);
+}
+
+// --stats-file: the STATS report rewritten every STATS_DUMP_INTERVAL seconds
+static void *stats_dump_thread(void *arg) {
+    const char *path = arg;
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    while (running) {
+        sleep(STATS_DUMP_INTERVAL);
+        size_t len = 0;
+        char *report = stats_report(&len);
+        if (!report) continue;
+        FILE *fp = fopen(tmp, "w");
+        int ok = fp && fwrite(report, 1, len, fp) == len;
+        if (fp && fclose(fp) != 0) ok = 0;
+        if (!ok || rename(tmp, path) != 0) perror("stats dump");
+        free(report);
+    }
+    return NULL;
+}
+
+static void session_cache_stats(Session *s) {
+    char reply[256];
+    pthread_mutex_lock(&cache.lock);
+    snprintf(reply, sizeof(reply), "OK hits=%llu misses=%llu evictions=%llu invalidations=%llu entries=%zu bytes=%zu budget=%zu\n",
+             (unsigned long long)cache.hits, (unsigned long long)cache.misses, (unsigned long long)cache.evictions,
+             (unsigned long long)cache.invalidations, cache.count, cache.used, cache.budget);
+    pthread_mutex_unlock(&cache.lock);
+    send_all(s->fd, reply, strlen(reply));
+}
+
+// Pipelined requests: "#<tag> <command>" is answered by "#<tag> <reply>"
+// as soon as it completes, so replies may come back in any order. Tagged
+// uploads send their body right after the command, without waiting for
+// READY. A tagged download answers "#<tag> OK <len> <total>" and then
+// sends the data as "#<tag> DATA <n>" frames, between which frames of other
+// replies may be interleaved. A LIST reply carries its text as
+// "#<tag> OK <bytes>". DELETE, LIST and STAT run inline and are answered
+// before the next command is read. Untagged commands wait for all tagged
+// ones first.
+static void session_tagged_upload(Session *s, const char *tag, char *args) {
+    char fname[MAX_FILENAME];
+    unsigned long long declared = 0;
+    // A compressed pipelined body follows unconfirmed, so the frame buffer is a must
+    int lz = take_lz_flag(args);
+    if (sscanf(args, "%255s %llu", fname, &declared) != 2) {
+        session_error(s, tag, "Usage: #<tag> UPLOAD <filename> <size> [LZ]");
+        return;
+    }
+    s->up_lz = session_want_lz(s, lz);
+    if (lz && !s->up_lz) {
+        session_error(s, tag, "OOM");
+        s->state = SESS_CLOSED;
+        return;
+    }
+    const char *err = NULL;
+    if (!valid_filename(fname)) err = "Invalid filename";
+    else s->up = upload_new(s->user, fname, (size_t)declared, 0, &err);
+    if (err) {
+        // The body is already on its way
+        session_error(s, tag, err);
+        s->drain_left = (size_t)declared;
+        s->state = SESS_PAYLOAD;
+        return;
+    }
+    snprintf(s->up_tag, sizeof(s->up_tag), "%s", tag);
+    s->up_legacy = 0;
+    s->up_write_failed = 0;
+    s->state = SESS_PAYLOAD;
+}
+
+// One DATA frame of n bytes, straight from the file while the socket takes
+// it; the rest of the frame goes to the backlog (send_lock held)
+static int session_send_frame(Session *s, Task *t, size_t n) {
+    char head[64];
+    snprintf(head, sizeof(head), "#%s DATA %zu\n", t->tag, n);
+    if (session_tx_write(s, head, strlen(head), MSG_MORE) != 0) return -1;
+    while (session_tx_idle(s) && n > 0) {
+        ssize_t w = reader_send_some(s->fd, t->reader, &t->send_off, n);
+        if (w < 0) return -1;
+        if (w == 0) break;
+        n -= w;
+    }
+    if (n == 0) return 0;
+    if (session_tx_reserve(s, n) != 0 || reader_read_full(t->reader, s->tx_buf + s->tx_len, n, t->send_off) != (ssize_t)n) return -1;
+    t->send_off += n;
+    return session_tx_queued(s, n);
+}
+
+// Sends the next frame of a tagged download, then requeues the task so
+// that one large download does not hold a worker or the socket. Behind a
+// backlog the task waits for tx_thread to requeue it instead.
+static void session_download_frame(Task *t) {
+    Session *s = t->session;
+    size_t n = t->send_left < TAGGED_FRAME_MAX ? t->send_left : TAGGED_FRAME_MAX;
+    if (n > 0) {
+        pthread_mutex_lock(&s->send_lock);
+        if (!s->send_failed && !session_tx_idle(s)) {
+            t->next = s->tx_waiters;
+            s->tx_waiters = t;
+            pthread_mutex_unlock(&s->send_lock);
+            return;
         }
-        else if (strncmp(buf, "DELETE ", 7) == 0) {
-            char fname[MAX_FILENAME];
-            if (sscanf(buf+7, "%255s", fname) != 1) {
-                send_error(client_fd, "Usage: DELETE <filename>");
-                continue;
-            }
-           
-            printf("DEBUG: User '%s' deleting file '%s'\n", current_user, fname); // Debug line
-           
-            Task *t = calloc(1, sizeof(Task));
-            pthread_mutex_init(&t->mutex, NULL);
-            pthread_cond_init(&t->cond, NULL);
-            t->type = TASK_DELETE;
-            strncpy(t->username, current_user, sizeof(t->username)-1);
-            strncpy(t->filename, fname, sizeof(t->filename)-1);
-            t->status = -1;
-           
-            push_task(t);
-            pthread_mutex_lock(&t->mutex);
-            pthread_cond_wait(&t->cond, &t->mutex);
-            pthread_mutex_unlock(&t->mutex);
-           
-            if (t->status == 0) {
-                printf("DEBUG: Delete task completed successfully\n"); // Debug line
-                send_ok(client_fd);
-            } else {
-                printf("DEBUG: Delete task failed: %s\n", t->errmsg); // Debug line
-                send_error(client_fd, t->errmsg);
-            }
-           
-            if (t->result_buf) free(t->result_buf);
-            pthread_mutex_destroy(&t->mutex);
-            pthread_cond_destroy(&t->cond);
-            free(t);
-            continue;
+        if (!s->send_failed && session_send_frame(s, t, n) != 0) session_tx_fail(s);
+        int failed = s->send_failed;
+        t->send_left -= n;
+        int wait = !failed && t->send_left > 0 && !session_tx_idle(s);
+        if (wait) {
+            t->next = s->tx_waiters;
+            s->tx_waiters = t;
         }
-        else if (strcmp(buf, "LIST") == 0) {
-            Task *t = calloc(1, sizeof(Task));
-            pthread_mutex_init(&t->mutex, NULL);
-            pthread_cond_init(&t->cond, NULL);
-            t->type = TASK_LIST;
-            strncpy(t->username, current_user, sizeof(t->username)-1);
-            t->status = -1;
-           
-            push_task(t);
-            pthread_mutex_lock(&t->mutex);
-            pthread_cond_wait(&t->cond, &t->mutex);
-            pthread_mutex_unlock(&t->mutex);
-           
-            if (t->status == 0) {
-                // Send the list data
-                send_all(client_fd, t->result_buf, t->result_size);
-                // Send END_OF_LIST marker on a new line
-                send_all(client_fd, "END_OF_LIST\n", 12);
-            } else {
-                send_error(client_fd, t->errmsg);
-            }
-           
-            if (t->result_buf) free(t->result_buf);
-            pthread_mutex_destroy(&t->mutex);
-            pthread_cond_destroy(&t->cond);
-            free(t);
-            continue;
+        pthread_mutex_unlock(&s->send_lock);
+        if (wait) return;
+        if (!failed && t->send_left > 0) { push_task(t); return; }
+    }
+    reader_close(t->reader);
+    metrics_record(OP_DOWNLOAD, now_ns() - t->started_ns);
+    task_free(t);
+    session_task_done(s);
+}
+
+static void session_download_opened(Task *t) {
+    Session *s = t->session;
+    size_t total = t->result_size;
+    const char *err = t->status != 0 ? t->errmsg : (size_t)t->send_off > total ? "Range not satisfiable" : NULL;
+    if (err) {
+        session_error(s, t->tag, err);
+        reader_close(t->reader);
+        metrics_record(OP_DOWNLOAD, now_ns() - t->started_ns);
+        task_free(t);
+        session_task_done(s);
+        return;
+    }
+    if (t->send_left > total - (size_t)t->send_off) t->send_left = total - (size_t)t->send_off;
+    char line[96];
+    snprintf(line, sizeof(line), "OK %zu %zu", t->send_left, total);
+    session_send_tagged(s, t->tag, line, NULL, 0);
+    t->type = TASK_SEND;
+    t->complete = session_download_frame;
+    session_download_frame(t);
+}
+
+static void session_tagged_download(Session *s, const char *tag, char *args) {
+    char fname[MAX_FILENAME];
+    unsigned long long offset = 0, length = 0;
+    // DATA frames are always raw; leaving LZ out of the reply declines it
+    take_lz_flag(args);
+    int nargs = sscanf(args, "%255s %llu %llu", fname, &offset, &length);
+    if (nargs < 1) {
+        session_error(s, tag, "Usage: #<tag> DOWNLOAD <filename> [<offset> [<len>]] [LZ]");
+        return;
+    }
+    if (!valid_filename(fname)) {
+        session_error(s, tag, "Invalid filename");
+        return;
+    }
+    Task *t = task_new(TASK_DOWNLOAD, s->user, fname);
+    if (!t) { session_error(s, tag, "OOM"); return; }
+    t->send_off = (off_t)offset;
+    t->send_left = nargs == 3 ? (size_t)length : SIZE_MAX;
+    session_dispatch(s, t, tag, session_download_opened);
+}
+
+// MUPLOAD <count>: count "<name> <size> [LZ]" lines follow, each with its
+// body, without waiting for replies. Each file is handled as the tagged
+// upload "#<index>", so its status comes back as "#<index> OK <size>" or
+// "#<index> ERR ..."; "OK <count>" follows once all of them are done.
+static void session_start_batch_upload(Session *s, char *args) {
+    int count;
+    if (s->proto < 2 || sscanf(args, "%d", &count) != 1 || count < 0 || count > BATCH_MAX_FILES) {
+        send_error(s->fd, "Usage: MUPLOAD <count>");
+        return;
+    }
+    s->batch_open = 1;
+    s->batch_count = s->batch_left = count;
+}
+
+static void session_batch_upload_file(Session *s, char *buf) {
+    char tag[16];
+    snprintf(tag, sizeof(tag), "%d", s->batch_count - s->batch_left);
+    s->batch_left--;
+    session_tagged_upload(s, tag, buf);
+}
+
+// Runs once the last body is in, before the next command is read
+static void session_finish_batch(Session *s, Task *unused) {
+    (void)unused;
+    char reply[32];
+    if (!session_await_inflight(s, 0, session_finish_batch)) return;
+    snprintf(reply, sizeof(reply), "OK %d\n", s->batch_count);
+    s->batch_open = 0;
+    send_all(s->fd, reply, strlen(reply));
+}
+
+// Dispatches the MDOWNLOAD files as far as the in-flight limit allows,
+// parking in between, and sends "OK <count>" once all are done
+static void session_batch_download_next(Session *s, Task *unused) {
+    (void)unused;
+    char *nl;
+    while (s->mdl_next && (nl = strchr(s->mdl_next, '\n')) != NULL) {
+        if (!session_await_inflight(s, SESSION_MAX_INFLIGHT - 1, session_batch_download_next)) return;
+        *nl = '\0';
+        char tag[24];
+        snprintf(tag, sizeof(tag), "%zu", s->mdl_index++);
+        Task *t = task_new(TASK_DOWNLOAD, s->user, s->mdl_next);
+        s->mdl_next = nl + 1;
+        if (!t) { session_error(s, tag, "OOM"); continue; }
+        t->send_off = 0;
+        t->send_left = SIZE_MAX;
+        session_dispatch(s, t, tag, session_download_opened);
+    }
+    free(s->mdl_names);
+    s->mdl_names = s->mdl_next = NULL;
+    if (!session_await_inflight(s, 0, session_batch_download_next)) return;
+    char line[64];
+    snprintf(line, sizeof(line), "OK %zu", s->mdl_count);
+    session_send_tagged(s, "", line, NULL, 0);
+}
+
+// MDOWNLOAD <pattern>...: every stored file matching one of the fnmatch
+// patterns. The reply is "FILES <count>" and the names, one per line; file
+// <index> then arrives as the tagged download "#<index>" and "OK <count>"
+// follows the last one.
+static void session_batch_download(Session *s, char *args) {
+    char *patterns[64];
+    int npatterns = 0;
+    char *save;
+    for (char *p = strtok_r(args, " ", &save); p && npatterns < 64; p = strtok_r(NULL, " ", &save)) patterns[npatterns++] = p;
+    if (s->proto < 2 || npatterns == 0) {
+        send_error(s->fd, "Usage: MDOWNLOAD <pattern>...");
+        return;
+    }
+    char *names = user_match_files(s->user, patterns, npatterns, &s->mdl_count);
+    if (!names) { send_error(s->fd, "OOM"); return; }
+    char line[64];
+    snprintf(line, sizeof(line), "FILES %zu", s->mdl_count);
+    session_send_tagged(s, "", line, names, strlen(names));
+    s->mdl_names = s->mdl_next = names;
+    s->mdl_index = 0;
+    session_batch_download_next(s, NULL);
+}
+
+// Reply to a tagged DELETE, LIST or STAT once it has run
+static void session_metadata_reply(Session *s, Task *t) {
+    char line[64];
+    if (t->status != 0) {
+        session_error(s, t->tag, t->errmsg);
+    } else if (t->type == TASK_LIST) {
+        snprintf(line, sizeof(line), "OK %zu", t->result_size);
+        session_send_tagged(s, t->tag, line, t->result_buf, t->result_size);
+    } else if (t->type == TASK_STAT) {
+        char crc[10];
+        snprintf(line, sizeof(line), "OK %zu%s", t->filesize, crc_word(t, crc));
+        session_send_tagged(s, t->tag, line, NULL, 0);
+    } else {
+        session_send_tagged(s, t->tag, "OK", NULL, 0);
+    }
+    metrics_record(t->type == TASK_LIST ? OP_LIST : t->type == TASK_STAT ? OP_STAT : OP_DELETE, now_ns() - t->started_ns);
+    task_free(t);
+}
+
+// Tagged DELETE, LIST or STAT, run inline like their untagged forms
+static void session_tagged_metadata(Session *s, const char *tag, enum TaskType type, const char *args) {
+    char fname[MAX_FILENAME] = "";
+    if (type != TASK_LIST && (sscanf(args, "%255s", fname) != 1 || !valid_filename(fname))) {
+        session_error(s, tag, "Invalid filename");
+        return;
+    }
+    Task *t = task_new(type, s->user, type == TASK_LIST ? NULL : fname);
+    if (!t) { session_error(s, tag, "OOM"); return; }
+    t->started_ns = s->line_at;
+    snprintf(t->tag, sizeof(t->tag), "%s", tag);
+    // Still answered before the next command, see session_delete
+    if (reactor_mode && type == TASK_DELETE) { session_await(s, t, session_metadata_reply); return; }
+    task_execute(t);
+    session_metadata_reply(s, t);
+}
+
+static void session_tagged_command(Session *s, char *buf) {
+    char *cmd = strchr(buf, ' ');
+    size_t tag_len = cmd ? (size_t)(cmd - buf) : strlen(buf);
+    if (!cmd || tag_len == 0 || tag_len >= sizeof(s->up_tag)) {
+        session_error(s, "", "Usage: #<tag> <command>");
+        return;
+    }
+    *cmd++ = '\0';
+    const char *tag = buf;
+
+    if (strncmp(cmd, "UPLOAD ", 7) == 0) session_tagged_upload(s, tag, cmd+7);
+    else if (strncmp(cmd, "DOWNLOAD ", 9) == 0) session_tagged_download(s, tag, cmd+9);
+    else if (strncmp(cmd, "DELETE ", 7) == 0) session_tagged_metadata(s, tag, TASK_DELETE, cmd+7);
+    else if (strncmp(cmd, "STAT ", 5) == 0) session_tagged_metadata(s, tag, TASK_STAT, cmd+5);
+    else if (strcmp(cmd, "LIST") == 0) session_tagged_metadata(s, tag, TASK_LIST, "");
+    else session_error(s, tag, "Command cannot be tagged");
+}
+
+static void session_command(Session *s, char *buf) {
+    // Protocol negotiation is allowed at any point of the session
+    if (strncmp(buf, "PROTO ", 6) == 0) {
+        int want = atoi(buf+6);
+        if (want < 1) { send_error(s->fd, "Usage: PROTO <version>"); return; }
+        s->proto = want < PROTO_VERSION ? want : PROTO_VERSION;
+        char reply[64];
+        snprintf(reply, sizeof(reply), "OK PROTO %d\n", s->proto);
+        send_all(s->fd, reply, strlen(reply));
+        return;
+    }
+
+    if (strcmp(buf, "STATS") == 0) { session_stats(s); return; }
+
+    if (s->state == SESS_AUTH) { session_auth_command(s, buf); return; }
+    int tagged = s->batch_left > 0 || (buf[0] == '#' && s->proto >= 2);
+    // Tagged commands wait for room, untagged ones keep their strict
+    // request/reply order. Either way the line is run again once s wakes.
+    if (!session_await_inflight(s, tagged ? SESSION_MAX_INFLIGHT - 1 : 0, NULL)) return;
+    if (s->batch_left > 0) { session_batch_upload_file(s, buf); return; }
+    if (tagged) { session_tagged_command(s, buf+1); return; }
+
+    // Handle commands after login
+    if (strncmp(buf, "UPLOAD ", 7) == 0) session_start_upload(s, buf+7);
+    else if (strncmp(buf, "RESUME ", 7) == 0) session_resume_upload(s, buf+7);
+    else if (strncmp(buf, "DELTA_UPLOAD ", 13) == 0) session_start_delta(s, buf+13);
+    else if (strncmp(buf, "DOWNLOAD ", 9) == 0) session_start_download(s, buf+9);
+    else if (strncmp(buf, "MUPLOAD ", 8) == 0) session_start_batch_upload(s, buf+8);
+    else if (strncmp(buf, "STRIPE_OPEN ", 12) == 0) session_stripe_open(s, buf+12);
+    else if (strncmp(buf, "STRIPE_COMMIT ", 14) == 0) session_stripe_commit(s, buf+14);
+    else if (strncmp(buf, "STRIPE ", 7) == 0) session_stripe_start(s, buf+7);
+    else if (strncmp(buf, "MDOWNLOAD ", 10) == 0) session_batch_download(s, buf+10);
+    else if (strncmp(buf, "DELETE ", 7) == 0) session_delete(s, buf+7);
+    else if (strncmp(buf, "STAT ", 5) == 0) session_stat(s, buf+5);
+    else if (strcmp(buf, "LIST") == 0) session_list(s);
+    else if (strcmp(buf, "CACHESTATS") == 0) session_cache_stats(s);
+    else if (strcmp(buf, "QUIT") == 0 || strcmp(buf, "EXIT") == 0) s->state = SESS_CLOSED;
+    else send_error(s->fd, "Unknown command");
+}
+
+// Refuses an overlong line like any untagged command, once the tagged ones
+// still running have replied
+static void session_line_too_long(Session *s, Task *t) {
+    (void)t;
+    if (!session_await_inflight(s, 0, session_line_too_long)) return;
+    session_error(s, "", "Line too long");
+}
+
+static int session_step(Session *s) {
+    switch (s->state) {
+    case SESS_AUTH:
+    case SESS_COMMAND: {
+        if (s->batch_open && s->batch_left == 0) {
+            session_finish_batch(s, NULL);
+            if (s->state == SESS_WAIT) return STEP_MORE;
         }
-        else if (strcmp(buf, "QUIT") == 0 || strcmp(buf, "EXIT") == 0) {
-            close(client_fd);
-            return;
+        if (s->op_start && !s->batch_open) {
+            metrics_record(s->op, now_ns() - s->op_start);
+            s->op_start = 0;
+        }
+        int rc = session_read_line(s);
+        if (rc != STEP_MORE) return rc;
+        if (!s->line) {
+            session_line_too_long(s, NULL);
+            return STEP_MORE;
         }
-        else {
-            send_error(client_fd, "Unknown command");
+        char *buf = s->line;
+        size_t r = s->line_len;
+        s->line_len = 0;
+        while (r>0 && (buf[r-1]=='\n' || buf[r-1]=='\r')) { buf[r-1]=0; r--; }
+        if (r==0) return STEP_MORE;
+        // Tagged requests and batch members are timed on their own
+        s->line_at = now_ns();
+        if (!s->batch_open && buf[0] != '#') {
+            s->op = metric_kind(buf);
+            s->op_start = s->line_at;
         }
+        session_command(s, buf);
+        return s->state == SESS_CLOSED ? STEP_CLOSE : STEP_MORE;
+    }
+    case SESS_PAYLOAD:
+        return session_recv_payload(s);
+    case SESS_DELTA:
+        return session_recv_delta(s);
+    case SESS_RESPONSE:
+        return session_send_body(s);
+    case SESS_WAIT: {
+        // Only run once what the session waited for is over
+        Task *t = s->wait_task;
+        void (*resume)(Session *, Task *) = s->resume;
+        s->wait_task = NULL;
+        s->resume = NULL;
+        s->state = SESS_COMMAND;
+        if (resume) resume(s, t);
+        else session_command(s, s->line);
+        return s->state == SESS_CLOSED ? STEP_CLOSE : STEP_MORE;
+    }
+    default:
+        return STEP_CLOSE;
+    }
+}
+
+// Runs the session until it would block, is parked or is finished.
+int session_run(Session *s) {
+    sched_home = s->home;
+    int rc;
+    do {
+        int was = session_transferring(s);
+        rc = session_step(s);
+        if (session_transferring(s) != was) __atomic_add_fetch(&s->user->transfers, was ? -1 : 1, __ATOMIC_RELAXED);
+        if (rc == STEP_MORE && s->state == SESS_WAIT) rc = STEP_PARKED;
+    } while (rc == STEP_MORE);
+    return rc;
+}
+
+void client_service(int client_fd) {
+    // Workers write tagged replies to the socket too and must never block
+    int flags = fcntl(client_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) < 0) { close(client_fd); return; }
+    Session *s = session_new(client_fd);
+    if (!s) { close(client_fd); return; }
+    int rc;
+    while ((rc = session_run(s)) != STEP_CLOSE) {
+        if (rc == STEP_PARKED) { session_block(s); continue; }
+        if (wait_fd(client_fd, rc == STEP_WANT_WRITE ? POLLOUT : POLLIN) != 0) break;
     }
+    session_free(s);
 }
 
 void *client_worker_thread(void *arg) {
@@ -639,19 +4787,241 @@ void *client_worker_thread(void *arg) {
     return NULL;
 }
 
-int main(void) {
+// Reactor mode: connections are non-blocking and parked in one epoll set
+// while idle, so CLIENT_POOL_SIZE threads can serve any number of them.
+// EPOLLONESHOT hands each ready connection to exactly one thread, which
+// re-arms it once the session would block again. A session waiting for a
+// worker is not armed at all; the worker queues it on the ready list
+// (reactor_wake) and the eventfd, also in the set, hands it to a thread.
+// ThreadSanitizer cannot see the ordering the kernel gives the EPOLLONESHOT
+// handoff, so it is spelled out for it.
+#ifdef __SANITIZE_THREAD__
+void __tsan_acquire(void *addr);
+void __tsan_release(void *addr);
+#define HANDOFF_RELEASE(p) __tsan_release(p)
+#define HANDOFF_ACQUIRE(p) __tsan_acquire(p)
+#else
+#define HANDOFF_RELEASE(p) ((void)(p))
+#define HANDOFF_ACQUIRE(p) ((void)(p))
+#endif
+
+static int reactor_epfd = -1;
+
+// Once armed, s belongs to whichever thread gets its next event
+static int reactor_arm(Session *s, int op, int want) {
+    struct epoll_event ev;
+    ev.events = (want == STEP_WANT_WRITE ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    ev.data.ptr = s;
+    int fd = s->fd;
+    HANDOFF_RELEASE(s);
+    return epoll_ctl(reactor_epfd, op, fd, &ev);
+}
+
+void reactor_add(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) { close(fd); return; }
+    Session *s = session_new(fd);
+    if (!s) { close(fd); return; }
+    if (reactor_arm(s, EPOLL_CTL_ADD, STEP_WANT_READ) != 0) { perror("epoll_ctl"); session_free(s); }
+}
+
+// Next session from the ready list; the eventfd counts them, so every
+// successful read takes one
+static Session *reactor_take_ready(void) {
+    uint64_t n;
+    if (read(reactor_wake_fd, &n, sizeof(n)) != sizeof(n)) return NULL;
+    pthread_mutex_lock(&reactor_ready_lock);
+    Session *s = reactor_ready_head;
+    if (s) reactor_ready_head = s->ready_next;
+    if (!reactor_ready_head) reactor_ready_tail = NULL;
+    pthread_mutex_unlock(&reactor_ready_lock);
+    return s;
+}
+
+static void reactor_serve(Session *s) {
+    while (!s->closing) {
+        int rc = session_run(s);
+        if (rc == STEP_PARKED) {
+            if (session_park(s)) continue;
+            return;
+        }
+        if (rc != STEP_CLOSE && reactor_arm(s, EPOLL_CTL_MOD, rc) == 0) return;
+        // Tagged requests still running write to s; the last one wakes it
+        epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, s->fd, NULL);
+        s->closing = 1;
+        s->wait_task = NULL;
+        s->wait_max = 0;
+        if (!session_park(s)) return;
+    }
+    session_free(s);
+}
+
+void *reactor_thread(void *arg) {
+    (void)arg;
+    while (running) {
+        // One event at a time, so that ready connections are spread over
+        // the threads
+        struct epoll_event ev;
+        int n = epoll_wait(reactor_epfd, &ev, 1, -1);
+        if (n <= 0) continue;
+        Session *s = ev.data.ptr ? ev.data.ptr : reactor_take_ready();
+        if (!s) continue;
+        HANDOFF_ACQUIRE(s);
+        reactor_serve(s);
+    }
+    return NULL;
+}
+
+// Lets reactor mode keep thousands of mostly idle connections open
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// --bench-sched: enqueue/dequeue throughput of the task queue with 1 to 64
+// threads, for both schedulers. Each thread submits a burst through
+// push_task, like a client thread would, and takes as many tasks back
+// through pop_task, like a worker. Bursts go to the thread's own deque,
+// except every fourth one, which lands on a neighbour so stealing happens.
+#define BENCH_ROUNDS 20000
+#define BENCH_BURST 16
+
+static void *bench_thread(void *arg) {
+    int self = (int)(intptr_t)arg;
+    Task *hand[BENCH_BURST];
+    Task *own = calloc(BENCH_BURST, sizeof(Task));
+    if (!own) return NULL;
+    for (int i = 0; i < BENCH_BURST; i++) hand[i] = &own[i];
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        sched_home = (self + (r % 4 == 3)) % sched_nqueues;
+        for (int i = 0; i < BENCH_BURST; i++) push_task(hand[i]);
+        // Tasks taken back may belong to other threads; they are re-pushed
+        // next round and every thread's tasks are out of the queues at the end
+        for (int i = 0; i < BENCH_BURST; i++) hand[i] = pop_task(self);
+    }
+    return own;
+}
+
+static void sched_bench(void) {
+    static const char *names[] = { "steal", "global" };
+    printf("%-8s %7s %12s\n", "sched", "threads", "Mops/s");
+    for (int mode = SCHED_STEAL; mode <= SCHED_GLOBAL; mode++) {
+        for (int n = 1; n <= 64; n *= 2) {
+            sched_mode = mode;
+            sched_init(n);
+            pthread_t th[64];
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (int i = 0; i < n; i++) pthread_create(&th[i], NULL, bench_thread, (void *)(intptr_t)i);
+            void *own[64];
+            for (int i = 0; i < n; i++) pthread_join(th[i], &own[i]);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            for (int i = 0; i < n; i++) free(own[i]);
+            double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            double ops = 2.0 * n * BENCH_ROUNDS * BENCH_BURST;
+            printf("%-8s %7d %12.2f\n", names[mode], n, ops / secs / 1e6);
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--reactor] [--io=posix|uring] [--engine=plain|dedup] [--sched=steal|global]\n"
+                    "       [--rescan|--rescan-serve] [--cache=<MB>] [--stats-file=<path>]\n", prog);
+    fprintf(stderr, "       %s --bench-sched\n", prog);
+    fprintf(stderr, "  --reactor       serve connections from an epoll event loop\n");
+    fprintf(stderr, "  --io=uring      submit storage I/O through io_uring (falls back to posix)\n");
+    fprintf(stderr, "  --engine=dedup  store files as deduplicated content-defined chunks\n");
+    fprintf(stderr, "  --sched=global  one shared task queue instead of per-worker deques\n");
+    fprintf(stderr, "  --rescan        rebuild file indexes from the storage tree before serving\n");
+    fprintf(stderr, "  --rescan-serve  rebuild them while serving users already scanned\n");
+    fprintf(stderr, "  --cache=<MB>    memory for recently downloaded files (default %d, 0 disables)\n", CACHE_DEFAULT_MB);
+    fprintf(stderr, "  --stats-file=<path>  write the STATS report there every %d seconds\n", STATS_DUMP_INTERVAL);
+    fprintf(stderr, "  --bench-sched   measure task queue throughput and exit\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int want_uring = 0;
+    const char *want_engine = NULL;
+    const char *stats_file = NULL;
+    enum { RESCAN_NONE, RESCAN_WAIT, RESCAN_SERVE } rescan = RESCAN_NONE;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reactor") == 0) reactor_mode = 1;
+        else if (strcmp(argv[i], "--io=posix") == 0) want_uring = 0;
+        else if (strcmp(argv[i], "--io=uring") == 0) want_uring = 1;
+        else if (strncmp(argv[i], "--engine=", 9) == 0) want_engine = argv[i] + 9;
+        else if (strcmp(argv[i], "--sched=steal") == 0) sched_mode = SCHED_STEAL;
+        else if (strcmp(argv[i], "--sched=global") == 0) sched_mode = SCHED_GLOBAL;
+        else if (strcmp(argv[i], "--rescan") == 0) rescan = RESCAN_WAIT;
+        else if (strcmp(argv[i], "--rescan-serve") == 0) rescan = RESCAN_SERVE;
+        else if (strncmp(argv[i], "--stats-file=", 13) == 0) stats_file = argv[i] + 13;
+        else if (strncmp(argv[i], "--cache=", 8) == 0) cache.budget = (size_t)strtoull(argv[i] + 8, NULL, 10) << 20;
+        else if (strcmp(argv[i], "--bench-sched") == 0) { sched_bench(); return 0; }
+        else usage(argv[0]);
+    }
+    sched_init(WORKER_POOL_SIZE);
+
+    if (want_uring && storage_use_uring() != 0) {
+        fprintf(stderr, "io_uring unavailable (%s), using posix storage\n", strerror(errno));
+    }
+    printf("Storage backend: %s\n", storage->name);
+
     signal(SIGINT, sigint_handler);
-    ensure_dir(STORAGE_DIR); ensure_dir(TMP_DIR);
+    // A client that disconnects mid-download must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    ensure_dir(STORAGE_DIR);
+    staging_sweep();
+    if (storage_select_engine(want_engine) != 0) exit(EXIT_FAILURE);
+    printf("Storage engine: %s\n", engine->name);
+
+    user_table_init();
+    if (meta_load() != 0) exit(EXIT_FAILURE);
 
-    // Create some test users
+    // Create the test users unless they were restored
     user_create("hello", "hello1234");
     user_create("test", "test123");
 
+    // Without metadata an existing tree is adopted by scanning it
+    if (!meta_restored && rescan == RESCAN_NONE) rescan = RESCAN_WAIT;
+    if (rescan != RESCAN_NONE) index_prepare();
+    if (rescan == RESCAN_WAIT) index_rebuild(NULL);
+
+    pthread_t meta_tid;
+    pthread_create(&meta_tid, NULL, meta_thread, NULL);
+    metrics_started = time(NULL);
+    if (stats_file) {
+        pthread_t stats_tid;
+        pthread_create(&stats_tid, NULL, stats_dump_thread, (void *)stats_file);
+    }
+    if (rescan == RESCAN_SERVE) {
+        pthread_t index_tid;
+        pthread_create(&index_tid, NULL, index_rebuild, NULL);
+    }
+
     pthread_t workers[WORKER_POOL_SIZE];
-    for (int i=0;i<WORKER_POOL_SIZE;i++) pthread_create(&workers[i], NULL, worker_thread, NULL);
+    for (int i=0;i<WORKER_POOL_SIZE;i++) pthread_create(&workers[i], NULL, worker_thread, (void *)(intptr_t)i);
+
+    tx_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (tx_epfd < 0) perror_exit("epoll_create1");
+    pthread_t tx_tid;
+    pthread_create(&tx_tid, NULL, tx_thread, NULL);
 
     pthread_t clients[CLIENT_POOL_SIZE];
-    for (int i=0;i<CLIENT_POOL_SIZE;i++) pthread_create(&clients[i], NULL, client_worker_thread, NULL);
+    if (reactor_mode) {
+        raise_fd_limit();
+        reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor_epfd < 0) perror_exit("epoll_create1");
+        reactor_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+        if (reactor_wake_fd < 0) perror_exit("eventfd");
+        struct epoll_event wake = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, reactor_wake_fd, &wake) != 0) perror_exit("epoll_ctl");
+        for (int i=0;i<CLIENT_POOL_SIZE;i++) pthread_create(&clients[i], NULL, reactor_thread, NULL);
+    } else {
+        for (int i=0;i<CLIENT_POOL_SIZE;i++) pthread_create(&clients[i], NULL, client_worker_thread, NULL);
+    }
 
     int listenfd = socket(AF_INET, SOCK_STREAM, 0);
     if (listenfd < 0) perror_exit("socket");
@@ -666,7 +5036,12 @@ int main(void) {
         struct sockaddr_in cli; socklen_t clilen = sizeof(cli);
         int conn = accept(listenfd, (struct sockaddr*)&cli, &clilen);
         if (conn < 0) { if (errno==EINTR) break; perror("accept"); continue; }
-        push_client_fd(conn);
+        // Replies are written whole, so Nagle would only hold back the last
+        // segment of each one until the client's delayed ACK
+        int nodelay = 1;
+        setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        if (reactor_mode) reactor_add(conn);
+        else push_client_fd(conn);
     }
 
     close(listenfd);
@@ -1,22 +1,16 @@
 #!/bin/bash
-
+# Full command mix against a fresh server; fails on any ERR or dropped connection
 echo "=== Testing Dropbox Client ==="
-
-echo "Test: Complete workflow in single session"
-{
-    echo "LOGIN hello hello1234"
-    sleep 1
-    echo "UPLOAD test.txt"
-    sleep 2
-    echo "LIST"
-    sleep 1
-    echo "DOWNLOAD test.txt"
-    sleep 2
-    echo "DELETE test.txt"
-    sleep 1
-    echo "LIST"
-    sleep 1
-    echo "QUIT"
-} | nc -q 1 localhost 8080
-
-echo "=== Test completed ==="
+gcc -Wall -Wextra -O2 -pthread -o dropbox_server dropbox_server.c || exit 1
+gcc -Wall -Wextra -O2 -pthread -o dropbox_loadgen dropbox_loadgen.c -lm || exit 1
+./dropbox_server &
+SERVER_PID=$!
+sleep 1
+./dropbox_loadgen --clients=4 --duration=5 --sizes=1k-1m \
+    --mix=signup:2,login:3,upload:25,download:40,list:10,stat:10,delete:10 \
+    --json=loadgen_client.json
+RC=$?
+kill $SERVER_PID
+wait $SERVER_PID 2>/dev/null
+echo "=== Test completed (loadgen exit $RC) ==="
+exit $RC
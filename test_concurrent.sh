@@ -1,16 +1,16 @@
 #!/bin/bash
+# Many simultaneous users against the epoll server. Pass a results file from an
+# earlier build as $1 to fail on a throughput or p99 regression.
 echo "=== Testing Multiple Clients ==="
-./dropbox_server &
+gcc -Wall -Wextra -O2 -pthread -o dropbox_server dropbox_server.c || exit 1
+gcc -Wall -Wextra -O2 -pthread -o dropbox_loadgen dropbox_loadgen.c -lm || exit 1
+./dropbox_server --reactor &
 SERVER_PID=$!
-sleep 2
-echo "Starting multiple clients..."
-{
-    echo "LOGIN hello hello1234"
-    sleep 1
-    echo "LIST"
-    sleep 1
-    echo "QUIT"
-} | nc -q 1 localhost 8080 &
-sleep 3
+sleep 1
+./dropbox_loadgen --clients=64 --duration=10 --warmup=2 --sizes=4k-256k \
+    --json=loadgen_concurrent.json ${1:+--baseline="$1"}
+RC=$?
 kill $SERVER_PID
-echo "=== Concurrent test completed ==="
+wait $SERVER_PID 2>/dev/null
+echo "=== Concurrent test completed (loadgen exit $RC) ==="
+exit $RC
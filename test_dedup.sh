@@ -0,0 +1,22 @@
+#!/bin/bash
+# Dedup engine with racing commits: half the clients keep replacing the same
+# two files of one shared account while the rest store the same content under
+# their own accounts. Fails on any ERR or download that differs from the upload.
+echo "=== Testing Concurrent Dedup Commits ==="
+gcc -Wall -Wextra -O2 -pthread -o dropbox_server dropbox_server.c || exit 1
+gcc -Wall -Wextra -O2 -pthread -o dropbox_loadgen dropbox_loadgen.c -lm || exit 1
+SERVER=$PWD/dropbox_server
+DIR=$(mktemp -d)
+(cd "$DIR" && exec "$SERVER" --reactor --engine=dedup) &
+SERVER_PID=$!
+sleep 1
+./dropbox_loadgen --clients=16 --shared=8 --files=2 --duration=5 --sizes=4k-512k \
+    --mix=upload:60,download:40 | tee loadgen_dedup.txt
+RC=${PIPESTATUS[0]}
+ERRORS=$(awk '$1 == "total" { print $3 }' loadgen_dedup.txt)
+[ "${ERRORS:-1}" = 0 ] || RC=1
+kill $SERVER_PID
+wait $SERVER_PID 2>/dev/null
+rm -rf "$DIR"
+echo "=== Dedup test completed (exit $RC) ==="
+exit $RC
@@ -1,9 +1,24 @@
 #!/bin/bash
+# Server under valgrind while the load generator exercises every command;
+# fails on any loadgen error or valgrind report
 echo "=== Testing for Memory Leaks ==="
-gcc -Wall -Wextra -pthread -g -o dropbox_server dropbox_server.c
-valgrind --leak-check=full ./dropbox_server &
+gcc -Wall -Wextra -pthread -g -o dropbox_server dropbox_server.c || exit 1
+gcc -Wall -Wextra -O2 -pthread -o dropbox_loadgen dropbox_loadgen.c -lm || exit 1
+rm -f valgrind.log
+# Thread stacks of the killed server are only possibly lost
+valgrind --leak-check=full --errors-for-leak-kinds=definite --error-exitcode=3 \
+    --log-file=valgrind.log ./dropbox_server &
 SERVER_PID=$!
-sleep 2
+sleep 5
+./dropbox_loadgen --clients=4 --duration=10 --sizes=1k-256k \
+    --mix=signup:2,login:3,upload:25,download:40,list:10,stat:10,delete:10
+RC=$?
 kill $SERVER_PID
-echo "=== Memory test completed ==="
-
+wait $SERVER_PID
+[ $? -eq 3 ] && RC=1
+if ! grep -q "ERROR SUMMARY: 0 errors" valgrind.log; then
+    cat valgrind.log
+    RC=1
+fi
+echo "=== Memory test completed (exit $RC) ==="
+exit $RC
@@ -1,9 +1,22 @@
 #!/bin/bash
+# ThreadSanitizer build of the server under concurrent load; fails on any report
 echo "=== Testing for Race Conditions ==="
-gcc -Wall -Wextra -pthread -g -fsanitize=thread -o dropbox_server dropbox_server.c
-./dropbox_server &
-SERVER_PID=$!
-sleep 2
-kill $SERVER_PID
-echo "=== Race condition test completed ==="
-
+gcc -Wall -Wextra -pthread -g -fsanitize=thread -o dropbox_server dropbox_server.c || exit 1
+gcc -Wall -Wextra -O2 -pthread -o dropbox_loadgen dropbox_loadgen.c -lm || exit 1
+rm -f tsan.log.*
+RC=0
+for MODE in "" --reactor; do
+    TSAN_OPTIONS="log_path=tsan.log suppressions=tsan.supp" ./dropbox_server $MODE &
+    SERVER_PID=$!
+    sleep 2
+    ./dropbox_loadgen --clients=16 --duration=5 --sizes=1k-256k \
+        --mix=signup:2,login:3,upload:30,download:40,list:5,stat:10,delete:10 || RC=1
+    kill $SERVER_PID
+    wait $SERVER_PID
+done
+if grep -q "WARNING: ThreadSanitizer" tsan.log.* 2>/dev/null; then
+    cat tsan.log.*
+    RC=1
+fi
+echo "=== Race condition test completed (exit $RC) ==="
+exit $RC